@@ -0,0 +1,216 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "ac.h"
+
+// states with a full transition table, 1k each
+#define DENSE_STATES 512
+
+// The trie is first built with linked edge lists kept sorted by byte, then
+// renumbered breadth first into the final layout.
+struct trie {
+  uint32_t *first;           // first edge of each node, or 0
+  uint32_t *next;            // next edge of the same node, or 0
+  unsigned char *byte;
+  uint32_t *to;
+  uint32_t nodes;
+  uint32_t edges;            // edge 0 is unused
+};
+
+static uint32_t trie_child(struct trie *t, uint32_t node, unsigned char b) {
+  for (uint32_t e = t->first[node]; e; e = t->next[e]) {
+    if (t->byte[e] == b) return t->to[e];
+    if (t->byte[e] > b) break;
+  }
+  return 0;
+}
+
+static uint32_t trie_add(struct trie *t, uint32_t node, unsigned char b) {
+  uint32_t *link = t->first + node;
+  while (*link && t->byte[*link] < b)
+    link = t->next + *link;
+  if (*link && t->byte[*link] == b)
+    return t->to[*link];
+  uint32_t e = t->edges++;
+  uint32_t child = t->nodes++;
+  t->first[child] = 0;
+  t->byte[e] = b;
+  t->to[e] = child;
+  t->next[e] = *link;
+  *link = e;
+  return child;
+}
+
+static void *alloc_array(size_t n, size_t size) {
+  return malloc(n ? n * size : 1);
+}
+
+int ac_init(struct ac *a, char **patterns, const size_t *len, int count,
+            const unsigned char *fold) {
+  size_t total = 1;
+  for (int i = 0; i < count; i++)
+    total += len[i];
+  struct trie t;
+  t.first = alloc_array(total, sizeof(uint32_t));
+  t.next = alloc_array(total, sizeof(uint32_t));
+  t.byte = alloc_array(total, 1);
+  t.to = alloc_array(total, sizeof(uint32_t));
+  int *terminal = alloc_array(total, sizeof(int));
+  uint32_t *order = alloc_array(total, sizeof(uint32_t));
+  uint32_t *id = alloc_array(total, sizeof(uint32_t));
+  uint32_t *fail = alloc_array(total, sizeof(uint32_t));
+  uint32_t *depth = alloc_array(total, sizeof(uint32_t));
+  int *out = alloc_array(total, sizeof(int));
+  memset(a, 0, sizeof(*a));
+  int res = -1;
+  if (!t.first || !t.next || !t.byte || !t.to || !terminal || !order ||
+      !id || !fail || !depth || !out)
+    goto done;
+
+  t.nodes = 1;
+  t.edges = 1;
+  t.first[0] = 0;
+  for (size_t i = 0; i < total; i++)
+    terminal[i] = -1;
+  for (int i = 0; i < count; i++) {
+    uint32_t node = 0;
+    for (size_t k = 0; k < len[i]; k++) {
+      unsigned char b = patterns[i][k];
+      node = trie_add(&t, node, fold ? fold[b] : b);
+    }
+    if (terminal[node] < 0)
+      terminal[node] = i;
+  }
+
+  // breadth first order, failure links and outputs, by trie node
+  uint32_t head = 0, tail = 0;
+  order[tail++] = 0;
+  fail[0] = 0;
+  depth[0] = 0;
+  out[0] = -1;
+  while (head < tail) {
+    uint32_t node = order[head];
+    id[node] = head++;
+    for (uint32_t e = t.first[node]; e; e = t.next[e]) {
+      uint32_t child = t.to[e];
+      uint32_t f = 0;
+      if (node) {
+        for (f = fail[node]; f && !trie_child(&t, f, t.byte[e]); f = fail[f]);
+        f = trie_child(&t, f, t.byte[e]);
+      }
+      fail[child] = f;
+      depth[child] = depth[node] + 1;
+      out[child] = terminal[child] >= 0 ? terminal[child] : out[f];
+      order[tail++] = child;
+    }
+  }
+
+  // the final layout, by state
+  uint32_t n = t.nodes;
+  a->state_count = n;
+  a->dense_count = n < DENSE_STATES ? n : DENSE_STATES;
+  uint32_t sparse = n - a->dense_count;
+  a->dense = alloc_array(a->dense_count, sizeof(*a->dense));
+  a->edge_start = alloc_array(sparse + 1, sizeof(uint32_t));
+  a->edge_byte = alloc_array(t.edges, 1);
+  a->edge_to = alloc_array(t.edges, sizeof(uint32_t));
+  a->fail = alloc_array(n, sizeof(uint32_t));
+  a->depth = alloc_array(n, sizeof(uint32_t));
+  a->out = alloc_array(n, sizeof(int));
+  if (!a->dense || !a->edge_start || !a->edge_byte || !a->edge_to ||
+      !a->fail || !a->depth || !a->out)
+    goto done;
+  uint32_t edges = 0;
+  for (uint32_t s = 0; s < n; s++) {
+    uint32_t node = order[s];
+    a->fail[s] = id[fail[node]];
+    a->depth[s] = depth[node];
+    a->out[s] = out[node];
+    if (s < a->dense_count) {
+      // the failure state comes earlier and already has its table
+      if (s)
+        memcpy(a->dense[s], a->dense[a->fail[s]], sizeof(*a->dense));
+      else
+        memset(a->dense[s], 0, sizeof(*a->dense));
+      for (uint32_t e = t.first[node]; e; e = t.next[e])
+        a->dense[s][t.byte[e]] = id[t.to[e]];
+      // so that the scan needs no folding near the root
+      for (int b = 0; b < 256 && fold; b++)
+        a->dense[s][b] = a->dense[s][fold[b]];
+    } else {
+      a->edge_start[s - a->dense_count] = edges;
+      for (uint32_t e = t.first[node]; e; e = t.next[e]) {
+        a->edge_byte[edges] = t.byte[e];
+        a->edge_to[edges++] = id[t.to[e]];
+      }
+    }
+  }
+  a->edge_start[sparse] = edges;
+  a->pattern_count = count;
+  a->pattern_len = len;
+  a->fold = fold;
+  res = 0;
+
+done:
+  free(t.first);
+  free(t.next);
+  free(t.byte);
+  free(t.to);
+  free(terminal);
+  free(order);
+  free(id);
+  free(fail);
+  free(depth);
+  free(out);
+  return res;
+}
+
+static inline uint32_t next_state(const struct ac *a, uint32_t s,
+                                  unsigned char b) {
+  unsigned char f = s >= a->dense_count && a->fold ? a->fold[b] : b;
+  while (s >= a->dense_count) {
+    uint32_t k = s - a->dense_count;
+    for (uint32_t e = a->edge_start[k]; e < a->edge_start[k + 1]; e++) {
+      if (a->edge_byte[e] == f) return a->edge_to[e];
+      if (a->edge_byte[e] > f) break;
+    }
+    s = a->fail[s];
+  }
+  return a->dense[s][b];
+}
+
+// Once a match is found, the scan goes on only while the current state
+// still stands for a prefix starting no later than it, as only that can
+// turn into a match further left or a longer one at the same place.
+char *ac_find(const struct ac *a, const char *p, size_t len, int *which) {
+  const unsigned char *h = (const unsigned char *)p;
+  uint32_t (*dense)[256] = a->dense;
+  uint32_t s = 0;
+  int best = -1;
+  size_t best_start = 0;
+  size_t i = 0;
+  while (i < len) {
+    if (!s) {
+      if (best >= 0) break;
+      // most bytes start no pattern at all
+      while (i < len && !dense[0][h[i]])
+        i++;
+      if (i == len) break;
+    }
+    s = next_state(a, s, h[i++]);
+    if (best >= 0 && i - a->depth[s] > best_start)
+      break;
+    int o = a->out[s];
+    if (o >= 0) {
+      size_t start = i - a->pattern_len[o];
+      if (best < 0 || start < best_start ||
+          (start == best_start && a->pattern_len[o] > a->pattern_len[best])) {
+        best = o;
+        best_start = start;
+      }
+    }
+  }
+  if (best < 0) return 0;
+  *which = best;
+  return (char *)p + best_start;
+}
@@ -0,0 +1,40 @@
+#ifndef AC_H
+#define AC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Aho-Corasick automaton over a set of patterns.  States are numbered in
+// breadth first order, so the ones near the root, where the scan spends
+// nearly all its time, come first and get a full transition table.  The
+// deeper ones only keep their own edges, sorted by byte, and a failure
+// link.
+struct ac {
+  int pattern_count;
+  const size_t *pattern_len;
+
+  uint32_t state_count;
+  uint32_t dense_count;
+  uint32_t (*dense)[256];
+
+  uint32_t *edge_start;      // edges of state dense_count + k start at
+  unsigned char *edge_byte;  // edge_start[k] and end at edge_start[k + 1]
+  uint32_t *edge_to;
+
+  uint32_t *fail;
+  uint32_t *depth;
+  int *out;                  // longest pattern ending in the state, or -1
+  const unsigned char *fold; // the table bytes are taken through, or NULL
+};
+
+// Builds the automaton; patterns need not be NUL terminated and must not be
+// empty.  With a fold table, like that of search_fold(), patterns and text
+// are both taken as it maps their bytes.  Returns -1 if out of memory.
+int ac_init(struct ac *a, char **patterns, const size_t *len, int count,
+            const unsigned char *fold);
+
+// Returns the leftmost match in p[0..len), the longest of those starting
+// there, and stores the index of its pattern; or returns NULL.
+char *ac_find(const struct ac *a, const char *p, size_t len, int *which);
+
+#endif
@@ -6,15 +6,56 @@
 #include <string.h>
 #include <unistd.h>
 
+// "--window=" or "--lines=" and a value like "<n>" or "<n>:<m>", which
+// goes into LESSOPEN, so it has to be digits and colons only
+char *window_value(char *arg, char *prefix) {
+  size_t len = strlen(prefix);
+  if (strncmp(arg, prefix, len))
+    return 0;
+  char *value = arg + len;
+  if (!*value || value[strspn(value, "0123456789:")]) {
+    fprintf(stderr, "anno: bad window \"%s\"\n", arg);
+    exit(1);
+  }
+  return value;
+}
+
 int main(int argc, char *argv[]) {
-  setenv("LESSOPEN", "||-annofilter %s", 1);
-  char **args = malloc((argc + 2) * sizeof(char*));
+  // The window options come first, and the rest goes to less.  A window
+  // annotates only those bytes or lines of each file, so less can open
+  // a huge file there without annofilter streaming all of it.
+  char *window = 0, *lines = 0;
+  int first = 1;
+  for (; first < argc; first++) {
+    char *value;
+    if ((value = window_value(argv[first], "--window=")))
+      window = value;
+    else if ((value = window_value(argv[first], "--lines=")))
+      lines = value;
+    else
+      break;
+  }
+  if (window && lines) {
+    fprintf(stderr, "anno: window is either bytes or lines\n");
+    return 1;
+  }
+  char lessopen[128];
+  if (window)
+    snprintf(lessopen, sizeof(lessopen),
+             "||-annofilter --coalesce -w %s %%s", window);
+  else if (lines) // -x finds the lines with <file>.tuidx when there is one
+    snprintf(lessopen, sizeof(lessopen),
+             "||-annofilter --coalesce -x -l %s %%s", lines);
+  else
+    snprintf(lessopen, sizeof(lessopen), "||-annofilter --coalesce %%s");
+  setenv("LESSOPEN", lessopen, 1);
+  char **args = malloc((argc - first + 3) * sizeof(char*));
   args[0] = "less";
   args[1] = "-R";
-  for (int i = 1; i < argc; i++) {
-    args[i + 1] = argv[i];
+  for (int i = first; i < argc; i++) {
+    args[i - first + 2] = argv[i];
   }
-  args[argc + 1] = 0;
+  args[argc - first + 2] = 0;
   execvp("less", args);
   fprintf(stderr, "execvp failed: %s (%d)\n", strerror(errno), errno);
   return errno;
@@ -1,3 +1,5 @@
+#define _DEFAULT_SOURCE
+
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
@@ -6,8 +8,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include "decode.h"
+#include "input.h"
+#include "reader.h"
+#include "timing.h"
+#include "tuidx.h"
+#include "utf8.h"
+#include "util.h"
+
 enum condition {OK, CONTROL, ENCODING, OVERLONG, HIGH_CONTROL,
                 TRAILING_WHITESPACE};
 
@@ -20,121 +32,137 @@ char *markup[] = {
   "\033[43m",
 };
 
+size_t markup_len[sizeof(markup) / sizeof(markup[0])];
+
 char *help_text =
-  "annofilter [-h]\n"
+  "annofilter [-hx] [-w <offset>[:<length>] | -l <line>[:<count>]]\n"
+  "           [--buffer-size=<bytes>] [--coalesce[=<len>]] [--no-decompress]\n"
+  "           [--no-mmap] [--no-uring] [--stats-timing] [--] <file>*\n"
   "Annotates encoding and other text problems with color codes for less.\n"
-  "Reads stdin and writes stdout.\n"
-  "  -h            Print this help text\n";
-
-char *foreground_red = "\033[31m";
-char *foreground_green = "\033[32m";
-char *foreground_yellow = "\033[33m";
-char *foreground_reset = "\033[39m";
-char *attribute_reset = "\033[0m";
-char *bold = "\033[1m";
-
-int use_color = 1;
-
-void color_vprintf(char *color, char *fmt, va_list ap) {
-  if (use_color) fprintf(stderr, "%s", color);
-  vfprintf(stderr, fmt, ap);
-  if (use_color) fprintf(stderr, "%s", foreground_reset);
-}
-
-void err_vprintf(char *fmt, va_list ap) {
-  color_vprintf(foreground_red, fmt, ap);
-}
-
-void info_vprintf(char *fmt, va_list ap) {
-  color_vprintf(foreground_green, fmt, ap);
-}
-
-void warn_vprintf(char *fmt, va_list ap) {
-  color_vprintf(foreground_yellow, fmt, ap);
-}
-
-void err_printf(char *fmt, ...) {
-  va_list ap;
-  va_start(ap, fmt);
-  err_vprintf(fmt, ap);
-  va_end(ap);
-}
-
-void info_printf(char *fmt, ...) {
-  va_list ap;
-  va_start(ap, fmt);
-  info_vprintf(fmt, ap);
-  va_end(ap);
-}
-
-void warn_printf(char *fmt, ...) {
-  va_list ap;
-  va_start(ap, fmt);
-  warn_vprintf(fmt, ap);
-  va_end(ap);
-}
-
-void errno_printf(char *fmt, ...) {
-  va_list ap;
-  va_start(ap, fmt);
-  err_vprintf(fmt, ap);
-  va_end(ap);
-  err_printf(": %s (%d)\n", strerror(errno), errno);
-  exit(errno);
-}
-
-void exit_printf(char *fmt, ...) {
-  va_list ap;
-  va_start(ap, fmt);
-  err_vprintf(fmt, ap);
-  va_end(ap);
-  exit(1);
-}
-
-long str2long(char *str) {
-  char *end;
-  long res = strtol(str, &end, 10);
-  if (!*str || *end)
-    exit_printf("cannot convert \"%s\" to long\n", str);
-  return res;
-}
-
-int file4read(char *name) {
-  int fd = open(name, O_RDONLY);
-  if (fd == -1)
-    errno_printf("cannot open file \"%s\"", name);
-  return fd;
-}
-
-void *allocate(int size) {
-  char *res = malloc(size);
-  if (!res)
-    exit_printf("cannot allocate %d bytes\n", size);
-  return res;
-}
+  "Reads stdin or named files, decompressing gzip and zstd ones outside of\n"
+  "windows, and writes stdout.\n"
+  "  -h            Print this help text\n"
+  "  -w <offset>[:<length>]\n"
+  "                Annotate only the lines from byte <offset> of a regular\n"
+  "                file, <length> bytes of them or up to the end\n"
+  "  -l <line>[:<count>]\n"
+  "                Annotate only the lines from line <line> of a regular\n"
+  "                file on, <count> of them or up to the end\n"
+  "  -x            Find the lines of -l with the <file>.tuidx index file\n"
+  "  --buffer-size=<bytes>\n"
+  "                Read files in pieces of up to <bytes>, by default 128k,\n"
+  "                or 1M when the first file is big and read, not mapped\n"
+  "  --coalesce[=<len>]\n"
+  "                Write a run of more than <len> (default 16) bad bytes of\n"
+  "                one kind as its first bytes and its length, like\n"
+  "                <c3 a4 e4 e4 e4 e4 e4 e4 \u00d712000>\n"
+  "  --no-decompress\n"
+  "                Take compressed files as they are\n"
+  "  --no-mmap     Read regular files instead of mapping them\n"
+  "  --no-uring    Read ahead with a thread instead of io_uring\n"
+  "  --stats-timing\n"
+  "                Report to stderr at exit and on SIGUSR1 how long reading,\n"
+  "                decompressing, annotating, writing and moving what is left\n"
+  "                of a buffer took, in how many calls and on how many bytes\n";
+
+int use_decompress = 1;
+int use_mmap = 1;
+int use_uring = 1;
+long window_offset = -1;
+long window_len = -1;
+long window_line = 0;        // from 1, 0 for none
+long window_lines = -1;
+int use_index = 0;
+long coalesce_len = 0;       // 0 for no coalescing
 
 void parse_options(int argc, char **argv) {
   while (1) {
     static struct option long_options[] =
       {
        {"help", no_argument, 0, 'h'},
+       {"window", required_argument, 0, 'w'},
+       {"lines", required_argument, 0, 'l'},
+       {"index", no_argument, 0, 'x'},
+       {"buffer-size", required_argument, 0, 'K'},
+       {"coalesce", optional_argument, 0, 'C'},
+       {"no-decompress", no_argument, 0, 'Z'},
+       {"no-mmap", no_argument, 0, 'M'},
+       {"no-uring", no_argument, 0, 'U'},
+       {"stats-timing", no_argument, 0, 'T'},
        {}
       };
     int option_index = 0;
-    int c = getopt_long(argc, argv, "h", long_options, &option_index);
+    int c = getopt_long(argc, argv, "hl:w:x", long_options, &option_index);
     if (c == -1) break;
     switch (c) {
     case 'h':
       fprintf(stderr, "%s", help_text);
       exit(0);
+    case 'w': {
+      char *colon = strchr(optarg, ':');
+      if (colon) {
+        *colon = 0;
+        window_len = str2long(colon + 1);
+      }
+      window_offset = str2long(optarg);
+      if (window_offset < 0 || (colon && window_len < 0))
+        exit_printf("window must not be negative\n");
+      break;
+    }
+    case 'l': {
+      char *colon = strchr(optarg, ':');
+      if (colon) {
+        *colon = 0;
+        window_lines = str2long(colon + 1);
+      }
+      window_line = str2long(optarg);
+      if (window_line < 1 || (colon && window_lines < 1))
+        exit_printf("lines are counted from 1\n");
+      break;
+    }
+    case 'x':
+      use_index = 1;
+      break;
+    case 'K': {
+      long len = str2long(optarg);
+      if (len < 4096 || len > 1 << 30)
+        exit_printf("buffer size must be from 4096 bytes to 1G\n");
+      reader_buffer_len = len;
+      break;
+    }
+    case 'C':
+      coalesce_len = optarg ? str2long(optarg) : 16;
+      if (coalesce_len < 1)
+        exit_printf("coalesced runs must be at least 1 byte long\n");
+      break;
+    case 'Z':
+      use_decompress = 0;
+      break;
+    case 'M':
+      use_mmap = 0;
+      break;
+    case 'U':
+      use_uring = 0;
+      break;
+    case 'T':
+      timing_enabled = 1;
+      break;
     }
   }
 }
 
-char buffer[65536];
-int buffer_out = 0;
-int buffer_pos = 0;
-int buffer_len = 65536;
+// for reads outside of the reader, of --buffer-size or 64k
+char *read_buffer;
+char *buffer;
+size_t buffer_out = 0;
+size_t buffer_pos = 0;
+size_t buffer_len;
+long input_left = -1;        // bytes left to read in a window, -1 for all
+// the files in argv are read ahead, outside of windows
+struct reader *input_reader = 0;
+// the file at hand if it is compressed
+struct decoder decoder;
+int decoding = 0;
 
 int last_byte_nl = 0;
 int last_byte_cr = 0;
@@ -142,99 +170,182 @@ int last_byte_whitespace = 0;
 
 enum condition current_condition = OK;
 
-void flush_output(int index) {
+// Output is collected here and written with one write() when full.  Long
+// clean stretches of input are not copied but written along with it.
+char out_buffer[1 << 18];
+size_t out_len = 0;
+
+const char hex_digits[] = "0123456789abcdef";
+
+void init_markup() {
+  for (int i = 0; i < sizeof(markup) / sizeof(markup[0]); i++)
+    markup_len[i] = strlen(markup[i]);
+}
+
+void write_all(struct iovec *iov, int count) {
+  while (count) {
+    uint64_t start = timing_start();
+    timing_syscall();
+    ssize_t len = writev(1, iov, count);
+    timing_end(TIMING_WRITE, start, len > 0 ? len : 0);
+    if (len == -1) {
+      if (errno == EINTR) continue;
+      errno_printf("cannot write");
+    }
+    while (count && len >= iov->iov_len) {
+      len -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count) {
+      iov->iov_base = (char *)iov->iov_base + len;
+      iov->iov_len -= len;
+    }
+  }
+}
+
+void out_flush() {
+  struct iovec iov = {out_buffer, out_len};
+  write_all(&iov, 1);
+  out_len = 0;
+}
+
+void out_write(char *p, size_t len) {
+  if (out_len + len <= sizeof(out_buffer)) {
+    memcpy(out_buffer + out_len, p, len);
+    out_len += len;
+    return;
+  }
+  if (len < sizeof(out_buffer) / 2) {
+    out_flush();
+    memcpy(out_buffer, p, len);
+    out_len = len;
+    return;
+  }
+  struct iovec iov[2] = {{out_buffer, out_len}, {p, len}};
+  write_all(iov, 2);
+  out_len = 0;
+}
+
+void out_markup(enum condition cond) {
+  out_write(markup[cond], markup_len[cond]);
+}
+
+// With --coalesce, the bad bytes of a run are held here until it ends,
+// up to the length that is still written byte by byte.
+char *run_bytes = 0;
+long run_len = 0;
+enum condition run_condition = OK;
+
+#define RUN_PREVIEW 8
+
+void run_end() {
+  if (!run_len) return;
+  if (run_condition != current_condition)
+    out_markup(run_condition);
+  current_condition = run_condition;
+  long n = run_len <= coalesce_len ? run_len : RUN_PREVIEW;
+  if (n > coalesce_len)
+    n = coalesce_len;
+  char *out = out_buffer + out_len;
+  for (long i = 0; i < n; i++) {
+    // a long run written byte by byte may not fit in one buffer
+    if (out - out_buffer + 32 > sizeof(out_buffer)) {
+      out_len = out - out_buffer;
+      out_flush();
+      out = out_buffer;
+    }
+    int ch = run_bytes[i] & 255;
+    *out++ = i && n < run_len ? ' ' : '<';
+    *out++ = hex_digits[ch >> 4];
+    *out++ = hex_digits[ch & 15];
+    if (n == run_len)
+      *out++ = '>';
+  }
+  out_len = out - out_buffer;
+  if (n < run_len)
+    out_len += sprintf(out, " \u00d7%ld>", run_len);
+  run_len = 0;
+}
+
+void flush_output(size_t index) {
   if (index > buffer_out) {
-    if (current_condition != OK) printf("%s", markup[OK]);
+    run_end();
+    if (current_condition != OK) out_markup(OK);
     current_condition = OK;
-    fwrite(buffer + buffer_out, 1, index - buffer_out, stdout);
+    out_write(buffer + buffer_out, index - buffer_out);
     buffer_out = index;
   }
 }
 
-void bad_preface(enum condition cond, int index) {
+void bad_preface(enum condition cond, size_t index) {
   flush_output(index);
-  if (cond != current_condition) {
-    printf("%s", markup[cond]);
-  }
+  run_end();
+  if (cond != current_condition)
+    out_markup(cond);
   current_condition = cond;
 }
 
-void bad_byte(enum condition cond, int index) {
+// Bad bytes right after those of a run of the same kind add to it.
+void run_bytes_add(int count, enum condition cond, size_t index) {
+  flush_output(index);
+  if (cond != run_condition)
+    run_end();
+  run_condition = cond;
+  for (int i = 0; i < count; i++, run_len++)
+    if (run_len < coalesce_len)
+      run_bytes[run_len] = buffer[index + i];
+  buffer_out = index + count;
+}
+
+void bad_bytes(int count, enum condition cond, size_t index) {
+  if (coalesce_len) {
+    run_bytes_add(count, cond, index);
+    return;
+  }
   bad_preface(cond, index);
-  printf("<%02x>", buffer[index] & 255);
-  buffer_out = index + 1;
+  if (out_len + 4 * count > sizeof(out_buffer))
+    out_flush();
+  char *out = out_buffer + out_len;
+  for (int i = 0; i < count; i++) {
+    int ch = buffer[index + i] & 255;
+    out[0] = '<';
+    out[1] = hex_digits[ch >> 4];
+    out[2] = hex_digits[ch & 15];
+    out[3] = '>';
+    out += 4;
+  }
+  out_len += 4 * count;
+  buffer_out = index + count;
 }
 
-void bad_bytes(int count, enum condition cond, int index) {
-  for (int i = 0; i < count; i++)
-    bad_byte(cond, index + i);
+void bad_byte(enum condition cond, size_t index) {
+  bad_bytes(1, cond, index);
 }
 
-void bad_marker(enum condition cond, int index) {
+void bad_marker(enum condition cond, size_t index) {
   bad_preface(cond, index);
-  printf(" ");
+  out_write(" ", 1);
 }
 
-void early_out(int index) {
+void early_out(size_t index) {
   flush_output(index);
+  uint64_t start = timing_start();
   memmove(buffer, buffer + index, buffer_pos - index);
+  timing_end(TIMING_CARRY, start, buffer_pos - index);
   buffer_pos -= index;
   buffer_out = 0;
 }
 
-void consume() {
-  for (int i = 0; i < buffer_pos; i++) {
+void check_ascii(size_t from, size_t to) {
+  for (size_t i = from; i < to; i++) {
     int ch = (int)buffer[i] & 255;
-    if (!(ch & 0x80)) { // leading 1
-      if (ch < ' ' && ch != '\n' && ch != '\t')
-        bad_byte(CONTROL, i);
-    } else if (!(ch & 0x40)) { // continuation
-      bad_byte(ENCODING, i);
-    } else if (!(ch & 0x20)) { // leading 2
-      if (i + 1 >= buffer_pos) {
-        early_out(i);
-        return;
-      }
-      int ch1 = (int)buffer[i+1] & 255;
-      if ((ch1 & 0xc0) != 0x80) {
-        bad_byte(ENCODING, i);
-        continue;
-      }
-      int u = ((ch & 0x1f) << 6) | (ch1 & 0x3f);
-      if (u < 0x80) bad_bytes(2, OVERLONG, i);
-      else if (u < 0xa0) bad_bytes(2, HIGH_CONTROL, i);
-    } else if (!(ch & 0x10)) { // leading 3
-      if (i + 2 >= buffer_pos) {
-        early_out(i);
-        return;
-      }
-      int ch1 = (int)buffer[i+1] & 255;
-      int ch2 = (int)buffer[i+2] & 255;
-      if ((ch1 & 0xc0) != 0x80 || (ch2 & 0xc0) != 0x80) {
-        bad_byte(ENCODING, i);
-        continue;
-      }
-      int u = ((ch & 0xf) << 12) | ((ch1 & 0x3f) << 6) | (ch2 & 0x3f);
-      if (u < 0x800) bad_bytes(3, OVERLONG, i);
-    } else if (ch < 0xf5) { // leading 4
-      if (i + 3 >= buffer_pos) {
-        early_out(i);
-        return;
-      }
-      int ch1 = (int)buffer[i+1] & 255;
-      int ch2 = (int)buffer[i+2] & 255;
-      int ch3 = (int)buffer[i+3] & 255;
-      if ((ch1 & 0xc0) != 0x80 || (ch2 & 0xc0) != 0x80 || (ch3 & 0xc0) != 0x80) {
-        bad_byte(ENCODING, i);
-        continue;
-      }
-      int u = ((ch & 7) << 18) | ((ch1 & 0x3f) << 12) | ((ch2 & 0x3f) << 6) |
-        (ch3 & 0x3f);
-      if (u < 0x10000) bad_bytes(4, OVERLONG, i);
-    } else { // illegal 0xf5-0xff
-      bad_byte(ENCODING, i);
+    if (ch & 0x80) { // part of a valid sequence
+      last_byte_nl = last_byte_cr = last_byte_whitespace = 0;
       continue;
     }
+    if (ch < ' ' && ch != '\n' && ch != '\t')
+      bad_byte(CONTROL, i);
 
     last_byte_nl = ch == '\n';
 
@@ -245,44 +356,264 @@ void consume() {
     if (ch != '\r')
       last_byte_whitespace = ch == '\t' || ch == ' ';
   }
+}
+
+void consume(int end) {
+  size_t i = 0;
+  while (1) {
+    enum utf8_class cls;
+    int len;
+    size_t bad = i + utf8_find_bad(buffer + i, buffer_pos - i, end, &cls, &len);
+    check_ascii(i, bad);
+    if (cls == UTF8_VALID)
+      break;
+    if (cls == UTF8_INCOMPLETE) {
+      early_out(bad);
+      return;
+    }
+    if (cls == UTF8_OVERLONG)
+      bad_bytes(len, OVERLONG, bad);
+    else if (cls == UTF8_UPPER_CONTROL)
+      bad_bytes(len, HIGH_CONTROL, bad);
+    else
+      bad_bytes(len, ENCODING, bad);
+    last_byte_nl = last_byte_cr = last_byte_whitespace = 0;
+    i = bad + len;
+  }
   flush_output(buffer_pos);
   buffer_out = 0;
   buffer_pos = 0;
 }
 
+void timed_consume(int end) {
+  uint64_t start = timing_start();
+  size_t len = buffer_pos;
+  consume(end);
+  timing_end(TIMING_SCAN, start, len);
+}
+
+// Decodes the stream that starts with p[0..len) if it is compressed.
+int start_decoding(char *p, size_t len, decode_source *source) {
+  if (!use_decompress) return 0;
+  decoding = decoder_start(&decoder, p, len, source, input_reader);
+  if (decoding == -1)
+    errno_printf("cannot decompress");
+  return decoding;
+}
+
+// A compressed file is annotated as it is decoded, like one read ahead.
 void run_fd(int fd) {
-  while (1) {
-    int len = read(fd, buffer + buffer_pos, buffer_len - buffer_pos);
+  size_t map_len;
+  char *map = use_mmap && input_left < 0 ? input_map(fd, &map_len) : 0;
+  if (map && !start_decoding(map, map_len, 0)) {
+    buffer = map;
+    buffer_pos = map_len;
+    timed_consume(1);
+    input_unmap(map, map_len);
+    buffer = read_buffer;
+    return;
+  }
+  int first = input_reader && !map;
+  while (input_left) {
+    size_t want = buffer_len - buffer_pos;
+    if (input_left > 0 && want > input_left)
+      want = input_left;
+    ssize_t len;
+    uint64_t start = timing_start();
+    if (input_reader) {
+      // A sequence carried over is completed in the read buffer, other
+      // pieces are annotated where the reader has them.
+      char *p;
+      size_t n = buffer_pos ? 4 - buffer_pos : want;
+      len = decoding ? decoder_read(&decoder, &p, n) :
+        reader_read(input_reader, &p, n);
+      timing_end(TIMING_READ, start, len > 0 ? len : 0);
+      if (len > 0 && first) {
+        first = 0;
+        if (start_decoding(p, len, decode_from_reader)) continue;
+      }
+      if (len > 0 && buffer_pos)
+        memcpy(buffer + buffer_pos, p, len);
+      else if (len > 0)
+        buffer = p;
+    } else {
+      timing_syscall();
+      len = read(fd, buffer + buffer_pos, want);
+      timing_end(TIMING_READ, start, len > 0 ? len : 0);
+    }
     if (len == -1)
-      errno_printf("cannot read");
+      errno_printf(decoding ? "cannot decompress" : "cannot read");
     if (!len) break;
     buffer_pos += len;
-    consume();
+    if (input_left > 0)
+      input_left -= len;
+    timed_consume(0);
+    if (buffer != read_buffer) {
+      if (buffer_pos) {
+        start = timing_start();
+        memcpy(read_buffer, buffer, buffer_pos);
+        timing_end(TIMING_CARRY, start, buffer_pos);
+      }
+      buffer = read_buffer;
+    }
   }
-  for (int i = 0; i < buffer_pos; i++) {
-    bad_byte(ENCODING, i);
+  if (buffer_pos)
+    timed_consume(1);
+  if (decoding) {
+    decoder_stop(&decoder);
+    decoding = 0;
   }
+  if (map)
+    input_unmap(map, map_len);
 }
 
-void run(int index, int argc, char **argv) {
-  if (index == argc) {
-    run_fd(0);
-  } else {
-    while (index < argc) {
-      char *name = argv[index++];
-      if (!strcmp(name, "-")) {
-        run_fd(0);
-      } else {
-        int fd = file4read(name);
-        run_fd(fd);
-        close(fd);
-      }
+// how far a window looks for the start and the end of its lines
+long window_margin = 65536;
+
+void pread_all(int fd, char *p, size_t len, long offset) {
+  while (len) {
+    ssize_t n = pread(fd, p, len, offset);
+    if (n == -1)
+      errno_printf("cannot read");
+    if (!n)
+      exit_printf("file shrank while reading\n");
+    p += n;
+    len -= n;
+    offset += n;
+  }
+}
+
+// Annotation starts afresh after a newline.  In a line longer than the
+// margin, any byte but a continuation byte starts a sequence, and only the
+// whitespace before a run of CRs carries over, so the window can still
+// start exactly where a full pass would be.
+long window_start(int fd, long offset, long size, char *p) {
+  long from = offset > window_margin ? offset - window_margin : 0;
+  size_t len = offset - from;
+  pread_all(fd, p, len + (offset < size), from);
+  for (size_t i = len; i > 0; i--)
+    if (p[i - 1] == '\n')
+      return from + i;
+  size_t i = len;
+  if (offset < size) {
+    for (int k = 0; k < 3 && i > 0 && (p[i] & 0xc0) == 0x80; k++)
+      i--;
+    if ((p[i] & 0xc0) == 0x80) // an orphan, the window may start at it
+      i = len;
+  }
+  for (size_t k = i; k > 0; k--) {
+    if (p[k - 1] != '\r') {
+      last_byte_whitespace = p[k - 1] == ' ' || p[k - 1] == '\t';
+      break;
     }
   }
+  return from + i;
+}
+
+// The window ends after the newline of its last line or, in a long line,
+// after the last sequence that starts in it.
+long window_end(int fd, long offset, long end, long size, char *p) {
+  long from = end > offset ? end - 1 : end;
+  long to = size - from > window_margin ? from + window_margin : size;
+  size_t len = to - from;
+  pread_all(fd, p, len, from);
+  char *nl = memchr(p, '\n', len);
+  if (nl)
+    return from + (nl - p) + 1;
+  size_t i = end - from;
+  for (int k = 0; k < 3 && i < len && (p[i] & 0xc0) == 0x80; k++)
+    i++;
+  return from + i;
+}
+
+// Turns the window of lines into one of bytes.  Without an index, the file
+// is read from the start up to the lines.
+void line_window(char *name, int fd) {
+  struct tuidx x;
+  struct tuidx *index = use_index && fd && !tuidx_load(&x, name, fd) ?
+    &x : 0;
+  int64_t start = tuidx_line_offset(index, fd, window_line - 1);
+  int64_t end = window_lines < 0 ? -1 :
+    tuidx_line_offset(index, fd, window_line - 1 + window_lines);
+  if (start == -1 || (window_lines >= 0 && end == -1))
+    errno_printf("cannot read");
+  window_offset = start;
+  window_len = end == -1 ? -1 : end - start;
+  if (index)
+    tuidx_free(index);
+}
+
+void run_window(char *name, int fd) {
+  struct stat st;
+  if (fstat(fd, &st) == -1)
+    errno_printf("cannot stat");
+  if (!S_ISREG(st.st_mode))
+    exit_printf("window needs a regular file\n");
+  long size = st.st_size;
+  if (window_line) {
+    line_window(name, fd);
+    if (window_offset >= size) // there are not that many lines
+      return;
+  }
+  long offset = window_offset < size ? window_offset : size;
+  long end = window_len < 0 || window_len > size - offset ?
+    size : offset + window_len;
+  char *p = allocate(window_margin + 1);
+  long start = window_start(fd, offset, size, p);
+  long stop = window_end(fd, offset, end, size, p);
+  free(p);
+  if (lseek(fd, start, SEEK_SET) == -1)
+    errno_printf("cannot seek");
+  input_left = stop - start;
+  run_fd(fd);
+  input_left = -1;
+}
+
+void run(int index, int argc, char **argv) {
+  if (window_offset >= 0 || window_line) {
+    if (argc - index > 1)
+      exit_printf("window needs exactly one file\n");
+    if (window_offset >= 0 && window_line)
+      exit_printf("window is either bytes or lines\n");
+    char *name = index < argc ? argv[index] : "-";
+    int fd = strcmp(name, "-") ? file4read(name) : 0;
+    run_window(name, fd);
+    run_end();
+    if (fd)
+      close(fd);
+    return;
+  }
+  int count = index == argc ? 1 : argc - index;
+  char **names = allocate(count * sizeof(char *));
+  for (int i = 0; i < count; i++)
+    names[i] = index == argc || !strcmp(argv[index + i], "-") ? 0 :
+      argv[index + i];
+  struct reader reader;
+  if (reader_init(&reader, names, count, use_mmap, !use_uring))
+    errno_printf("cannot start reading");
+  input_reader = &reader;
+  for (int i = 0; i < count; i++) {
+    int fd = reader_next(&reader);
+    if (fd == -1)
+      errno_printf("cannot open file \"%s\"", names[i]);
+    run_fd(fd);
+    run_end();
+  }
+  input_reader = 0;
+  reader_free(&reader);
+  free(names);
 }
 
 int main(int argc, char **argv) {
+  use_color = 1;
   parse_options(argc, argv);
+  timing_setup();
+  init_markup();
+  buffer_len = reader_buffer_len ? reader_buffer_len : 1 << 16;
+  buffer = read_buffer = allocate(buffer_len);
+  if (coalesce_len)
+    run_bytes = allocate(coalesce_len);
   run(optind, argc, argv);
+  out_flush();
   return 0;
 }
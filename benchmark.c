@@ -0,0 +1,797 @@
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+
+#include "util.h"
+
+char *help_text =
+  "benchmark [-h] [-c <cases>] [-d <dir>] [-n <runs>] [-s <size>[,<size>]*]\n"
+  "          [-t <tool>] [-g <shape> <bytes>]\n"
+  "Generates test corpora and reports the throughput of match, textstats,\n"
+  "annofilter and textfix on them with each of their engines: built without\n"
+  "SIMD by make scalar, read with a thread or io_uring, mapped, read in small\n"
+  "pieces, from a pipe, and those of a tool only, like the parallel and\n"
+  "partial counts of textstats.  Tools are run from the current directory.\n"
+  "Cycles are time stamp counter cycles.\n"
+  "  -c <cases>    Check instead that all engines give the same output as\n"
+  "                the build without SIMD reading with a thread, on <cases>\n"
+  "                random corpora, mostly fuzz, with pieces of random length\n"
+  "                in between, and report the mismatches and the throughput\n"
+  "                of each engine; exits with 1 if there are mismatches,\n"
+  "                whose corpora are kept\n"
+  "  -d <dir>      Keep the corpora in <dir> (default: a temporary directory)\n"
+  "  -g <shape> <bytes>\n"
+  "                Write a corpus of <bytes> bytes to stdout and exit\n"
+  "  -h            Print this help text\n"
+  "  -n <runs>     Report the best of <runs> runs (default: 3)\n"
+  "  -s <sizes>    Corpus sizes, with optional k, M or G (default: 1M,64M)\n"
+  "  -t <tool>     Run only <tool>, may be given many times\n"
+  "Shapes: ascii, utf8, latin1, crlf, longlines, binary, fuzz, nuls\n";
+
+long str2size(char *str) {
+  char *end;
+  long res = strtol(str, &end, 10);
+  if (*end == 'k') res <<= 10, end++;
+  else if (*end == 'M') res <<= 20, end++;
+  else if (*end == 'G') res <<= 30, end++;
+  if (!*str || *end || res <= 0)
+    exit_printf("cannot convert \"%s\" to size\n", str);
+  return res;
+}
+
+// Corpora
+
+uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+uint64_t rng() {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+char *ascii_words[] = {
+  "ERROR", "INFO", "WARN", "connection", "reset", "by", "peer", "user",
+  "id=42", "2024-01-02", "12:00:01.123", "request", "GET", "/index.html",
+  "200", "timeout", "[worker-3]", "session", "closed", "retrying", "in",
+  "5s", "ok", "the", "of", "and", "to",
+};
+
+char *utf8_words[] = {
+  "päivä", "hyvää", "yötä", "Ärrä", "öljy", "straße", "façade", "naïve",
+  "καλημέρα", "κόσμε", "привет", "мир", "שלום", "مرحبا", "नमस्ते", "こんにちは",
+  "世界", "한국어", "😀", "🎉", "ok", "and", "the", "connection", "reset",
+};
+
+// Finnish in Latin-1: a-umlaut 0xe4, o-umlaut 0xf6, a-ring 0xe5
+char *latin1_words[] = {
+  "p\xe4iv\xe4", "hyv\xe4\xe4", "y\xf6t\xe4", "\xc4rr\xe4", "\xf6ljy",
+  "s\xe4\xe4", "ty\xf6", "\xe5land", "k\xe4si", "my\xf6s", "ja", "on",
+  "ei", "connection", "reset",
+};
+
+#define COUNT(a) (sizeof(a) / sizeof(a[0]))
+
+char *pick(char **words, int count) {
+  return words[rng() % count];
+}
+
+// A line of words up to about width bytes, each line ending with eol.
+size_t words_line(char *p, size_t room, char **words, int count,
+                  size_t width, char *eol) {
+  size_t len = 0, eol_len = strlen(eol);
+  while (len < width) {
+    char *w = pick(words, count);
+    size_t n = strlen(w);
+    if (len + n + 1 + eol_len > room) break;
+    if (len) p[len++] = ' ';
+    memcpy(p + len, w, n);
+    len += n;
+  }
+  if (len + eol_len <= room) {
+    memcpy(p + len, eol, eol_len);
+    len += eol_len;
+  }
+  return len;
+}
+
+// Bits of text that scanners may get wrong at their edges, above all where
+// a read ends: utf8 valid, cut short, overlong, a surrogate or out of
+// range, stray continuation bytes, latin1, controls, line ends with and
+// without CR and blanks before them, and what the checks search for.
+char *fuzz_bits[] = {
+  "\n", "\r\n", "\r", " \n", "\t\r\n", " ", "ab", "\xc3\xa4", "\xc3\x84",
+  "\xc3\xa5", "\xc3\xb6", "p\xc3\xa4iv\xc3\xa4", "P\xc3\x84IV\xc3\x84",
+  "\xe2\x82\xac", "\xf0\x9f\x98\x80", "\xc2\x85", "\xc2\x9f", "\xc3",
+  "\xe2\x82", "\xf0\x9f\x98", "\x80", "\xbf\xbf", "\xc0\x80",
+  "\xe0\x80\x80", "\xf0\x80\x80\x80", "\xed\xa0\x80", "\xf4\x90\x80\x80",
+  "\xff", "\xfe", "\xe4", "\xf6", "\x85", "\x01", "\x1b", "\x7f",
+};
+
+// a NUL in about this many bits of fuzz, 0 for none
+long fuzz_nuls = 0;
+
+// A word, a bit of fuzz, a NUL or now and then a line of up to 2000 bytes.
+size_t fuzz_piece(char *p, size_t room) {
+  uint64_t r = rng();
+  char *bit = r % 2 ? pick(ascii_words, COUNT(ascii_words)) :
+    pick(fuzz_bits, COUNT(fuzz_bits));
+  size_t n = strlen(bit);
+  if (fuzz_nuls && r % fuzz_nuls == 0) {
+    if (!room) return 0;
+    *p = 0;
+    return 1;
+  }
+  if (r % 300 == 1) {
+    n = 100 + r / 300 % 1900;
+    if (n > room) n = room;
+    memset(p, 'x', n);
+    return n;
+  }
+  if (n > room) return 0;
+  memcpy(p, bit, n);
+  return n;
+}
+
+// Fills p[0..len) with the named shape; returns 0 for an unknown one.
+int generate(char *shape, char *p, size_t len) {
+  size_t pos = 0;
+  if (!strcmp(shape, "binary")) {
+    for (; pos + 8 <= len; pos += 8) {
+      uint64_t r = rng();
+      memcpy(p + pos, &r, 8);
+    }
+    for (; pos < len; pos++)
+      p[pos] = rng();
+    return 1;
+  }
+  while (pos < len) {
+    size_t room = len - pos, n;
+    if (!strcmp(shape, "ascii")) {
+      n = words_line(p + pos, room, ascii_words, COUNT(ascii_words),
+                     40 + rng() % 80, "\n");
+    } else if (!strcmp(shape, "utf8")) {
+      n = words_line(p + pos, room, utf8_words, COUNT(utf8_words),
+                     40 + rng() % 80, "\n");
+    } else if (!strcmp(shape, "latin1")) {
+      n = words_line(p + pos, room, latin1_words, COUNT(latin1_words),
+                     40 + rng() % 80, "\n");
+    } else if (!strcmp(shape, "crlf")) {
+      // short lines, some with trailing whitespace or a stray CR
+      static char *eols[] = {"\r\n", "\r\n", "\r\n", " \r\n", "\r\r\n", "\r"};
+      n = words_line(p + pos, room, ascii_words, COUNT(ascii_words),
+                     rng() % 40, eols[rng() % COUNT(eols)]);
+    } else if (!strcmp(shape, "longlines")) {
+      n = words_line(p + pos, room, ascii_words, COUNT(ascii_words),
+                     (128 << 10) + rng() % (1 << 20), "\n");
+    } else if (!strcmp(shape, "fuzz")) {
+      n = fuzz_piece(p + pos, room);
+    } else if (!strcmp(shape, "nuls")) {
+      // text with a NUL in some lines and now and then a line of many,
+      // for match to tell binary by where they are, not by how it reads
+      n = words_line(p + pos, room, ascii_words, COUNT(ascii_words),
+                     40 + rng() % 80, "\n");
+      uint64_t r = rng();
+      for (int k = r % 400 ? r % 30 == 0 : 20 + r % 20; k && n; k--)
+        p[pos + rng() % n] = 0;
+    } else {
+      return 0;
+    }
+    if (!n) {
+      memset(p + pos, 'x', room);
+      n = room;
+    }
+    pos += n;
+  }
+  return 1;
+}
+
+char *shapes[] = {"ascii", "utf8", "latin1", "crlf", "longlines", "binary",
+                  "fuzz", "nuls"};
+
+// the last corpus written, for the engines that read a pipe
+char *corpus = 0;
+size_t corpus_len = 0;
+
+void write_corpus(char *name, char *shape, size_t len) {
+  free(corpus);
+  char *p = malloc(len ? len : 1);
+  if (!p)
+    exit_printf("cannot allocate %zu bytes\n", len);
+  if (!generate(shape, p, len))
+    exit_printf("unknown shape \"%s\"\n", shape);
+  int fd = name ? open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644) : 1;
+  if (fd == -1)
+    errno_printf("cannot create \"%s\"", name);
+  for (size_t pos = 0; pos < len;) {
+    ssize_t n = write(fd, p + pos, len - pos);
+    if (n == -1)
+      errno_printf("cannot write");
+    pos += n;
+  }
+  if (name)
+    close(fd);
+  corpus = p;
+  corpus_len = len;
+}
+
+// Runs
+
+// A way for a tool to take its input, with the options that pick it.  The
+// first engine of each tool, the scalar build reading with a thread, is the
+// reference that the others are checked against.
+struct engine {
+  char *name;
+  char *args[4];
+  int scalar;                // the tool built without SIMD
+  int chunked;               // read in pieces of chunk_len bytes
+  int pipe;                  // fed through a pipe to stdin
+  int check_only;            // not timed, as it depends on earlier runs
+  char **columns;            // from --format=tsv, compared; all if null
+};
+
+char *line_columns[] = {"bytes", "lines", "no_final_newline", 0};
+char *utf8_columns[] = {
+  "bytes", "utf8_missing_continuations", "utf8_orphan_continuations",
+  "utf8_overlongs", "utf8_upper_controls", "utf8_illegals",
+  "no_final_newline", 0,
+};
+
+#define READ_ENGINES                                                    \
+  {"scalar", {"--no-mmap", "--no-uring"}, .scalar = 1},                 \
+  {"thread", {"--no-mmap", "--no-uring"}},                              \
+  {"uring", {"--no-mmap"}},                                             \
+  {"mmap", {0}},                                                        \
+  {"pieces", {"--no-mmap"}, .chunked = 1},                              \
+  {"pipe", {0}, .pipe = 1}
+
+struct engine match_engines[] = {
+  READ_ENGINES,
+  {"index", {"-x"}, .check_only = 1},
+};
+
+struct engine textstats_engines[] = {
+  READ_ENGINES,
+  {"jobs", {"-j4"}},
+  {"lines", {"--only=lines"}, .columns = line_columns},
+  {"utf8", {"--only=utf8"}, .columns = utf8_columns},
+  {"index", {"-x"}, .check_only = 1},
+};
+
+struct engine plain_engines[] = {
+  READ_ENGINES,
+};
+
+struct tool {
+  char *name;
+  char *args[8];             // up to the input file, which is added last
+  char *scalar;              // the path of the build without SIMD
+  struct engine *engines;
+  int engine_count;
+};
+
+#define ENGINES(e) e, COUNT(e)
+
+struct tool tools[] = {
+  {"match", {"./match", "connection reset"}, "./scalar/match",
+   ENGINES(match_engines)},
+  {"textstats", {"./textstats"}, "./scalar/textstats",
+   ENGINES(textstats_engines)},
+  {"annofilter", {"./annofilter"}, "./scalar/annofilter",
+   ENGINES(plain_engines)},
+  {"textfix", {"./textfix", "-cw"}, "./scalar/textfix",
+   ENGINES(plain_engines)},
+};
+
+// What -c runs on each corpus, with each engine of the tool.  The index
+// engines find <file>.tuidx, written by textstats before the checks.
+struct check {
+  int tool;
+  char *args[8];
+};
+
+struct check checks[] = {
+  {1, {"--format=tsv"}},
+  {0, {"-c", "-e", "connection", "-e", "reset"}},
+  {0, {"-n", "-b", "-A2", "-B1", "reset"}},
+  {0, {"-i", "-m", "256", "-r", "error"}},
+  {0, {"--count-matches-only", "-e", "\xc3\xa4", "-e", "ab"}},
+  {0, {"--max-count=3", "-n", "-A1", "connection"}},
+  {0, {"--fold-finnish", "p\xc3\xa4iv\xc3\xa4"}},
+  {2, {0}},
+  {2, {"--coalesce=4"}},
+  {3, {"-cw"}},
+  {3, {"-l"}},
+};
+
+int tool_selected[COUNT(tools)];
+int any_tool_selected = 0;
+
+long runs = 3;
+long sizes[16];
+int size_count = 0;
+char *corpus_dir = 0;
+long check_cases = 0;
+// of the reads of the pieces engine, and whether a pipe is fed in pieces
+// of random length instead of 64k ones
+long chunk_len = 4096;
+int random_pieces = 0;
+
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+uint64_t cycles() {
+#ifdef HAVE_TSC
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+// Writes the corpus to fd in pieces and closes it.  A tool that stops
+// reading early ends the feeding.
+void feed(int fd) {
+  for (size_t pos = 0; pos < corpus_len;) {
+    size_t n = 1 << 16;
+    if (random_pieces) {
+      uint64_t r = rng();
+      n = 1 + r / 4 % (r % 4 == 0 ? 16 : r % 4 == 1 ? 4096 : 65536);
+    }
+    if (n > corpus_len - pos)
+      n = corpus_len - pos;
+    ssize_t len = write(fd, corpus + pos, n);
+    if (len == -1 && errno == EINTR) continue;
+    if (len == -1) break;
+    pos += len;
+  }
+  close(fd);
+}
+
+int open_output(char *name) {
+  int fd = open(name ? name : "/dev/null", O_WRONLY | O_CREAT | O_TRUNC,
+                0644);
+  if (fd == -1)
+    errno_printf("cannot create \"%s\"", name);
+  return fd;
+}
+
+// Runs the tool once on the file with args and those of the engine, and
+// with stdout and stderr to the files out and err or to /dev/null if they
+// are null.  Returns the exit status, and the wall time in seconds in
+// *secs and the cycles spent in *used.
+int run_once(struct tool *t, char **args, struct engine *e, char *file,
+             char *out, char *err, double *secs, uint64_t *used) {
+  char *argv[32];
+  char buffer_size[32];
+  int argc = 0;
+  argv[argc++] = e->scalar ? t->scalar : t->args[0];
+  for (int i = 0; args[i]; i++)
+    argv[argc++] = args[i];
+  for (int i = 0; e->args[i]; i++)
+    argv[argc++] = e->args[i];
+  if (e->chunked) {
+    snprintf(buffer_size, sizeof(buffer_size), "--buffer-size=%ld",
+             chunk_len);
+    argv[argc++] = buffer_size;
+  }
+  argv[argc++] = "--";
+  if (!e->pipe)
+    argv[argc++] = file;
+  argv[argc] = 0;
+  int fds[2];
+  if (e->pipe && pipe(fds) == -1)
+    errno_printf("cannot create pipe");
+  double start = now();
+  uint64_t start_cycles = cycles();
+  pid_t pid = fork();
+  if (pid == -1)
+    errno_printf("cannot fork");
+  if (!pid) {
+    if (e->pipe) {
+      dup2(fds[0], 0);
+      close(fds[0]);
+      close(fds[1]);
+    }
+    dup2(open_output(out), 1);
+    dup2(open_output(err), 2);
+    execv(argv[0], argv);
+    _exit(127);
+  }
+  if (e->pipe) {
+    close(fds[0]);
+    feed(fds[1]);
+  }
+  int status;
+  if (waitpid(pid, &status, 0) == -1)
+    errno_printf("cannot wait");
+  *used = cycles() - start_cycles;
+  *secs = now() - start;
+  if (WIFEXITED(status) && WEXITSTATUS(status) == 127)
+    exit_printf("cannot run \"%s\", run make %sfirst\n", argv[0],
+                e->scalar ? "scalar " : "");
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+char *size_str(long size, char *buf) {
+  if (size >= 1 << 30 && !(size & ((1 << 30) - 1)))
+    sprintf(buf, "%ldG", size >> 30);
+  else if (size >= 1 << 20 && !(size & ((1 << 20) - 1)))
+    sprintf(buf, "%ldM", size >> 20);
+  else if (size >= 1 << 10 && !(size & ((1 << 10) - 1)))
+    sprintf(buf, "%ldk", size >> 10);
+  else
+    sprintf(buf, "%ld", size);
+  return buf;
+}
+
+void bench(char *file, char *shape, long size) {
+  char buf[32];
+  for (int k = 0; k < COUNT(tools); k++) {
+    if (any_tool_selected && !tool_selected[k]) continue;
+    for (int i = 0; i < tools[k].engine_count; i++) {
+      struct engine *e = tools[k].engines + i;
+      // timed if there is one
+      if (e->check_only || (e->scalar && access(tools[k].scalar, X_OK)))
+        continue;
+      double best = 0;
+      uint64_t best_cycles = 0;
+      for (int r = 0; r < runs; r++) {
+        double t;
+        uint64_t c;
+        run_once(tools + k, tools[k].args + 1, e, file, 0, 0, &t, &c);
+        if (!r || t < best) {
+          best = t;
+          best_cycles = c;
+        }
+      }
+      printf("%-10s  %-6s  %-9s  %7s  %9.1f", tools[k].name, e->name, shape,
+             size_str(size, buf), size / best / (1 << 20));
+#ifdef HAVE_TSC
+      printf("  %7.2f\n", (double)best_cycles / size);
+#else
+      printf("        -\n");
+#endif
+      fflush(stdout);
+    }
+  }
+}
+
+// Checks
+
+char *read_file(char *name, size_t *len) {
+  int fd = open(name, O_RDONLY);
+  if (fd == -1)
+    errno_printf("cannot open \"%s\"", name);
+  size_t cap = 1 << 16;
+  char *p = malloc(cap);
+  *len = 0;
+  while (p) {
+    if (*len == cap)
+      p = realloc(p, cap *= 2);
+    if (!p) break;
+    ssize_t n = read(fd, p + *len, cap - *len);
+    if (n == -1)
+      errno_printf("cannot read \"%s\"", name);
+    if (!n) break;
+    *len += n;
+  }
+  if (!p)
+    exit_printf("cannot allocate %zu bytes\n", cap);
+  close(fd);
+  return p;
+}
+
+int compared(char *column, char **columns) {
+  if (!strcmp(column, "file") || !strcmp(column, "elapsed_ns") ||
+      !strcmp(column, "bytes_per_sec"))
+    return 0;
+  if (!columns) return 1;
+  for (int i = 0; columns[i]; i++)
+    if (!strcmp(column, columns[i]))
+      return 1;
+  return 0;
+}
+
+// Keeps only the compared columns of tsv output in p[0..len), named in
+// its first line, and returns the length left.  The file names differ
+// with a pipe and the times always.
+size_t tsv_columns(char *p, size_t len, char **columns) {
+  uint64_t keep = 0;         // of the first 64 columns
+  size_t out = 0;
+  int first = 1;
+  for (size_t pos = 0; pos < len;) {
+    char *nl = memchr(p + pos, '\n', len - pos);
+    size_t end = nl ? (size_t)(nl - p) : len;
+    int column = 0;
+    // the columns of a line start where the last one ended
+    while (pos <= end) {
+      char *tab = memchr(p + pos, '\t', end - pos);
+      size_t stop = tab ? (size_t)(tab - p) : end;
+      if (first) {
+        p[stop] = 0;
+        if (column < 64 && compared(p + pos, columns))
+          keep |= 1ULL << column;
+      }
+      if (column < 64 && keep >> column & 1) {
+        memmove(p + out, p + pos, stop - pos);
+        out += stop - pos;
+        p[out++] = '\t';
+      }
+      column++;
+      pos = stop + 1;
+      if (!tab) break;
+    }
+    p[out++] = '\n';
+    first = 0;
+    pos = end + 1;
+  }
+  return out;
+}
+
+// per engine of each tool, over all checks
+struct tally {
+  long runs;
+  long mismatches;
+  double secs;
+  uint64_t bytes;
+} tallies[COUNT(tools)][16];
+
+char *copy(char *p, size_t len) {
+  char *q = malloc(len + 1);   // for tsv_columns to end a line
+  if (!q)
+    exit_printf("cannot allocate %zu bytes\n", len);
+  memcpy(q, p, len);
+  return q;
+}
+
+// Tells where the output of an engine first differs from that of the
+// reference, after a given length.
+void report(char *what, char *p, size_t len, char *want, size_t want_len) {
+  size_t i = 0;
+  while (i < len && i < want_len && p[i] == want[i])
+    i++;
+  printf("  %s differs at byte %zu of %zu, %zu wanted\n", what, i, len,
+         want_len);
+}
+
+// Runs a check with each engine of its tool on the file and compares the
+// exit status, the messages and the output with those of the first.  The
+// tsv of textstats is compared without the columns that differ anyway, and
+// with only those that an engine counts.  Returns the number of
+// mismatches.
+int check_file(struct check *c, char *file, char *dir, long number) {
+  struct tool *t = tools + c->tool;
+  char out_name[4096], err_name[4096];
+  snprintf(out_name, sizeof(out_name), "%s/stdout", dir);
+  snprintf(err_name, sizeof(err_name), "%s/stderr", dir);
+  int tsv = c->args[0] && !strcmp(c->args[0], "--format=tsv");
+  char *ref_out = 0, *ref_err = 0;
+  size_t ref_out_len = 0, ref_err_len = 0;
+  int ref_status = 0;
+  int mismatches = 0;
+  for (int i = 0; i < t->engine_count; i++) {
+    struct engine *e = t->engines + i;
+    double secs;
+    uint64_t used;
+    int status = run_once(t, c->args, e, file, out_name, err_name, &secs,
+                          &used);
+    struct tally *y = tallies[c->tool] + i;
+    y->runs++;
+    y->secs += secs;
+    y->bytes += corpus_len;
+    size_t out_len, err_len;
+    char *out = read_file(out_name, &out_len);
+    char *err = read_file(err_name, &err_len);
+    if (!i) {
+      ref_out = out;
+      ref_out_len = out_len;
+      ref_err = err;
+      ref_err_len = err_len;
+      ref_status = status;
+      continue;
+    }
+    char *want = copy(ref_out, ref_out_len);
+    size_t want_len = ref_out_len;
+    if (tsv) {
+      want_len = tsv_columns(want, want_len, e->columns);
+      out_len = tsv_columns(out, out_len, e->columns);
+    }
+    int bad_status = status != ref_status;
+    int bad_err = err_len != ref_err_len || memcmp(err, ref_err, err_len);
+    int bad_out = out_len != want_len || memcmp(out, want, out_len);
+    if (bad_status || bad_err || bad_out) {
+      mismatches++;
+      y->mismatches++;
+      printf("mismatch in case %ld: %s", number, t->name);
+      for (int k = 0; c->args[k]; k++)
+        printf(" %s", c->args[k]);
+      printf(" with %s on %s\n", e->name, file);
+      if (bad_status)
+        printf("  exit status %d, %d wanted\n", status, ref_status);
+      if (bad_err)
+        report("stderr", err, err_len, ref_err, ref_err_len);
+      if (bad_out)
+        report("stdout", out, out_len, want, want_len);
+    }
+    free(want);
+    free(out);
+    free(err);
+  }
+  free(ref_out);
+  free(ref_err);
+  return mismatches;
+}
+
+// Runs all checks on check_cases random corpora, each from a seed of its
+// own number, and reports the tally of each engine.  Returns the number of
+// mismatches.
+long check(char *dir) {
+  long mismatches = 0;
+  random_pieces = 1;
+  for (long n = 0; n < check_cases; n++) {
+    rng_state = 0x9e3779b97f4a7c15ULL * (n + 1);
+    uint64_t r = rng();
+    char *shape = r % 4 > 1 ? "fuzz" : r % 4 ? "nuls" :
+      shapes[r / 4 % COUNT(shapes)];
+    size_t len = rng() % (r % 8 == 1 ? 64 : 256 << 10);
+    r = rng();
+    fuzz_nuls = r % 4 ? 0 : 1 + r / 4 % 200;
+    chunk_len = 4096 + rng() % 61440;
+    char file[4096], index[4096 + 8];
+    snprintf(file, sizeof(file), "%s/case-%ld", dir, n);
+    snprintf(index, sizeof(index), "%s.tuidx", file);
+    write_corpus(file, shape, len);
+    struct tool *t = tools + 1;
+    struct engine e = {"index", {"-x"}};
+    char *args[] = {0};
+    double secs;
+    uint64_t used;
+    run_once(t, args, &e, file, 0, 0, &secs, &used);
+    long found = 0;
+    for (int i = 0; i < COUNT(checks); i++)
+      if (!any_tool_selected || tool_selected[checks[i].tool])
+        found += check_file(checks + i, file, dir, n);
+    unlink(index);
+    if (found)
+      printf("  kept %s, %s of %zu bytes and chunks of %ld\n", file, shape,
+             len, chunk_len);
+    else
+      unlink(file);
+    mismatches += found;
+  }
+  char name[4096];
+  snprintf(name, sizeof(name), "%s/stdout", dir);
+  unlink(name);
+  snprintf(name, sizeof(name), "%s/stderr", dir);
+  unlink(name);
+  printf("%-10s  %-6s  %7s  %10s  %9s\n", "tool", "engine", "runs",
+         "mismatches", "MB/s");
+  for (int k = 0; k < COUNT(tools); k++)
+    for (int i = 0; i < tools[k].engine_count; i++) {
+      struct tally *y = &tallies[k][i];
+      if (!y->runs) continue;
+      printf("%-10s  %-6s  %7ld  %10ld  %9.1f\n", tools[k].name,
+             tools[k].engines[i].name, y->runs, y->mismatches,
+             y->bytes / y->secs / (1 << 20));
+    }
+  return mismatches;
+}
+
+void parse_options(int argc, char **argv) {
+  while (1) {
+    static struct option long_options[] =
+      {
+       {"check", required_argument, 0, 'c'},
+       {"dir", required_argument, 0, 'd'},
+       {"generate", required_argument, 0, 'g'},
+       {"help", no_argument, 0, 'h'},
+       {"runs", required_argument, 0, 'n'},
+       {"sizes", required_argument, 0, 's'},
+       {"tool", required_argument, 0, 't'},
+       {}
+      };
+    int option_index = 0;
+    int c = getopt_long(argc, argv, "c:d:g:hn:s:t:", long_options,
+                        &option_index);
+    if (c == -1) break;
+    switch (c) {
+    case 'c':
+      check_cases = str2long(optarg);
+      if (check_cases < 1)
+        exit_printf("cases must be at least 1\n");
+      break;
+    case 'd':
+      corpus_dir = optarg;
+      break;
+    case 'g':
+      if (optind >= argc)
+        exit_printf("no corpus size\n");
+      write_corpus(0, optarg, str2size(argv[optind]));
+      exit(0);
+    case 'h':
+      fprintf(stderr, "%s", help_text);
+      exit(0);
+    case 'n':
+      runs = str2long(optarg);
+      if (runs < 1)
+        exit_printf("runs must be at least 1\n");
+      break;
+    case 's':
+      size_count = 0;
+      for (char *s = strtok(optarg, ","); s; s = strtok(0, ",")) {
+        if (size_count == COUNT(sizes))
+          exit_printf("too many sizes\n");
+        sizes[size_count++] = str2size(s);
+      }
+      break;
+    case 't': {
+      int k;
+      for (k = 0; k < COUNT(tools) && strcmp(tools[k].name, optarg); k++);
+      if (k == COUNT(tools))
+        exit_printf("unknown tool \"%s\"\n", optarg);
+      tool_selected[k] = any_tool_selected = 1;
+      break;
+    }
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  parse_options(argc, argv);
+  if (!size_count) {
+    sizes[size_count++] = 1 << 20;
+    sizes[size_count++] = 64 << 20;
+  }
+  char tmp[] = "/tmp/benchmark-XXXXXX";
+  char *dir = corpus_dir;
+  if (!dir && !(dir = mkdtemp(tmp)))
+    errno_printf("cannot create temporary directory");
+  // a tool that stops reading early must not end the feeding of a pipe
+  signal(SIGPIPE, SIG_IGN);
+  if (check_cases) {
+    long mismatches = check(dir);
+    if (!corpus_dir && rmdir(dir) == -1)
+      printf("corpora of mismatches kept in %s\n", dir);
+    return mismatches ? 1 : 0;
+  }
+  printf("%-10s  %-6s  %-9s  %7s  %9s  %7s\n", "tool", "engine", "shape",
+         "size", "MB/s", "cyc/B");
+  for (int s = 0; s < size_count; s++) {
+    for (int k = 0; k < COUNT(shapes); k++) {
+      char file[4096];
+      snprintf(file, sizeof(file), "%s/%s-%ld", dir, shapes[k], sizes[s]);
+      if (corpus_dir && !access(file, R_OK)) {
+        free(corpus);
+        corpus = read_file(file, &corpus_len);
+      } else {
+        rng_state = 0x9e3779b97f4a7c15ULL + k;
+        write_corpus(file, shapes[k], sizes[s]);
+      }
+      bench(file, shapes[k], sizes[s]);
+      if (!corpus_dir)
+        unlink(file);
+    }
+  }
+  if (!corpus_dir)
+    rmdir(dir);
+  return 0;
+}
@@ -0,0 +1,331 @@
+#define _DEFAULT_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__has_include)
+#if __has_include(<zlib.h>)
+#include <zlib.h>
+#define HAVE_ZLIB
+#endif
+#endif
+
+#include "decode.h"
+#include "pool.h"
+#include "reader.h"
+#include "timing.h"
+
+// The few calls of each library that are needed, looked up by name.  The
+// zstd ones are declared here, as they have been stable since 1.0.
+
+#ifdef HAVE_ZLIB
+static struct {
+  int (*init)(z_stream *, int, const char *, int);   // inflateInit2_
+  int (*step)(z_stream *, int);
+  int (*reset)(z_stream *);
+  int (*end)(z_stream *);
+} zlib;
+static int zlib_loaded = 0;
+static pthread_once_t zlib_once = PTHREAD_ONCE_INIT;
+
+static void load_zlib(void) {
+  void *h = dlopen("libz.so.1", RTLD_NOW);
+  if (!h) return;
+  zlib.init = dlsym(h, "inflateInit2_");
+  zlib.step = dlsym(h, "inflate");
+  zlib.reset = dlsym(h, "inflateReset");
+  zlib.end = dlsym(h, "inflateEnd");
+  zlib_loaded = zlib.init && zlib.step && zlib.reset && zlib.end;
+}
+#endif
+
+struct zstd_in {
+  const void *src;
+  size_t size;
+  size_t pos;
+};
+
+struct zstd_out {
+  void *dst;
+  size_t size;
+  size_t pos;
+};
+
+static struct {
+  void *(*create)(void);
+  size_t (*free)(void *);
+  size_t (*step)(void *, struct zstd_out *, struct zstd_in *);
+  unsigned (*is_error)(size_t);
+} zstd;
+static int zstd_loaded = 0;
+static pthread_once_t zstd_once = PTHREAD_ONCE_INIT;
+
+static void load_zstd(void) {
+  void *h = dlopen("libzstd.so.1", RTLD_NOW);
+  if (!h) return;
+  zstd.create = dlsym(h, "ZSTD_createDCtx");
+  zstd.free = dlsym(h, "ZSTD_freeDCtx");
+  zstd.step = dlsym(h, "ZSTD_decompressStream");
+  zstd.is_error = dlsym(h, "ZSTD_isError");
+  zstd_loaded = zstd.create && zstd.free && zstd.step && zstd.is_error;
+}
+
+static int load(enum decode_format format) {
+  if (format == DECODE_ZSTD) {
+    pthread_once(&zstd_once, load_zstd);
+    return zstd_loaded;
+  }
+#ifdef HAVE_ZLIB
+  pthread_once(&zlib_once, load_zlib);
+  return zlib_loaded;
+#else
+  return 0;
+#endif
+}
+
+enum decode_format decode_detect(const char *p, size_t len) {
+  const unsigned char *u = (const unsigned char *)p;
+  if (len >= 2 && u[0] == 0x1f && u[1] == 0x8b)
+    return DECODE_GZIP;
+  // a frame, or a skippable frame like those pzstd starts with
+  if (len >= 4 && (u[0] == 0x28 || (u[0] & 0xf0) == 0x50) &&
+      u[1] == (u[0] == 0x28 ? 0xb5 : 0x2a) &&
+      u[2] == (u[0] == 0x28 ? 0x2f : 0x4d) &&
+      u[3] == (u[0] == 0x28 ? 0xfd : 0x18))
+    return DECODE_ZSTD;
+  return DECODE_NONE;
+}
+
+ssize_t decode_from_reader(void *reader, char **p, size_t len) {
+  return reader_read(reader, p, len);
+}
+
+struct codec {
+  enum decode_format format;
+#ifdef HAVE_ZLIB
+  z_stream z;
+#endif
+  void *zstd;
+};
+
+static int codec_init(struct codec *c, enum decode_format format) {
+  c->format = format;
+  if (format == DECODE_ZSTD) {
+    c->zstd = zstd.create();
+    return c->zstd ? 0 : -1;
+  }
+#ifdef HAVE_ZLIB
+  memset(&c->z, 0, sizeof(c->z));
+  // gzip only, with its header
+  return zlib.init(&c->z, 16 + MAX_WBITS, ZLIB_VERSION, sizeof(c->z)) == Z_OK ?
+    0 : -1;
+#else
+  return -1;
+#endif
+}
+
+static void codec_end(struct codec *c) {
+  if (c->format == DECODE_ZSTD) {
+    zstd.free(c->zstd);
+    return;
+  }
+#ifdef HAVE_ZLIB
+  zlib.end(&c->z);
+#endif
+}
+
+// Decodes from in[0..*in_len) into out[*out_pos..out_len), moving both on.
+// Returns 1 at the end of a gzip member or zstd frame, 0 if more is to come
+// and -1 if the stream is broken.
+static int codec_step(struct codec *c, const char **in, size_t *in_len,
+                      char *out, size_t *out_pos, size_t out_len) {
+  if (c->format == DECODE_ZSTD) {
+    struct zstd_in i = {*in, *in_len, 0};
+    struct zstd_out o = {out, out_len, *out_pos};
+    size_t res = zstd.step(c->zstd, &o, &i);
+    *in += i.pos;
+    *in_len -= i.pos;
+    *out_pos = o.pos;
+    return zstd.is_error(res) ? -1 : !res;
+  }
+#ifdef HAVE_ZLIB
+  // zlib counts in uInt
+  size_t in_step = *in_len < UINT_MAX ? *in_len : UINT_MAX;
+  c->z.next_in = (Bytef *)*in;
+  c->z.avail_in = in_step;
+  c->z.next_out = (Bytef *)out + *out_pos;
+  c->z.avail_out = out_len - *out_pos;
+  int res = zlib.step(&c->z, Z_NO_FLUSH);
+  *in += in_step - c->z.avail_in;
+  *in_len -= in_step - c->z.avail_in;
+  *out_pos = out_len - c->z.avail_out;
+  if (res == Z_STREAM_END)
+    return 1;
+  return res == Z_OK || res == Z_BUF_ERROR ? 0 : -1;
+#else
+  return -1;
+#endif
+}
+
+static void codec_reset(struct codec *c) {
+#ifdef HAVE_ZLIB
+  if (c->format == DECODE_GZIP)
+    zlib.reset(&c->z);
+#endif
+}
+
+// What there is is handed over before waiting for more input, so a slow
+// pipe is scanned as it comes.  gzip members follow each other like in
+// zcat, and anything else after one is ignored; zstd frames are decoded
+// one after the other by the library.
+static void *decode_thread(void *arg) {
+  struct decoder *d = arg;
+  struct codec c;
+  const char *in = d->first;
+  size_t in_len = d->first_len;
+  int in_end = !d->source;
+  int need_input = 0;        // nothing more comes out without it
+  int member_done = 0;       // at the end of a member or frame
+  int error = codec_init(&c, d->format) ? ENOMEM : 0;
+  while (1) {
+    pthread_mutex_lock(&d->lock);
+    while (!d->stop && d->tail - d->head == DECODE_SLOTS)
+      pthread_cond_wait(&d->cond, &d->lock);
+    int stop = d->stop;
+    pthread_mutex_unlock(&d->lock);
+    if (stop) break;
+    struct decode_slot *s = d->slots + d->tail % DECODE_SLOTS;
+    size_t pos = 0;
+    while (!error && pos < DECODE_SLOT_LEN) {
+      if (!in_len && (need_input || member_done)) {
+        if (pos || in_end) break;
+        char *p = d->input;
+        ssize_t n = d->source(d->arg, &p, d->input_len);
+        if (n == -1) {
+          error = errno;
+          break;
+        }
+        if (!n)
+          in_end = 1;
+        in = p;
+        in_len = n;
+        continue;
+      }
+      if (member_done) {
+        if (c.format == DECODE_GZIP && (unsigned char)*in != 0x1f) {
+          in_len = 0;
+          in_end = 1;
+          break;
+        }
+        codec_reset(&c);
+        member_done = 0;
+      }
+      uint64_t start = timing_start();
+      size_t from = pos;
+      int res = codec_step(&c, &in, &in_len, s->buffer, &pos,
+                           DECODE_SLOT_LEN);
+      timing_end(TIMING_DECODE, start, pos - from);
+      if (res == -1)
+        error = EBADMSG;
+      member_done = res == 1;
+      need_input = pos < DECODE_SLOT_LEN;
+    }
+    // a stream cut short is broken too
+    if (!pos && !error && !member_done)
+      error = EBADMSG;
+    pthread_mutex_lock(&d->lock);
+    s->len = pos ? (ssize_t)pos : error ? -1 : 0;
+    s->error = pos ? 0 : error;
+    d->tail++;
+    pthread_cond_broadcast(&d->cond);
+    pthread_mutex_unlock(&d->lock);
+    if (!pos) break;
+  }
+  if (d->format != DECODE_ZSTD || c.zstd)
+    codec_end(&c);
+  return 0;
+}
+
+// the slots and the input, in one buffer
+static size_t buffer_len(struct decoder *d) {
+  return DECODE_SLOTS * (size_t)DECODE_SLOT_LEN +
+    (d->source ? d->input_len : 0);
+}
+
+int decoder_start(struct decoder *d, const char *first, size_t len,
+                  decode_source *source, void *arg) {
+  memset(d, 0, sizeof(*d));
+  d->format = decode_detect(first, len);
+  if (d->format == DECODE_NONE)
+    return 0;
+  if (!load(d->format)) {
+    errno = ELIBACC;
+    return -1;
+  }
+  d->source = source;
+  d->arg = arg;
+  d->input_len = source && len > DECODE_INPUT_LEN ? len : DECODE_INPUT_LEN;
+  char *buffer = pool_get(buffer_len(d));
+  if (!buffer)
+    return -1;
+  for (int i = 0; i < DECODE_SLOTS; i++)
+    d->slots[i].buffer = buffer + i * (size_t)DECODE_SLOT_LEN;
+  if (source) {
+    d->input = buffer + DECODE_SLOTS * (size_t)DECODE_SLOT_LEN;
+    memcpy(d->input, first, len);
+    first = d->input;
+  }
+  d->first = first;
+  d->first_len = len;
+  pthread_mutex_init(&d->lock, 0);
+  pthread_cond_init(&d->cond, 0);
+  errno = pthread_create(&d->thread, 0, decode_thread, d);
+  if (errno) {
+    pthread_mutex_destroy(&d->lock);
+    pthread_cond_destroy(&d->cond);
+    pool_put(buffer, buffer_len(d));
+    return -1;
+  }
+  return 1;
+}
+
+ssize_t decoder_read(struct decoder *d, char **p, size_t len) {
+  if (d->ended)
+    return 0;
+  struct decode_slot *s = d->slots + d->head % DECODE_SLOTS;
+  pthread_mutex_lock(&d->lock);
+  if (d->slot_pos && d->slot_pos == (size_t)s->len) {
+    d->head++;
+    d->slot_pos = 0;
+    s = d->slots + d->head % DECODE_SLOTS;
+    pthread_cond_broadcast(&d->cond);
+  }
+  while (d->head == d->tail)
+    pthread_cond_wait(&d->cond, &d->lock);
+  pthread_mutex_unlock(&d->lock);
+  if (s->len <= 0) {
+    d->ended = 1;
+    errno = s->error;
+    return s->len;
+  }
+  size_t n = s->len - d->slot_pos;
+  if (n > len)
+    n = len;
+  *p = s->buffer + d->slot_pos;
+  d->slot_pos += n;
+  return n;
+}
+
+void decoder_stop(struct decoder *d) {
+  pthread_mutex_lock(&d->lock);
+  d->stop = 1;
+  pthread_cond_broadcast(&d->cond);
+  pthread_mutex_unlock(&d->lock);
+  pthread_join(d->thread, 0);
+  pthread_mutex_destroy(&d->lock);
+  pthread_cond_destroy(&d->cond);
+  pool_put(d->slots[0].buffer, buffer_len(d));
+}
@@ -0,0 +1,74 @@
+#ifndef DECODE_H
+#define DECODE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Decompresses a gzip or zstd stream on a thread of its own into a ring of
+// buffers, which the tool scans in place while the next ones are decoded.
+// The libraries are loaded when the first compressed stream turns up, so
+// none of the tools needs them to build or to run on plain files.
+
+#define DECODE_SLOTS 4
+#define DECODE_SLOT_LEN (1 << 17)
+#define DECODE_INPUT_LEN (1 << 17)
+
+enum decode_format {DECODE_NONE, DECODE_GZIP, DECODE_ZSTD};
+
+// Gives the next piece of the compressed stream, up to len bytes, either in
+// the buffer at *p or elsewhere by pointing *p there.  Returns 0 at the end
+// and -1 with errno set if reading failed, like reader_read().
+typedef ssize_t decode_source(void *arg, char **p, size_t len);
+
+// a source reading the current file of a struct reader
+ssize_t decode_from_reader(void *reader, char **p, size_t len);
+
+struct decode_slot {
+  char *buffer;
+  ssize_t len;               // 0 at the end, -1 for an error
+  int error;
+};
+
+struct decoder {
+  enum decode_format format;
+  decode_source *source;
+  void *arg;
+  const char *first;         // the stream up to where source takes over
+  size_t first_len;
+  char *input;               // for source to read into
+  size_t input_len;
+
+  struct decode_slot slots[DECODE_SLOTS];
+  unsigned head;             // slot of the tool
+  unsigned tail;             // next slot to fill
+  size_t slot_pos;           // taken of the slot at head
+  int ended;
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int stop;
+};
+
+// The format of a stream starting with p[0..len).
+enum decode_format decode_detect(const char *p, size_t len);
+
+// Starts decoding a stream that begins with first[0..len), if that shows it
+// to be compressed.  The rest of the stream comes from source, or if it is
+// NULL, first is all of it and stays valid until decoder_stop().  first is
+// copied otherwise.  Returns 1 if decoding, 0 if the stream is not
+// compressed, and -1 with errno set if its library cannot be loaded, if out
+// of memory or if the thread cannot be created.
+int decoder_start(struct decoder *d, const char *first, size_t len,
+                  decode_source *source, void *arg);
+
+// Stores in *p a piece of up to len bytes of the decoded stream, valid
+// until the next call, and returns its length.  Returns 0 at the end and -1
+// with errno set if reading failed or the stream is broken.
+ssize_t decoder_read(struct decoder *d, char **p, size_t len);
+
+// Waits for the thread, which may be reading from source, and frees all.
+void decoder_stop(struct decoder *d);
+
+#endif
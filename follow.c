@@ -0,0 +1,71 @@
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "follow.h"
+#include "timing.h"
+
+int follow_start(struct follow *f, int fd, uint64_t off) {
+  struct stat st;
+  if (fstat(fd, &st) == -1)
+    return -1;
+  if (!S_ISREG(st.st_mode))
+    return 0;
+  f->fd = fd;
+  f->off = off;
+  f->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (f->inotify == -1)
+    return -1;
+  // the file itself, even if it came as stdin
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+  if (inotify_add_watch(f->inotify, path, IN_MODIFY) == -1) {
+    int error = errno;
+    close(f->inotify);
+    errno = error;
+    return -1;
+  }
+  return 1;
+}
+
+ssize_t follow_read(struct follow *f, char *p, size_t len) {
+  while (1) {
+    timing_syscall();
+    ssize_t n = pread(f->fd, p, len, f->off);
+    if (n == -1 && errno == EINTR) continue;
+    if (n > 0)
+      f->off += n;
+    return n;
+  }
+}
+
+// An append that comes after the last read and before the wait is never
+// missed, as its event waits in the queue since the watch was added.  The
+// events are only drained, as the next read tells what there is.
+int follow_wait(struct follow *f, int timeout_ms) {
+  uint64_t deadline = timing_now() + (uint64_t)timeout_ms * 1000000;
+  while (1) {
+    int wait_ms = timeout_ms;
+    if (timeout_ms >= 0) {
+      uint64_t now = timing_now();
+      wait_ms = now < deadline ? (deadline - now + 999999) / 1000000 : 0;
+    }
+    struct pollfd pfd = {f->inotify, POLLIN, 0};
+    int res = poll(&pfd, 1, wait_ms);
+    if (res == -1 && errno == EINTR) continue;
+    if (res <= 0)
+      return res;
+    char events[4096];
+    while (read(f->inotify, events, sizeof(events)) > 0);
+    return 1;
+  }
+}
+
+void follow_stop(struct follow *f) {
+  close(f->inotify);
+}
@@ -0,0 +1,35 @@
+#ifndef FOLLOW_H
+#define FOLLOW_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Goes on reading a regular file as it grows, like tail -f.  Appends are
+// waited for with inotify, so a file that stays as it is costs nothing,
+// and reading picks up at the offset the tool has come to, so that its
+// scanner goes on from the state the earlier bytes left.
+
+struct follow {
+  int fd;
+  uint64_t off;              // next byte to read
+  int inotify;
+};
+
+// Starts following fd from offset off.  Returns 1 if following, 0 if fd
+// is not a regular file, which cannot grow under a reader, and -1 with
+// errno set if inotify cannot watch it.
+int follow_start(struct follow *f, int fd, uint64_t off);
+
+// Reads up to len bytes from where the last read stopped, without waiting.
+// Returns 0 if the file has not grown and -1 with errno set if reading
+// failed.
+ssize_t follow_read(struct follow *f, char *p, size_t len);
+
+// Waits until the file may have grown, for up to timeout_ms milliseconds,
+// or with no limit if it is -1.  Returns 1 if it may have grown, 0 if the
+// time ran out and -1 with errno set if waiting failed.
+int follow_wait(struct follow *f, int timeout_ms);
+
+void follow_stop(struct follow *f);
+
+#endif
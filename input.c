@@ -0,0 +1,30 @@
+#define _DEFAULT_SOURCE
+
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "input.h"
+
+char *input_map(int fd, size_t *len) {
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+      st.st_size < INPUT_MAP_MIN_LEN)
+    return 0;
+  if ((uintmax_t)st.st_size > SIZE_MAX || lseek(fd, 0, SEEK_CUR) != 0)
+    return 0;
+  char *p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (p == MAP_FAILED)
+    return 0;
+  madvise(p, st.st_size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+  madvise(p, st.st_size, MADV_HUGEPAGE);
+#endif
+  *len = st.st_size;
+  return p;
+}
+
+void input_unmap(char *p, size_t len) {
+  munmap(p, len);
+}
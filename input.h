@@ -0,0 +1,17 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stddef.h>
+
+// Files shorter than this are read, as mapping and unmapping them takes
+// longer than copying them, which counts with many small files.
+#define INPUT_MAP_MIN_LEN (1 << 16)
+
+// Maps fd for one sequential pass if it is a regular file of at least
+// INPUT_MAP_MIN_LEN bytes read from the start.  Returns NULL if it has to be
+// read() instead.
+char *input_map(int fd, size_t *len);
+
+void input_unmap(char *p, size_t len);
+
+#endif
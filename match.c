@@ -1,264 +1,1722 @@
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "ac.h"
+#include "decode.h"
+#include "follow.h"
+#include "input.h"
+#include "pool.h"
+#include "reader.h"
+#include "search.h"
+#include "stats.h"
+#include "timing.h"
+#include "tuidx.h"
+#include "util.h"
+#include "walk.h"
+
 char *help_text =
-  "match [-chr] [-m <columns>] [--] <pattern> <file>*\n"
-  "Searches standard input or named files for exact match of pattern.\n"
-  "Understands only bytes, assumes binary if and only if maximum line length\n"
-  "is exceeded.\n"
-  "  -c            Report only number of matches\n"
+  "match [-FRbchilnqrx] [-A <lines>] [-B <lines>] [-j <jobs>] [-m <columns>]\n"
+  "      [--buffer-size=<bytes>] [--count-matches-only] [--fold-finnish]\n"
+  "      [--max-count=<lines>] [--snapshot=<seconds>] [--unordered]\n"
+  "      [--no-decompress] [--no-mmap] [--no-uring] [--stats-timing] [--]\n"
+  "      (<pattern> | -e <pattern>... | -f <file>) <file>*\n"
+  "Searches standard input or named files for exact match of pattern.  gzip\n"
+  "and zstd files are decompressed.\n"
+  "Understands only bytes, assumes binary from where more than one byte in\n"
+  "512 of the last 4k, or of all before near the start, is NUL.  Lines longer\n"
+  "than the maximum are printed only around their matches.\n"
+  "With more than one pattern, all are searched in one pass and the leftmost\n"
+  "match, the longest there, is taken.\n"
+  "  -A <lines>    Print <lines> lines of context after each matching line\n"
+  "  -B <lines>    Print <lines> lines of context before each matching line\n"
+  "  -R            Search all files under the directories named, or under .,\n"
+  "                in name order, biggest first with -j, with the name of the\n"
+  "                file before each line; one that cannot be read is warned\n"
+  "                about and makes the exit status 2\n"
+  "  -F            Follow the file, which must be the only one, as it grows\n"
+  "                like tail -f, printing new matches as they come, and with\n"
+  "                -c the counts whenever more has been searched\n"
+  "  -b            Print the byte offset of each line before it\n"
+  "  -c            Report only number of matches, also for each pattern\n"
+  "  -e <pattern>  Search for <pattern>, may be given many times\n"
+  "  -f <file>     Search for each nonempty line of <file>\n"
   "  -h            Print this help text\n"
+  "  -i            Match ASCII letters in either case; -x is not used then\n"
+  "  -j <jobs>     Scan up to <jobs> files at the same time\n"
+  "  -l            Print only the names of files that match, each searched\n"
+  "                only up to its first match\n"
+  "  -n            Print the line number of each line before it\n"
+  "  -q            Print nothing, and exit at the first match with status 0\n"
   "  -r            Use color codes in output\n"
-  "  -m <columns>  Handle maximum line length of <columns> (default: 64k)\n";
-
-int use_color = 0;
+  "  -x            Skip the blocks of files that their <file>.tuidx index\n"
+  "                files rule out\n"
+  "  -m <columns>  Print lines longer than <columns> (default: 64k) as pieces\n"
+  "                of up to <columns> / 2 bytes on either side of a match,\n"
+  "                which are never context\n"
+  "  --buffer-size=<bytes>\n"
+  "                Read files in pieces of up to <bytes>, by default 128k,\n"
+  "                or 1M when the first file is big and read, not mapped\n"
+  "  --count-matches-only\n"
+  "                Like -c but without matching lines, which leaves the\n"
+  "                lines out altogether: matches are counted over the whole\n"
+  "                file, like in binary files\n"
+  "  --fold-finnish\n"
+  "                Like -i, and match the utf8 letters ä, å and ö in either\n"
+  "                case too\n"
+  "  --max-count=<lines>\n"
+  "                Stop searching each file after <lines> matching lines, or\n"
+  "                as many matches in binary data and with\n"
+  "                --count-matches-only; the context due after the last line\n"
+  "                is still printed\n"
+  "  --snapshot=<seconds>\n"
+  "                With -F -c, report the counts every <seconds> instead\n"
+  "  --unordered   Write output of parallel scans as soon as it is ready,\n"
+  "                instead of in the order of the files\n"
+  "  --no-decompress\n"
+  "                Search compressed files as they are\n"
+  "  --no-mmap     Read regular files instead of mapping them\n"
+  "  --no-uring    Read ahead with a thread instead of io_uring\n"
+  "  --stats-timing\n"
+  "                Report to stderr at exit and on SIGUSR1 how long reading,\n"
+  "                decompressing, searching, writing and moving what is left\n"
+  "                of a buffer took, in how many calls and on how many bytes\n";
 
-char *foreground_red = "\033[31m";
-char *foreground_green = "\033[32m";
-char *foreground_reset = "\033[39m";
-char *attribute_reset = "\033[0m";
-char *bold = "\033[1m";
-
-void color_vprintf(char *color, char *fmt, va_list ap) {
-  if (use_color) fprintf(stderr, "%s", color);
-  vfprintf(stderr, fmt, ap);
-  if (use_color) fprintf(stderr, "%s", foreground_reset);
-}
-
-void err_vprintf(char *fmt, va_list ap) {
-  color_vprintf(foreground_red, fmt, ap);
-}
-
-void info_vprintf(char *fmt, va_list ap) {
-  color_vprintf(foreground_green, fmt, ap);
-}
-
-void err_printf(char *fmt, ...) {
-  va_list ap;
-  va_start(ap, fmt);
-  err_vprintf(fmt, ap);
-  va_end(ap);
-}
-
-void info_printf(char *fmt, ...) {
-  va_list ap;
-  va_start(ap, fmt);
-  info_vprintf(fmt, ap);
-  va_end(ap);
-}
-
-void errno_printf(char *fmt, ...) {
-  va_list ap;
-  va_start(ap, fmt);
-  err_vprintf(fmt, ap);
-  va_end(ap);
-  err_printf(": %s (%d)\n", strerror(errno), errno);
-  exit(errno);
-}
-
-void exit_printf(char *fmt, ...) {
-  va_list ap;
-  va_start(ap, fmt);
-  err_vprintf(fmt, ap);
-  va_end(ap);
-  exit(1);
-}
+long max_columns = 65536L;
+int report_count = 0;
+int count_only = 0;
+int list_files = 0;
+int quiet = 0;
+uint64_t max_count = UINT64_MAX;
+int use_decompress = 1;
+int use_mmap = 1;
+int use_uring = 1;
+int use_index = 0;
+int thread_count = 1;
+int unordered = 0;
+int line_numbers = 0;
+int byte_offsets = 0;
+long after_context = 0;
+long before_context = 0;
+int use_context = 0;
+int ignore_case = 0;
+int fold_finnish = 0;
+int follow = 0;
+int recursive = 0;
+uint64_t snapshot_ns = 0;        // 0 for a report after each growth
 
-long str2long(char *str) {
-  char *end;
-  long res = strtol(str, &end, 10);
-  if (!*str || *end)
-    exit_printf("cannot convert \"%s\" to long\n", str);
-  return res;
-}
+char **patterns;
+size_t *pattern_lens;
+int pattern_count = 0;
+int pattern_cap = 0;
+int pattern_option = 0;
+// the pattern that takes the matches of each, the first of those that are
+// the same, as with -e x -e x or as folded by -i
+int *same_pattern;
 
-int file4read(char *name) {
-  int fd = open(name, O_RDONLY);
-  if (fd == -1)
-    errno_printf("cannot open file \"%s\"", name);
-  return fd;
+void add_pattern(char *pattern, size_t len) {
+  if (pattern_count == pattern_cap) {
+    pattern_cap = pattern_cap ? 2 * pattern_cap : 16;
+    patterns = realloc(patterns, pattern_cap * sizeof(char *));
+    pattern_lens = realloc(pattern_lens, pattern_cap * sizeof(size_t));
+    if (!patterns || !pattern_lens)
+      exit_printf("cannot allocate %d patterns\n", pattern_cap);
+  }
+  patterns[pattern_count] = pattern;
+  pattern_lens[pattern_count++] = len;
 }
 
-void *allocate(int size) {
-  char *res = malloc(size);
-  if (!res)
-    exit_printf("cannot allocate %d bytes\n", size);
-  return res;
+// The file is kept in memory, its lines are the patterns, without the CR
+// of a CRLF line end.
+void read_patterns(char *name) {
+  int fd = file4read(name);
+  size_t len = 0, cap = 65536;
+  char *p = allocate(cap);
+  while (1) {
+    if (len == cap) {
+      cap *= 2;
+      p = realloc(p, cap);
+      if (!p)
+        exit_printf("cannot allocate %zu bytes\n", cap);
+    }
+    ssize_t n = read(fd, p + len, cap - len);
+    if (n == -1)
+      errno_printf("cannot read \"%s\"", name);
+    if (!n) break;
+    len += n;
+  }
+  close(fd);
+  char *end = p + len;
+  while (p < end) {
+    char *nl = memchr(p, '\n', end - p);
+    char *line_end = nl ? nl : end;
+    char *stop = line_end > p && line_end[-1] == '\r' ? line_end - 1 :
+      line_end;
+    if (stop > p)
+      add_pattern(p, stop - p);
+    p = line_end + 1;
+  }
 }
 
-long max_columns = 65536L;
-int report_count = 0;
-
 void parse_options(int argc, char **argv) {
   while (1) {
     static struct option long_options[] =
       {
+       {"after-context", required_argument, 0, 'A'},
+       {"before-context", required_argument, 0, 'B'},
+       {"byte-offset", no_argument, 0, 'b'},
        {"count", no_argument, 0, 'c'},
+       {"buffer-size", required_argument, 0, 'K'},
+       {"count-matches-only", no_argument, 0, 'C'},
+       {"pattern", required_argument, 0, 'e'},
+       {"file", required_argument, 0, 'f'},
        {"help", no_argument, 0, 'h'},
+       {"ignore-case", no_argument, 0, 'i'},
+       {"follow", no_argument, 0, 'F'},
+       {"recursive", no_argument, 0, 'R'},
+       {"fold-finnish", no_argument, 0, 'L'},
+       {"jobs", required_argument, 0, 'j'},
+       {"files-with-matches", no_argument, 0, 'l'},
+       {"max-count", required_argument, 0, 'N'},
        {"max-columns", required_argument, 0, 'm'},
+       {"line-number", no_argument, 0, 'n'},
+       {"quiet", no_argument, 0, 'q'},
        {"color", no_argument, 0, 'r'},
+       {"index", no_argument, 0, 'x'},
+       {"snapshot", required_argument, 0, 'S'},
+       {"unordered", no_argument, 0, 'U'},
+       {"no-decompress", no_argument, 0, 'Z'},
+       {"no-mmap", no_argument, 0, 'M'},
+       {"no-uring", no_argument, 0, 'I'},
+       {"stats-timing", no_argument, 0, 'T'},
        {}
       };
     int option_index = 0;
-    int c = getopt_long(argc, argv, "chm:r", long_options, &option_index);
+    int c = getopt_long(argc, argv, "A:B:FRbce:f:hij:lm:nqrx", long_options,
+                        &option_index);
     if (c == -1) break;
     switch (c) {
+    case 'A':
+      after_context = str2long(optarg);
+      use_context = 1;
+      if (after_context < 0)
+        exit_printf("context must be at least 0\n");
+      break;
+    case 'B':
+      before_context = str2long(optarg);
+      use_context = 1;
+      if (before_context < 0)
+        exit_printf("context must be at least 0\n");
+      break;
+    case 'F':
+      follow = 1;
+      break;
+    case 'R':
+      recursive = 1;
+      break;
+    case 'b':
+      byte_offsets = 1;
+      break;
     case 'c':
       report_count = 1;
       break;
+    case 'C':
+      report_count = count_only = 1;
+      break;
+    case 'e':
+      add_pattern(optarg, strlen(optarg));
+      pattern_option = 1;
+      break;
+    case 'f':
+      read_patterns(optarg);
+      pattern_option = 1;
+      break;
     case 'h':
       fprintf(stderr, "%s", help_text);
       exit(0);
+    case 'i':
+      ignore_case = 1;
+      break;
+    case 'L':
+      ignore_case = fold_finnish = 1;
+      break;
+    case 'j':
+      thread_count = str2long(optarg);
+      if (thread_count < 1)
+        exit_printf("jobs must be at least 1\n");
+      break;
+    case 'l':
+      list_files = 1;
+      break;
+    case 'N': {
+      long count = str2long(optarg);
+      if (count < 1)
+        exit_printf("max count must be at least 1\n");
+      max_count = count;
+      break;
+    }
     case 'm':
       max_columns = str2long(optarg);
       break;
+    case 'n':
+      line_numbers = 1;
+      break;
+    case 'q':
+      quiet = 1;
+      break;
     case 'r':
       use_color = 1;
       break;
+    case 'x':
+      use_index = 1;
+      break;
+    case 'S': {
+      long seconds = str2long(optarg);
+      if (seconds < 1)
+        exit_printf("snapshot interval must be at least 1 second\n");
+      snapshot_ns = seconds * 1000000000ULL;
+      break;
+    }
+    case 'U':
+      unordered = 1;
+      break;
+    case 'K': {
+      long len = str2long(optarg);
+      if (len < 4096 || len > 1 << 30)
+        exit_printf("buffer size must be from 4096 bytes to 1G\n");
+      reader_buffer_len = len;
+      break;
+    }
+    case 'Z':
+      use_decompress = 0;
+      break;
+    case 'M':
+      use_mmap = 0;
+      break;
+    case 'I':
+      use_uring = 0;
+      break;
+    case 'T':
+      timing_enabled = 1;
+      break;
     }
   }
 }
 
-char *match_param;
-int match_param_len;
+// With --fold-finnish each pattern stands for all the ways of writing its
+// ä, å and ö in either case.  The automaton gets them all, and a match of
+// one counts for the pattern it came from.
+#define MAX_FINNISH_LETTERS 10
 
-char *buffer;
-int buffer_pos = 0;
-int buffer_len;
+char **variants;
+size_t *variant_lens;
+int *variant_of;
+int variant_count = 0;
+int variant_cap = 0;
 
-int state_binary = 0;
+void add_variant(char *pattern, size_t len, int of) {
+  if (variant_count == variant_cap) {
+    variant_cap = variant_cap ? 2 * variant_cap : 16;
+    variants = realloc(variants, variant_cap * sizeof(char *));
+    variant_lens = realloc(variant_lens, variant_cap * sizeof(size_t));
+    variant_of = realloc(variant_of, variant_cap * sizeof(int));
+    if (!variants || !variant_lens || !variant_of)
+      exit_printf("cannot allocate %d patterns\n", variant_cap);
+  }
+  variants[variant_count] = pattern;
+  variant_lens[variant_count] = len;
+  variant_of[variant_count++] = of;
+}
 
-void output_part(char *start, char *ptr) {
-  if (state_binary || report_count || !use_color) return;
+// The letters are found by the last bytes of their utf8, after 0xc3, which
+// only differ by case in the bit 0x20 like in latin1.
+void add_variants(int of) {
+  char *p = patterns[of];
+  size_t len = pattern_lens[of];
+  size_t at[MAX_FINNISH_LETTERS];
+  int n = 0;
+  for (size_t i = 1; i < len; i++) {
+    if ((unsigned char)p[i - 1] != 0xc3) continue;
+    for (int k = 0; k < STATS_FINNISH_LETTERS; k++) {
+      if (((unsigned char)p[i] | 0x20) !=
+          (0xa0 | (stats_finnish_upper[k] & 0x3f)))
+        continue;
+      if (n == MAX_FINNISH_LETTERS)
+        exit_printf("more than %d of ä, å and ö in a pattern\n",
+                    MAX_FINNISH_LETTERS);
+      at[n++] = i;
+    }
+  }
+  if (!n) {
+    add_variant(p, len, of);
+    return;
+  }
+  for (unsigned m = 0; m < 1u << n; m++) {
+    char *v = allocate(len);
+    memcpy(v, p, len);
+    for (int k = 0; k < n; k++)
+      v[at[k]] = m >> k & 1 ? v[at[k]] | 0x20 : v[at[k]] & ~0x20;
+    add_variant(v, len, of);
+  }
+}
+
+size_t min_pattern_len;
+size_t max_pattern_len;
+struct search search;
+struct ac ac;
+int use_ac = 0;
+unsigned char fold_table[256];
+// counting with -c needs no lines but those of hits
+int fast_count = 0;
+// with -c, -l and -q nothing of the lines is written
+int no_lines = 0;
+// lines are written with more than themselves: a prefix or context
+int decorate = 0;
+
+// Leftmost match in p[0..len), stores the index of its pattern.
+char *find_match(char *p, size_t len, int *which) {
+  if (!use_ac) {
+    *which = 0;
+    return search_find(&search, p, len);
+  }
+  char *hit = ac_find(&ac, p, len, which);
+  if (hit && variant_count)
+    *which = variant_of[*which];
+  return hit;
+}
+
+// Binary data starts at the first NUL that makes more than one byte in 512
+// of the BINARY_WINDOW bytes ending with it NUL, or of all of them if
+// there are fewer.
+#define BINARY_WINDOW 4096
+#define BINARY_NULS (BINARY_WINDOW / 512)
+
+// One file, with its own state and its own output waiting for its turn.
+struct job {
+  char *name;
+  int named;                 // on the command line, not found by -R
+  int fd;
+  int error;
+  struct decoder decoder;
+  int decoding;
+
+  char *buffer;              // read_buffer, or a piece scanned in place
+  size_t buffer_pos;
+  size_t buffer_len;         // of read_buffer
+  char *read_buffer;
+  uint64_t buffer_off;       // stream offset of the buffer start
+  int state_binary;
+  size_t binary_from;        // where the next match may start
+  uint64_t nul_count;        // seen so far
+  uint64_t nuls[BINARY_NULS + 1]; // stream offsets of the last of them
+
+  int long_line;             // inside a line longer than max_columns
+  int long_matched;
+  uint64_t line_start;       // stream offsets, like buffer_off
+  uint64_t long_from;        // where the next match may start
+  int in_piece;
+  uint64_t piece_pos;        // written up to here
+  uint64_t piece_end;        // context ends here unless another match comes
+
+  // for -n, -b, -A and -B, in stream offsets but for the pointers
+  char *base;                // the stream at buffer_off, in map or buffer
+  uint64_t lines_off;        // newlines before this are counted
+  uint64_t line_number;      // of the line that lines_off is in
+  uint64_t printed_end;      // where the last line written ends
+  uint64_t context_from;     // no context is taken from before this
+  long after_left;           // lines of context still due after a match
+  int grouped;               // some line has been written
+  char *before;              // the last lines dropped from the buffer
+  size_t before_len;
+  size_t before_cap;
+  uint64_t before_off;
+
+  uint64_t line_match_count;
+  uint64_t match_count;
+  uint64_t *pattern_match_count;
+  int stopped;               // at max_count, only context is left to write
+
+  // for -F
+  uint64_t taken;            // bytes read of the file
+  struct follow follow;
+  int following;
+
+  char *out;
+  size_t out_len;
+  size_t out_cap;
+  int index;                 // of the file
+  int written;               // some output has gone to stdout
+  int active;                // taken by a file not yet reported
+  int turn;                  // the file that takes the slot next
+  int done;
+};
+
+// The jobs are a ring of slots that the files take in order, each waiting
+// for its slot until the file there before it has been reported, so that
+// any number of files takes only so much memory.
+#define JOB_SLOTS_PER_THREAD 16
+
+struct job *jobs;
+int slot_count;
+char **job_names;
+char *job_named;
+int job_count;
+int next_job = 0;
+int next_output = 0;
+
+// the counts of the files reported so far
+uint64_t reported_match_count = 0;
+uint64_t reported_line_match_count = 0;
+uint64_t *reported_pattern_match_count;
+int reported_binary = 0;
+int reported_error = 0;
+
+pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t slot_free = PTHREAD_COND_INITIALIZER;
+pthread_cond_t output_turn = PTHREAD_COND_INITIALIZER;
+
+// output is handed over to stdout in pieces of about this size
+size_t out_spill_len = 1 << 16;
+// and a file waits for its turn once it has this much that is not
+size_t out_hold_len = 1 << 24;
+
+// Makes room for need bytes in *p, keeping the first used, with a buffer
+// from the pool of at least first bytes, which goes back with the job.
+void grow(char **p, size_t *cap, size_t used, size_t need, size_t first) {
+  if (need <= *cap) return;
+  size_t len = pool_len(need > first ? need : first);
+  char *q = pool_get(len);
+  if (!q)
+    exit_printf("cannot allocate %zu bytes\n", len);
+  if (used)
+    memcpy(q, *p, used);
+  pool_put(*p, *cap);
+  *p = q;
+  *cap = len;
+}
+
+void out_write(struct job *j, char *p, size_t len) {
+  grow(&j->out, &j->out_cap, j->out_len, j->out_len + len, out_spill_len);
+  memcpy(j->out + j->out_len, p, len);
+  j->out_len += len;
+}
+
+void out_str(struct job *j, char *str) {
+  out_write(j, str, strlen(str));
+}
+
+// "--" also goes between the context of one file and the next.
+int context_written = 0;
+
+void write_output(struct job *j) {
+  if (use_context && !no_lines && j->out_len && !j->written) {
+    if (context_written)
+      fwrite("--\n", 1, 3, stdout);
+    context_written = j->written = 1;
+  }
+  uint64_t start = timing_start();
+  fwrite(j->out, 1, j->out_len, stdout);
+  timing_end(TIMING_WRITE, start, j->out_len);
+  j->out_len = 0;
+}
+
+void report_job(struct job *j) {
+  char *name = j->name ? j->name : "-";
+  // a file that -R found may be gone or unreadable, and the others go on
+  if (j->error && j->named) {
+    errno = j->error;
+    errno_printf(j->fd == -1 ? "cannot open file \"%s\"" : "cannot read \"%s\"",
+                 name);
+  } else if (j->error) {
+    warn_printf(j->fd == -1 ? "cannot open file \"%s\": %s\n" :
+                "cannot read \"%s\": %s\n", name, strerror(j->error));
+    reported_error = 1;
+  }
+  write_output(j);
+  if (j->state_binary && j->match_count && !no_lines)
+    info_printf(recursive ? "binary file \"%s\" matches\n" :
+                "binary file matches\n", name);
+  pool_put(j->out, j->out_cap);
+  j->out = 0;
+  j->out_cap = 0;
+  reported_match_count += j->match_count;
+  reported_line_match_count += j->line_match_count;
+  reported_binary |= j->state_binary;
+  for (int k = 0; j->pattern_match_count && k < pattern_count; k++)
+    reported_pattern_match_count[k] += j->pattern_match_count[k];
+  j->active = 0;
+  j->turn = j->index + slot_count;
+  pthread_cond_broadcast(&slot_free);
+}
+
+// Writes what a job has so far if it is first in line or order does not
+// matter.  Called at line boundaries, so lines are never mixed.  A later
+// file with too much output held waits until it is first, so that many
+// files with much output each take only so much memory.
+void spill(struct job *j) {
+  pthread_mutex_lock(&output_lock);
+  while (!unordered && j->index != next_output && j->out_len >= out_hold_len)
+    pthread_cond_wait(&output_turn, &output_lock);
+  if (unordered || j->index == next_output)
+    write_output(j);
+  pthread_mutex_unlock(&output_lock);
+}
+
+void finish(struct job *j) {
+  pthread_mutex_lock(&output_lock);
+  j->done = 1;
+  if (unordered) {
+    report_job(j);
+  } else {
+    while (next_output < job_count) {
+      struct job *next = jobs + next_output % slot_count;
+      if (!next->active || next->index != next_output || !next->done)
+        break;
+      report_job(next);
+      next_output++;
+      pthread_cond_broadcast(&output_turn);
+    }
+  }
+  pthread_mutex_unlock(&output_lock);
+}
+
+void output_part(struct job *j, char *start, char *ptr, size_t len) {
   if (ptr > start)
-    fwrite(start, 1, ptr - start, stdout);
-  printf("%s", bold);
-  fwrite(ptr, 1, match_param_len, stdout);
-  printf("%s", attribute_reset);
+    out_write(j, start, ptr - start);
+  out_str(j, bold);
+  out_write(j, ptr, len);
+  out_str(j, attribute_reset);
 }
 
-void output_tail(char *start, int len) {
-  if (state_binary || report_count || !use_color) return;
-  fwrite(start, 1, len, stdout);
+uint64_t offset_of(struct job *j, char *p) {
+  return j->buffer_off + (p - j->base);
 }
 
-void output_full(char *line, int len) {
-  if (state_binary || report_count || use_color) return;
-  fwrite(line, 1, len, stdout);
+char *at_offset(struct job *j, uint64_t off) {
+  return j->base + (off - j->buffer_off);
 }
 
-int line_match_count = 0;
-int match_count = 0;
+// The number of the line that stream offset off is in.  Newlines are
+// counted on from the last call, so off must not go back past one, and
+// the bytes in between must still be in memory.
+uint64_t line_number_at(struct job *j, uint64_t off) {
+  if (off > j->lines_off) {
+    j->line_number += search_count(at_offset(j, j->lines_off),
+                                   off - j->lines_off, '\n');
+    j->lines_off = off;
+  }
+  return j->line_number;
+}
 
-void consume_line(char *line, int line_len) {
+// Digits of n followed by sep, written backwards from end.  Returns where
+// they start.
+char *put_number(char *end, uint64_t n, char sep) {
+  *--end = sep;
+  do {
+    *--end = '0' + n % 10;
+    n /= 10;
+  } while (n);
+  return end;
+}
+
+// "<file>:<line number>:<byte offset>:" as far as asked for, '-' for
+// context.
+void output_prefix(struct job *j, uint64_t number, uint64_t off, char sep) {
+  if (recursive) {
+    out_str(j, j->name);
+    out_write(j, &sep, 1);
+  }
+  char prefix[48];
+  char *p = prefix + sizeof(prefix);
+  if (byte_offsets)
+    p = put_number(p, off, sep);
+  if (line_numbers)
+    p = put_number(p, number, sep);
+  out_write(j, p, prefix + sizeof(prefix) - p);
+}
+
+// Writes the lines in p[0..len), which starts at stream offset off, as
+// context numbered from *number on.
+void output_context(struct job *j, char *p, size_t len, uint64_t off,
+                    uint64_t *number) {
+  char *end = p + len;
+  while (p < end) {
+    char *nl = memchr(p, '\n', end - p);
+    size_t n = nl ? (size_t)(nl - p) + 1 : (size_t)(end - p);
+    output_prefix(j, (*number)++, off, '-');
+    out_write(j, p, n);
+    p += n;
+    off += n;
+  }
+  j->printed_end = j->context_from = off;
+}
+
+// Writes the lines of context still due after the last matching line that
+// start before stream offset to.
+void context_after(struct job *j, uint64_t to) {
+  while (j->after_left && j->printed_end < to) {
+    uint64_t off = j->printed_end;
+    char *line = at_offset(j, off);
+    char *nl = memchr(line, '\n', to - off);
+    size_t len = nl ? (size_t)(nl - line) + 1 : to - off;
+    uint64_t number = line_numbers ? line_number_at(j, off) : 0;
+    output_context(j, line, len, off, &number);
+    j->after_left--;
+  }
+}
+
+// Moves p back over lines down to lo while *n is short of
+// before_context, counting them in *n.
+char *lines_back(char *lo, char *p, long *n) {
+  while (*n < before_context && p > lo) {
+    char *nl = memrchr(lo, '\n', p - 1 - lo);
+    p = nl ? nl + 1 : lo;
+    ++*n;
+  }
+  return p;
+}
+
+// The lines before the buffer that -B may still want are copied aside as
+// the buffer drops them.  They go on from those kept before if there are
+// too few.
+void save_before(struct job *j, size_t drop) {
+  uint64_t from = j->context_from > j->buffer_off ?
+    j->context_from - j->buffer_off : 0;
+  if (from >= drop) {
+    j->before_len = 0;
+    return;
+  }
+  long n = 0;
+  char *p = lines_back(j->buffer + from, j->buffer + drop, &n);
+  size_t keep = 0;
+  if (n < before_context && p == j->buffer &&
+      j->before_off + j->before_len == j->buffer_off) {
+    size_t lo = j->context_from > j->before_off ?
+      j->context_from - j->before_off : 0;
+    char *end = j->before + j->before_len;
+    char *q = lo < j->before_len ? lines_back(j->before + lo, end, &n) : end;
+    keep = end - q;
+    memmove(j->before, q, keep);
+  }
+  size_t len = j->buffer + drop - p;
+  grow(&j->before, &j->before_cap, keep, keep + len, POOL_MIN_LEN);
+  memcpy(j->before + keep, p, len);
+  j->before_len = keep + len;
+  j->before_off = j->buffer_off + drop - j->before_len;
+}
+
+// Before a matching line at stream offset off, the context due after the
+// last one, then that before this one, with "--" between lines that do
+// not follow each other, and the prefix of the line.
+void output_start(struct job *j, char *line) {
+  uint64_t off = offset_of(j, line);
+  context_after(j, off);
+  uint64_t number = line_numbers ? line_number_at(j, off) : 0;
+  uint64_t from = j->context_from > j->buffer_off ? j->context_from :
+    j->buffer_off;
+  long n = 0;
+  char *p = lines_back(at_offset(j, from), line, &n);
+  char *saved = j->before + j->before_len;
+  if (n < before_context && from == j->buffer_off && j->before_len &&
+      j->before_off + j->before_len == j->buffer_off) {
+    size_t lo = j->context_from > j->before_off ?
+      j->context_from - j->before_off : 0;
+    if (lo < j->before_len)
+      saved = lines_back(j->before + lo, saved, &n);
+  }
+  size_t saved_len = j->before + j->before_len - saved;
+  uint64_t first = saved_len ? j->before_off + (saved - j->before) :
+    offset_of(j, p);
+  if (use_context && j->grouped &&
+      first != j->printed_end)
+    out_str(j, "--\n");
+  number -= n;
+  if (saved_len)
+    output_context(j, saved, saved_len, first, &number);
+  output_context(j, p, line - p, offset_of(j, p), &number);
+  output_prefix(j, number, off, ':');
+}
+
+// After a matching line that ends at stream offset end.
+void output_end(struct job *j, uint64_t end) {
+  j->printed_end = j->context_from = end;
+  j->after_left = after_context;
+  j->grouped = 1;
+}
+
+// Binary data has no lines, so its matches count towards max_count, and
+// so do those of --count-matches-only.
+void count_match(struct job *j, int which) {
+  j->match_count += 1;
+  if (j->pattern_match_count)
+    j->pattern_match_count[which]++;
+  if ((j->state_binary || count_only) && j->match_count >= max_count)
+    j->stopped = 1;
+}
+
+void count_line(struct job *j) {
+  if (++j->line_match_count >= max_count)
+    j->stopped = 1;
+}
+
+// How matching lines are written: not at all when counting or in binary
+// data, as they are or with the matches in color, and with prefixes and
+// context or without.  consume_line_as() is inlined with the mode as a
+// constant, so each variant has only the branches of its own mode.
+enum line_mode {LINES_COUNT, LINES_PLAIN, LINES_COLOR, LINES_DECORATED,
+                LINES_DECORATED_COLOR};
+
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+
+ALWAYS_INLINE void consume_line_as(struct job *j, char *line, size_t line_len,
+                                   enum line_mode mode) {
+  int write = mode != LINES_COUNT;
+  int color = mode == LINES_COLOR || mode == LINES_DECORATED_COLOR;
+  int decorated = mode == LINES_DECORATED || mode == LINES_DECORATED_COLOR;
   int line_match = 0;
   char *prev = line;
   char *start = line;
-  int len = line_len;
-  while (len >= match_param_len) {
-    char *ptr = memchr(start, match_param[0], len - match_param_len + 1);
+  size_t len = line_len;
+  while (len >= min_pattern_len) {
+    int which;
+    char *ptr = find_match(start, len, &which);
     if (!ptr) break;
-    if (!memcmp(ptr, match_param, match_param_len)) {
-      output_part(prev, ptr);
-      match_count += 1;
-      line_match = 1;
-      prev = start = ptr + match_param_len;
-      len = line_len - (start - line);
-    } else {
-      start = ptr + 1;
-      len = line_len - (start - line);
-    }
+    if (decorated && !line_match)
+      output_start(j, line);
+    if (color)
+      output_part(j, prev, ptr, pattern_lens[which]);
+    count_match(j, which);
+    line_match = 1;
+    prev = start = ptr + pattern_lens[which];
+    if (j->stopped) break;
+    len = line_len - (start - line);
   }
   if (line_match) {
-    output_full(line, line_len);
-    output_tail(prev, line_len - (prev - line));
-    line_match_count++;
+    if (color)
+      out_write(j, prev, line_len - (prev - line));
+    else if (write)
+      out_write(j, line, line_len);
+    count_line(j);
+    if (decorated)
+      output_end(j, offset_of(j, line + line_len));
+    if (write && j->out_len >= out_spill_len)
+      spill(j);
+  }
+}
+
+// Moves what is left after the first drop bytes of the buffer to its
+// start, or in a piece scanned in place, moves the start.
+void carry(struct job *j, size_t drop) {
+  if (line_numbers && !j->state_binary)
+    line_number_at(j, j->buffer_off + drop);
+  if (j->buffer != j->read_buffer) {
+    j->buffer += drop;
+    j->base = j->buffer;
+    return;
+  }
+  uint64_t start = timing_start();
+  memmove(j->buffer, j->buffer + drop, j->buffer_pos - drop);
+  timing_end(TIMING_CARRY, start, j->buffer_pos - drop);
+}
+
+// Binary data is only counted.  A match is certain once max_pattern_len
+// bytes from its start have been read, as no longer one can start there or
+// earlier; the last max_pattern_len - 1 bytes are kept for the next read
+// unless it is the final one.
+void consume_binary(struct job *j, int final) {
+  size_t keep = max_pattern_len - 1;
+  size_t until = final ? j->buffer_pos :
+    j->buffer_pos > keep ? j->buffer_pos - keep : 0;
+  size_t from = j->binary_from;
+  while (from < until) {
+    int which;
+    char *ptr = find_match(j->buffer + from, j->buffer_pos - from, &which);
+    if (!ptr || ptr - j->buffer >= until) break;
+    count_match(j, which);
+    from = ptr - j->buffer + pattern_lens[which];
+    if (j->stopped) break;
+  }
+  if (j->buffer_pos > keep) {
+    size_t drop = j->buffer_pos - keep;
+    carry(j, drop);
+    j->buffer_pos = keep;
+    from = from > drop ? from - drop : 0;
+  }
+  j->binary_from = from;
+}
+
+// Counts the matches in p[0..len), and unless count_only the lines of
+// them, by the end of the line of the last one.  Matches never span lines
+// here, so it comes out the same as from consume_line() on each line, also
+// when max_count ends the search with the line it is reached in.
+void count_lines(struct job *j, char *p, size_t len) {
+  char *end = p + len;
+  char *line_end = p;        // lines before this are counted
+  while ((size_t)(end - p) >= min_pattern_len) {
+    int which;
+    char *hit = find_match(p, end - p, &which);
+    if (!hit) return;
+    count_match(j, which);
+    if (count_only && j->stopped) return;
+    p = hit + pattern_lens[which];
+    if (!count_only && hit >= line_end) {
+      count_line(j);
+      char *nl = memchr(p, '\n', end - p);
+      line_end = nl ? nl + 1 : end;
+      if (j->stopped)
+        end = line_end;
+    }
+  }
+}
+
+// Searches complete lines all at once and only looks for the line around
+// a hit, so that lines without a match cost nothing but the search.
+ALWAYS_INLINE void consume_lines_as(struct job *j, char *p, size_t len,
+                                    enum line_mode mode) {
+  char *end = p + len;
+  while ((size_t)(end - p) >= min_pattern_len) {
+    int which;
+    char *hit = find_match(p, end - p, &which);
+    if (!hit) break;
+    char *line = memrchr(p, '\n', hit - p);
+    line = line ? line + 1 : p;
+    char *nl = memchr(hit, '\n', end - hit);
+    char *line_end = nl ? nl + 1 : end;
+    consume_line_as(j, line, line_end - line, mode);
+    p = line_end;
+    if (j->stopped) break;
+  }
+  if (mode == LINES_DECORATED || mode == LINES_DECORATED_COLOR)
+    context_after(j, offset_of(j, end));
+}
+
+#define LINE_MODE(name, mode)                                           \
+  void consume_line_##name(struct job *j, char *line, size_t len) {     \
+    consume_line_as(j, line, len, mode);                                \
+  }                                                                     \
+  void consume_lines_##name(struct job *j, char *p, size_t len) {       \
+    consume_lines_as(j, p, len, mode);                                  \
   }
+
+LINE_MODE(count, LINES_COUNT)
+LINE_MODE(plain, LINES_PLAIN)
+LINE_MODE(color, LINES_COLOR)
+LINE_MODE(decorated, LINES_DECORATED)
+LINE_MODE(decorated_color, LINES_DECORATED_COLOR)
+
+// the variants for the options, picked in run()
+void (*consume_line)(struct job *j, char *line, size_t len);
+void (*consume_lines)(struct job *j, char *p, size_t len);
+
+// Returns where in p[0..len), at stream offset off, binary data starts,
+// or len.  This goes by the bytes of the stream only, so whatever pieces
+// it is read in, all of it before is taken as text.
+size_t binary_start(struct job *j, char *p, size_t len, uint64_t off) {
+  char *q = p, *end = p + len;
+  while ((q = memchr(q, 0, end - q))) {
+    uint64_t at = off + (q - p);
+    j->nuls[j->nul_count++ % (BINARY_NULS + 1)] = at;
+    if (at + 1 < BINARY_WINDOW) {
+      if (j->nul_count > (at + 1) / 512)
+        return q - p;
+    } else if (j->nul_count > BINARY_NULS &&
+               // the one BINARY_NULS before this
+               j->nuls[(j->nul_count - 1 - BINARY_NULS) % (BINARY_NULS + 1)]
+               > at - BINARY_WINDOW) {
+      return q - p;
+    }
+    q++;
+  }
+  return len;
+}
+
+void piece_text(struct job *j, char *p, size_t len) {
+  if (!no_lines && len)
+    out_write(j, p, len);
 }
 
-void consume_binary() {
-  if (buffer_pos < match_param_len) return;
-  consume_line(buffer, buffer_pos);
-  memmove(buffer, buffer + buffer_pos - match_param_len + 1,
-          match_param_len - 1);
-  buffer_pos = match_param_len - 1;
+void piece_match(struct job *j, char *p, size_t len) {
+  if (no_lines) return;
+  if (use_color) out_str(j, bold);
+  out_write(j, p, len);
+  if (use_color) out_str(j, attribute_reset);
 }
 
-void consume(int force) {
-  if (state_binary) {
-    consume_binary();
+// A long line is a group of its own as far as context goes, and each of
+// its pieces gets the prefix of where it starts.
+void piece_prefix(struct job *j) {
+  if (!decorate || no_lines) return;
+  if (use_context && !j->long_matched && j->grouped &&
+      j->printed_end != j->line_start)
+    out_str(j, "--\n");
+  uint64_t number = line_numbers ? line_number_at(j, j->line_start) : 0;
+  output_prefix(j, number, j->piece_pos, ':');
+}
+
+// A piece that stops short of the end of its line is marked as cut.
+void close_piece(struct job *j, int line_end) {
+  if (!line_end)
+    piece_text(j, "...\n", 4);
+  j->in_piece = 0;
+  if (j->out_len >= out_spill_len)
+    spill(j);
+}
+
+// A line longer than max_columns is never kept whole.  Each match is
+// printed with up to max_columns / 2 bytes of the line on either side, and
+// matches closer than that share a piece.  buf holds len bytes of the line
+// from stream offset off on, the context before long_from included, and
+// reaches the end of the line if done is set.  Otherwise a match is only
+// certain like in binary data, and the search stops short of the end.
+void consume_long(struct job *j, char *buf, uint64_t off, size_t len,
+                  int done) {
+  uint64_t context = max_columns / 2;
+  uint64_t end = off + len;
+  uint64_t limit = done ? end :
+    len >= max_pattern_len ? end - max_pattern_len + 1 : off;
+  uint64_t from = j->long_from;
+  while (from < limit) {
+    int which;
+    char *hit = find_match(buf + (from - off), end - from, &which);
+    if (!hit) break;
+    uint64_t at = off + (hit - buf);
+    if (at >= limit) break;
+    if (j->in_piece && at > j->piece_end) {
+      piece_text(j, buf + (j->piece_pos - off), j->piece_end - j->piece_pos);
+      close_piece(j, 0);
+    }
+    if (!j->in_piece) {
+      j->piece_pos = at - j->line_start > context ? at - context :
+        j->line_start;
+      piece_prefix(j);
+      if (j->piece_pos > j->line_start)
+        piece_text(j, "...", 3);
+      j->in_piece = 1;
+    }
+    piece_text(j, buf + (j->piece_pos - off), at - j->piece_pos);
+    piece_match(j, hit, pattern_lens[which]);
+    count_match(j, which);
+    j->long_matched = 1;
+    from = j->piece_pos = at + pattern_lens[which];
+    j->piece_end = from + context;
+  }
+  if (done) {
+    if (j->in_piece) {
+      uint64_t to = j->piece_end < end ? j->piece_end : end;
+      piece_text(j, buf + (j->piece_pos - off), to - j->piece_pos);
+      close_piece(j, to == end);
+    }
+    if (j->long_matched) {
+      count_line(j);
+      if (decorate) {
+        j->printed_end = end;
+        j->grouped = 1;
+      }
+    }
+    j->context_from = end;
+    j->after_left = 0;
+    j->long_line = 0;
     return;
   }
-  char *ptr = memchr(buffer, '\n', buffer_pos);
-  if (ptr) {
-    char *line = buffer;
-    while (ptr) {
-      int len = ptr - line + 1;
-      consume_line(line, len);
-      line += len;
-      ptr = memchr(line, '\n', buffer_pos - (line - buffer));
+  // no match starts before from any more
+  if (from < limit)
+    from = limit;
+  if (j->in_piece) {
+    uint64_t to = j->piece_end < from ? j->piece_end : from;
+    piece_text(j, buf + (j->piece_pos - off), to - j->piece_pos);
+    j->piece_pos = to;
+    if (from > j->piece_end)
+      close_piece(j, 0);
+  }
+  j->long_from = from;
+}
+
+// Returns 1 once the long line ends in the buffer, which is then dropped up
+// to there; otherwise drops all but what the next call needs.
+int consume_long_buffer(struct job *j) {
+  size_t from = j->long_from - j->buffer_off;
+  char *nl = memchr(j->buffer + from, '\n', j->buffer_pos - from);
+  size_t len = nl ? (size_t)(nl - j->buffer) + 1 : j->buffer_pos;
+  consume_long(j, j->buffer, j->buffer_off, len, nl != 0);
+  size_t drop = len;
+  if (!nl) {
+    uint64_t context = max_columns / 2;
+    uint64_t keep = j->long_from - j->line_start > context ?
+      j->long_from - context : j->line_start;
+    if (j->in_piece && j->piece_pos < keep)
+      keep = j->piece_pos;
+    drop = keep - j->buffer_off;
+  }
+  carry(j, drop);
+  j->buffer_pos -= drop;
+  j->buffer_off += drop;
+  return nl != 0;
+}
+
+// From here on matches are only counted, from where the search is.
+void turn_binary(struct job *j) {
+  j->binary_from = 0;
+  if (j->long_line) {
+    if (j->in_piece)
+      close_piece(j, 0);
+    if (j->long_matched)
+      count_line(j);
+    j->binary_from = j->long_from - j->buffer_off;
+    j->long_line = 0;
+  }
+  j->after_left = 0;
+  j->state_binary = 1;
+}
+
+// Lines are taken from the first max_columns bytes of the buffer, and if
+// there is none, a long line starts.  Once the search has stopped, they are
+// only taken for the context due, which a long line ends.
+void consume(struct job *j) {
+  while (1) {
+    if (j->state_binary) {
+      if (!j->stopped)
+        consume_binary(j, 0);
+      return;
+    }
+    if (j->long_line) {
+      if (!consume_long_buffer(j)) return;
+      continue;
+    }
+    size_t n = j->buffer_pos < max_columns ? j->buffer_pos : max_columns;
+    char *ptr = memrchr(j->buffer, '\n', n);
+    if (ptr) {
+      size_t len = ptr - j->buffer + 1;
+      if (j->stopped)
+        context_after(j, j->buffer_off + len);
+      else
+        consume_lines(j, j->buffer, len);
+      if (before_context && !no_lines && !j->stopped)
+        save_before(j, len);
+      carry(j, len);
+      j->buffer_pos -= len;
+      j->buffer_off += len;
+      continue;
     }
-    memmove(buffer, line, buffer_pos - (line - buffer));
-    buffer_pos -= (line - buffer);
+    if (j->buffer_pos < max_columns) return;
+    if (j->stopped) {
+      j->after_left = 0;
+      return;
+    }
+    j->long_line = 1;
+    j->long_matched = 0;
+    j->line_start = j->long_from = j->buffer_off;
+  }
+}
+
+// The whole file is one buffer, taken in windows of max_columns like the
+// read buffer, but a long line is there at once.  Only the text before
+// binary data is taken in lines, and from the line it starts in on the
+// matches are counted, as in run_fd().
+void run_map(struct job *j, char *p, size_t len) {
+  if (count_only) {
+    count_lines(j, p, len);
+    return;
+  }
+  char *start = p, *end = p + binary_start(j, p, len, 0);
+  int binary = end < p + len;
+  while (p < end && (!j->stopped || j->after_left)) {
+    size_t n = end - p < max_columns ? end - p : max_columns;
+    char *ptr = memrchr(p, '\n', n);
+    if (ptr && j->stopped) {
+      context_after(j, ptr + 1 - start);
+      p = ptr + 1;
+    } else if (ptr) {
+      consume_lines(j, p, ptr - p + 1);
+      p = ptr + 1;
+    } else if (j->stopped && n == max_columns) {
+      return;
+    } else if (n == max_columns) {
+      char *nl = memchr(p + n, '\n', end - p - n);
+      char *line_end = nl ? nl + 1 : end;
+      j->long_matched = 0;
+      j->line_start = j->long_from = p - start;
+      // a long line that binary data starts in is left unfinished
+      j->long_line = !nl && binary;
+      consume_long(j, p, p - start, line_end - p, !j->long_line);
+      if (j->long_line) break;
+      p = line_end;
+    } else if (binary) {
+      break;
+    } else {
+      if (!j->stopped)
+        consume_line(j, p, end - p);
+      context_after(j, len);
+      return;
+    }
+  }
+  if (!binary || (j->stopped && !j->after_left)) return;
+  size_t from = j->long_line ? j->long_from : (size_t)(p - start);
+  turn_binary(j);
+  if (!j->stopped)
+    consume_line_count(j, start + from, len - from);
+}
+
+// Counts the lines up to stream offset to, taking whole blocks from the
+// index.
+void skip_lines(struct job *j, struct tuidx *x, uint64_t to) {
+  uint64_t k = (j->lines_off + TUIDX_BLOCK_LEN - 1) / TUIDX_BLOCK_LEN;
+  while ((k + 1) * TUIDX_BLOCK_LEN <= to) {
+    line_number_at(j, k * TUIDX_BLOCK_LEN);
+    j->line_number += x->blocks[k].newlines;
+    j->lines_off = ++k * TUIDX_BLOCK_LEN;
+  }
+  line_number_at(j, to);
+}
+
+int block_may_match(struct tuidx *x, uint64_t block) {
+  for (int i = 0; i < pattern_count; i++)
+    if (tuidx_may_match(x, block, patterns[i], pattern_lens[i]))
+      return 1;
+  return 0;
+}
+
+// With an index, only the lines around runs of blocks where a match may
+// start are searched.  This is only done if no line is long and there is
+// no NUL, so that all comes out the same as from run_map().
+void run_map_indexed(struct job *j, char *p, size_t len, struct tuidx *x) {
+  size_t done = 0;           // lines before this are searched
+  uint64_t blocks = x->h.block_count;
+  for (uint64_t k = 0; k < blocks; k++) {
+    if (!block_may_match(x, k)) continue;
+    size_t from = k * TUIDX_BLOCK_LEN, to = from + TUIDX_BLOCK_LEN;
+    while (k + 1 < blocks && block_may_match(x, k + 1)) {
+      k++;
+      to += TUIDX_BLOCK_LEN;
+    }
+    // and a match starting in the last block may run past it
+    to += max_pattern_len - 1;
+    if (to > len) to = len;
+    if (from < done) from = done;
+    if (from >= to) continue;
+    char *line = memrchr(p + done, '\n', from - done);
+    char *start = line ? line + 1 : p + done;
+    char *nl = memchr(p + to - 1, '\n', len - (to - 1));
+    char *end = nl ? nl + 1 : p + len;
+    context_after(j, start - p);
+    if (line_numbers)
+      skip_lines(j, x, start - p);
+    consume_lines(j, start, end - start);
+    done = end - p;
+    if (j->stopped) break;
+  }
+  context_after(j, len);
+}
+
+void run_map_file(struct job *j, char *p, size_t len) {
+  struct tuidx x;
+  // a count over the whole file cannot go by lines
+  int whole = count_only && !fast_count;
+  // and the index knows bytes only as they are
+  if (!use_index || ignore_case || !j->name || whole ||
+      tuidx_load(&x, j->name, j->fd)) {
+    run_map(j, p, len);
     return;
   }
-  if (force) {
-    state_binary = 1;
-    consume_binary();
+  if (!x.h.nul_count && x.h.max_line_len < (uint64_t)max_columns)
+    run_map_indexed(j, p, len, &x);
+  else
+    run_map(j, p, len);
+  tuidx_free(&x);
+}
+
+// Reports the counts of -c over all files so far and returns the matches.
+// The last ones may still be in their jobs.
+uint64_t report_counts(void) {
+  uint64_t match_count = reported_match_count;
+  uint64_t line_match_count = reported_line_match_count;
+  int any_binary = reported_binary;
+  for (int i = 0; i < slot_count; i++) {
+    if (!jobs[i].active) continue;
+    match_count += jobs[i].match_count;
+    line_match_count += jobs[i].line_match_count;
+    any_binary |= jobs[i].state_binary;
   }
+  if (report_count) {
+    info_printf("%" PRIu64 " matches\n", match_count);
+    if (!any_binary && !count_only)
+      info_printf("%" PRIu64 " lines match\n", line_match_count);
+    for (int k = 0; k < pattern_count && pattern_count > 1; k++) {
+      int same = same_pattern[k];
+      uint64_t count = reported_pattern_match_count[same];
+      for (int i = 0; i < slot_count; i++)
+        if (jobs[i].active)
+          count += jobs[i].pattern_match_count[same];
+      info_printf("%" PRIu64 " matches of \"%.*s\"\n", count,
+                  (int)pattern_lens[k], patterns[k]);
+    }
+  }
+  return match_count;
 }
 
-void run_fd(int fd) {
+// searched since the counts were last reported, with -F -c
+int fresh = 0;
+uint64_t next_snapshot = 0;
+
+// Goes on reading the file of a job, with -F, once it has been read to its
+// end.  While it has not grown, what there is to write is written, and the
+// counts are reported after each growth or every snapshot_ns.  A file that
+// is not regular just ends.
+ssize_t follow_input(struct job *j, char *p, size_t len) {
+  if (!j->following) {
+    int res = follow_start(&j->follow, j->fd, j->taken);
+    if (res != 1)
+      return res;
+    j->following = 1;
+    fresh = 1;
+    next_snapshot = timing_now() + snapshot_ns;
+  }
   while (1) {
-    int len = read(fd, buffer + buffer_pos, buffer_len - buffer_pos);
+    uint64_t start = timing_start();
+    ssize_t n = follow_read(&j->follow, p, len);
+    timing_end(TIMING_READ, start, n > 0 ? n : 0);
+    if (n > 0)
+      fresh = 1;
+    if (!n) {
+      spill(j);
+      fflush(stdout);
+    }
+    uint64_t now = timing_now();
+    if (report_count && (snapshot_ns ? now >= next_snapshot : !n && fresh)) {
+      report_counts();
+      fresh = 0;
+      next_snapshot = now + snapshot_ns;
+    }
+    if (n) return n;
+    int wait_ms = !report_count || !snapshot_ns ? -1 :
+      next_snapshot > now ? (int)((next_snapshot - now + 999999) / 1000000) :
+      0;
+    if (follow_wait(&j->follow, wait_ms) == -1)
+      return -1;
+  }
+}
+
+// the files, read ahead when they are scanned one at a time
+struct reader *input_reader = 0;
+
+// Reads up to len bytes into the buffer at *p, or from the reader or the
+// decoder takes a piece of any length where it is, pointing *p there.
+ssize_t read_input(struct job *j, char **p, size_t len) {
+  char *to = *p;
+  if (j->following)
+    return follow_input(j, to, len);
+  uint64_t start = timing_start();
+  ssize_t n;
+  if (j->decoding) {
+    n = decoder_read(&j->decoder, p, SIZE_MAX);
+  } else if (input_reader) {
+    n = reader_read(input_reader, p, SIZE_MAX);
+  } else {
+    timing_syscall();
+    n = read(j->fd, to, len);
+  }
+  timing_end(TIMING_READ, start, n > 0 ? n : 0);
+  if (n > 0 && !j->decoding)
+    j->taken += n;
+  if (!n && follow && !j->decoding) {
+    *p = to;
+    return follow_input(j, to, len);
+  }
+  return n;
+}
+
+// what the decoder of a job reads the file with
+ssize_t job_source(void *arg, char **p, size_t len) {
+  struct job *j = arg;
+  if (input_reader)
+    return reader_read(input_reader, p, len);
+  timing_syscall();
+  return read(j->fd, *p, len);
+}
+
+// Decodes the stream of a job that starts with p[0..len) if it is
+// compressed.
+int start_decoding(struct job *j, char *p, size_t len,
+                   decode_source *source) {
+  if (!use_decompress) return 0;
+  int res = decoder_start(&j->decoder, p, len, source, j);
+  if (res == -1)
+    j->error = errno;
+  j->decoding = res == 1;
+  return res;
+}
+
+// With -q the first match settles the exit status, so nothing is waited
+// for: not the other files, nor reads and decoding in flight, which may be
+// of a pipe that gives nothing more for long.
+void quit_at_match(struct job *j) {
+  if (quiet && j->match_count)
+    exit(0);
+}
+
+// Takes len bytes read to the end of the buffer.  The text before binary
+// data is taken first, with the rest kept out of the way.
+void take(struct job *j, size_t len) {
+  size_t text = j->state_binary ? len :
+    binary_start(j, j->buffer + j->buffer_pos, len,
+                 j->buffer_off + j->buffer_pos);
+  if (text < len) {
+    size_t rest = j->buffer_pos + text;
+    char *binary = j->buffer + rest;
+    j->buffer_pos = rest;
+    consume(j);
+    memmove(j->buffer + j->buffer_pos, binary, len - text);
+    // unless its search is over already
+    if (!j->stopped || j->after_left)
+      turn_binary(j);
+    j->buffer_pos += len - text;
+  } else {
+    j->buffer_pos += len;
+  }
+  consume(j);
+}
+
+// A piece that the reader or the decoder has is scanned where it is.  What
+// was left in the buffer is first joined with as much of the piece as it
+// takes to leave nothing but bytes of the piece: the rest of a line in text,
+// as many bytes as a pattern in binary data, and the context kept of a long
+// line.  Then the rest of the piece is taken in place, and only what is left
+// at its end is copied to the buffer, unless the search is over and none of
+// it is due.
+void take_piece(struct job *j, char *p, size_t len) {
+  while (j->buffer_pos && len && (!j->stopped || j->after_left)) {
+    size_t room = (j->long_line || j->state_binary ? j->buffer_len :
+                   (size_t)max_columns) - j->buffer_pos;
+    size_t n = len < room ? len : room;
+    size_t bridge = max_columns / 2 + max_pattern_len;
+    char *nl;
+    if (j->state_binary && n > max_pattern_len)
+      n = max_pattern_len;
+    else if (j->long_line && n > bridge)
+      n = bridge;
+    else if (!j->state_binary && !j->long_line && (nl = memchr(p, '\n', n)))
+      n = nl - p + 1;
+    uint64_t start = timing_start();
+    memcpy(j->buffer + j->buffer_pos, p, n);
+    timing_end(TIMING_CARRY, start, n);
+    take(j, n);
+    p += n;
+    len -= n;
+    if (j->buffer_pos <= n) break;
+  }
+  if (!len || (j->stopped && !j->after_left)) return;
+  j->buffer = j->base = p - j->buffer_pos;
+  take(j, len);
+  if (j->stopped && !j->after_left && !j->long_line)
+    j->buffer_pos = 0;
+  uint64_t start = timing_start();
+  memcpy(j->read_buffer, j->buffer, j->buffer_pos);
+  timing_end(TIMING_CARRY, start, j->buffer_pos);
+  j->buffer = j->base = j->read_buffer;
+}
+
+// Reads only up to max_columns bytes of lines, more while in a long line,
+// and stops once the search has and no context is due.  A compressed file
+// is read like that from its decoder, mapped or not.
+void run_fd(struct job *j) {
+  size_t map_len;
+  char *map = use_mmap ? input_map(j->fd, &map_len) : 0;
+  int decoding = map ? start_decoding(j, map, map_len, 0) : 0;
+  j->line_number = 1;
+  if (map && !decoding) {
+    j->base = map;
+    uint64_t start = timing_start();
+    run_map_file(j, map, map_len);
+    timing_end(TIMING_SCAN, start, map_len);
+    quit_at_match(j);
+    input_unmap(map, map_len);
+    return;
+  }
+  int first = !map;
+  j->base = j->buffer;
+  j->buffer_pos = 0;
+  j->buffer_off = 0;
+  // matches are counted across lines like in binary data
+  if (count_only)
+    j->state_binary = 1;
+  while (!j->stopped || j->after_left) {
+    size_t room = j->long_line || j->state_binary ? j->buffer_len :
+      (size_t)max_columns;
+    char *p = j->buffer + j->buffer_pos;
+    ssize_t len = decoding == -1 ? 0 :
+      read_input(j, &p, room - j->buffer_pos);
     if (len == -1)
-      errno_printf("cannot read");
-    if (!len) break;
-    buffer_pos += len;
-    consume(buffer_pos == buffer_len);
+      j->error = errno;
+    if (len <= 0) break;
+    if (first) {
+      first = 0;
+      decoding = start_decoding(j, p, len, job_source);
+      if (decoding) continue;
+    }
+    uint64_t start = timing_start();
+    if (p == j->buffer + j->buffer_pos)
+      take(j, len);
+    else
+      take_piece(j, p, len);
+    timing_end(TIMING_SCAN, start, len);
+  }
+  quit_at_match(j);
+  if (j->decoding)
+    decoder_stop(&j->decoder);
+  if (j->following)
+    follow_stop(&j->follow);
+  if (map)
+    input_unmap(map, map_len);
+  if (j->error)
+    return;
+  if (j->state_binary) {
+    if (!j->stopped)
+      consume_binary(j, 1);
+  } else if (j->long_line) {
+    consume_long(j, j->buffer, j->buffer_off, j->buffer_pos, 1);
+  } else if (j->buffer_pos) {
+    if (!j->stopped)
+      consume_line(j, j->buffer, j->buffer_pos);
+    context_after(j, j->buffer_off + j->buffer_pos);
+  }
+  quit_at_match(j);
+}
+
+void run_job(struct job *j, char *buffer) {
+  j->buffer = j->read_buffer = buffer;
+  j->buffer_len = 2 * max_columns;
+  if (input_reader) {
+    j->fd = reader_next(input_reader);
+    if (j->fd == -1)
+      j->error = errno;
+    else
+      run_fd(j);
+  } else if (j->name) {
+    j->fd = open(j->name, O_RDONLY);
+    if (j->fd == -1) {
+      j->error = errno;
+    } else {
+      run_fd(j);
+      close(j->fd);
+    }
+  } else {
+    j->fd = 0;
+    run_fd(j);
+  }
+  pool_put(j->before, j->before_cap);
+  if (list_files && j->match_count) {
+    out_str(j, j->name ? j->name : "(standard input)");
+    out_write(j, "\n", 1);
+  }
+  finish(j);
+}
+
+// Takes the slot of file index once it is its turn, for a clean job.  A
+// later file may come to the slot first, but must not take it.
+struct job *start_job(int index) {
+  struct job *j = jobs + index % slot_count;
+  pthread_mutex_lock(&output_lock);
+  while (j->turn != index)
+    pthread_cond_wait(&slot_free, &output_lock);
+  uint64_t *counts = j->pattern_match_count;
+  memset(j, 0, sizeof(*j));
+  if (counts)
+    memset(counts, 0, pattern_count * sizeof(uint64_t));
+  j->pattern_match_count = counts;
+  j->name = job_names[index];
+  j->named = job_named[index];
+  j->index = index;
+  j->active = 1;
+  j->turn = -1;
+  pthread_mutex_unlock(&output_lock);
+  return j;
+}
+
+void *worker(void *arg) {
+  char *buffer = pool_get(2 * max_columns);
+  if (!buffer)
+    exit_printf("cannot allocate %zu bytes\n", 2 * (size_t)max_columns);
+  while (1) {
+    pthread_mutex_lock(&job_lock);
+    int index = next_job++;
+    pthread_mutex_unlock(&job_lock);
+    if (index >= job_count) break;
+    run_job(start_job(index), buffer);
   }
-  if (!state_binary && buffer_pos)
-    consume_line(buffer, buffer_pos);
+  pool_put(buffer, 2 * max_columns);
+  return 0;
 }
 
 void run(int index, int argc, char **argv) {
-  if (index == argc)
+  if (!pattern_option) {
+    if (index == argc)
+      exit_printf("no match parameter\n");
+    add_pattern(argv[index], strlen(argv[index]));
+    index++;
+  }
+  if (!pattern_count)
     exit_printf("no match parameter\n");
-  match_param = argv[index++];
-  match_param_len = strlen(match_param);
-  if (!match_param_len)
-    exit_printf("match parameter empty\n");
-  if (match_param_len >= max_columns)
-    exit_printf("match parameter not less than maximum line length\n");
-  buffer_len = max_columns;
-  buffer = allocate(buffer_len);
-  if (index == argc) {
-    run_fd(0);
+  min_pattern_len = max_pattern_len = pattern_lens[0];
+  for (int i = 0; i < pattern_count; i++) {
+    if (!pattern_lens[i])
+      exit_printf("match parameter empty\n");
+    if (pattern_lens[i] >= max_columns)
+      exit_printf("match parameter not less than maximum line length\n");
+    if (pattern_lens[i] < min_pattern_len)
+      min_pattern_len = pattern_lens[i];
+    if (pattern_lens[i] > max_pattern_len)
+      max_pattern_len = pattern_lens[i];
+  }
+  if (list_files && report_count)
+    exit_printf("-l and -c cannot be used together\n");
+  // -q writes no counts either
+  if (quiet)
+    report_count = 0;
+  no_lines = report_count || list_files || quiet;
+  if (list_files || quiet)
+    max_count = 1;
+  decorate = line_numbers || byte_offsets || use_context || recursive;
+  fast_count = no_lines;
+  for (int i = 0; i < pattern_count; i++)
+    if (memchr(patterns[i], '\n', pattern_lens[i]))
+      fast_count = 0;
+  if (no_lines) {
+    consume_line = consume_line_count;
+    consume_lines = fast_count ? count_lines : consume_lines_count;
+  } else if (decorate) {
+    consume_line = use_color ? consume_line_decorated_color :
+      consume_line_decorated;
+    consume_lines = use_color ? consume_lines_decorated_color :
+      consume_lines_decorated;
+  } else {
+    consume_line = use_color ? consume_line_color : consume_line_plain;
+    consume_lines = use_color ? consume_lines_color : consume_lines_plain;
+  }
+  const unsigned char *fold = 0;
+  if (ignore_case) {
+    search_fold(fold_table);
+    fold = fold_table;
+  }
+  if (fold_finnish) {
+    for (int i = 0; i < pattern_count; i++)
+      add_variants(i);
+    if (variant_count == pattern_count)
+      variant_count = 0;
+  }
+  use_ac = pattern_count > 1 || variant_count;
+  if (!use_ac) {
+    char *pattern = patterns[0];
+    if (fold) {
+      pattern = allocate(pattern_lens[0]);
+      for (size_t i = 0; i < pattern_lens[0]; i++)
+        pattern[i] = fold[(unsigned char)patterns[0][i]];
+    }
+    search_init(&search, pattern, pattern_lens[0], fold);
+  } else if (variant_count ?
+             ac_init(&ac, variants, variant_lens, variant_count, fold) :
+             ac_init(&ac, patterns, pattern_lens, pattern_count, fold)) {
+    exit_printf("cannot allocate automaton for %d patterns\n",
+                variant_count ? variant_count : pattern_count);
+  }
+  // a pattern that is the same as one before it is found as that one
+  same_pattern = allocate(pattern_count * sizeof(int));
+  for (int i = 0; i < pattern_count; i++) {
+    int which;
+    char *hit = find_match(patterns[i], pattern_lens[i], &which);
+    same_pattern[i] = hit == patterns[i] &&
+      pattern_lens[which] == pattern_lens[i] ? which : i;
+  }
+  struct walk walk;
+  if (recursive) {
+    char *here = "";
+    char **roots = index == argc ? &here : argv + index;
+    // and the index files of -x
+    if (walk_paths(&walk, roots, index == argc ? 1 : argc - index,
+                   thread_count, ".tuidx", thread_count > 1))
+      errno_printf("cannot list files");
+    for (size_t i = 0; i < walk.error_count; i++)
+      warn_printf("cannot read directory \"%s\": %s\n", walk.errors[i].name,
+                  strerror(walk.errors[i].error));
+    reported_error = walk.error_count != 0;
+    if (walk.count > INT_MAX)
+      exit_printf("too many files\n");
+    job_count = walk.count;
+    job_names = allocate((job_count ? job_count : 1) * sizeof(char *));
+    job_named = allocate(job_count ? job_count : 1);
+    for (int i = 0; i < job_count; i++) {
+      job_names[i] = walk.files[i].name;
+      job_named[i] = walk.files[i].named;
+    }
   } else {
-    while (index < argc) {
-      int fd = file4read(argv[index++]);
-      run_fd(fd);
-      close(fd);
+    job_count = index == argc ? 1 : argc - index;
+    job_names = allocate(job_count * sizeof(char *));
+    job_named = allocate(job_count);
+    for (int i = 0; i < job_count; i++) {
+      job_names[i] = index == argc ? 0 : argv[index + i];
+      job_named[i] = 1;
     }
   }
+  if (follow && job_count != 1)
+    exit_printf("-F follows only one file\n");
+  // the end of a map does not move
+  if (follow)
+    use_mmap = 0;
+  int threads = thread_count < job_count ? thread_count : job_count;
+  slot_count = threads * JOB_SLOTS_PER_THREAD;
+  if (slot_count > job_count)
+    slot_count = job_count ? job_count : 1;
+  jobs = allocate(slot_count * sizeof(struct job));
+  memset(jobs, 0, slot_count * sizeof(struct job));
+  for (int i = 0; i < slot_count; i++)
+    jobs[i].turn = i;
+  size_t size = pattern_count * sizeof(uint64_t);
+  reported_pattern_match_count = allocate(size);
+  memset(reported_pattern_match_count, 0, size);
+  if (report_count && pattern_count > 1)
+    for (int i = 0; i < slot_count; i++)
+      jobs[i].pattern_match_count = allocate(size);
+  struct reader reader;
+  if (threads == 1) {
+    if (reader_init(&reader, job_names, job_count, use_mmap, !use_uring))
+      errno_printf("cannot start reading");
+    input_reader = &reader;
+  }
+  pthread_t *thread = allocate(threads * sizeof(pthread_t));
+  for (int i = 1; i < threads; i++) {
+    errno = pthread_create(thread + i, 0, worker, 0);
+    if (errno)
+      errno_printf("cannot create thread");
+  }
+  worker(0);
+  for (int i = 1; i < threads; i++)
+    pthread_join(thread[i], 0);
+  free(thread);
+  if (input_reader) {
+    reader_free(input_reader);
+    input_reader = 0;
+  }
+  free(job_names);
+  free(job_named);
+  if (recursive)
+    walk_free(&walk);
 }
 
 int main(int argc, char **argv) {
   parse_options(argc, argv);
+  timing_setup();
   run(optind, argc, argv);
-  if (state_binary && match_count && !report_count) {
-    info_printf("binary file matches\n");
-  }
-  if (report_count) {
-    info_printf("%d matches\n", match_count);
-    if (!state_binary) info_printf("%d lines match\n", line_match_count);
-  }
-  return !match_count;
+  // 2 like grep if a file or a directory could not be read
+  int matched = report_counts() != 0;
+  return reported_error ? 2 : !matched;
 }
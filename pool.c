@@ -0,0 +1,76 @@
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "pool.h"
+
+#define POOL_CLASSES 64
+#define CACHE_LINE 64
+
+// A buffer given back holds the link to the next one of its size.
+struct pool_free {
+  struct pool_free *next;
+};
+
+static struct {
+  struct pool_free *first;
+  int count;
+} classes[POOL_CLASSES];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int size_class(size_t len) {
+  int k = 0;
+  while (((size_t)POOL_MIN_LEN << k) < len)
+    k++;
+  return k;
+}
+
+size_t pool_len(size_t len) {
+  return (size_t)POOL_MIN_LEN << size_class(len);
+}
+
+void *pool_get(size_t len) {
+  if (len > SIZE_MAX / 2 + 1) {
+    errno = ENOMEM;
+    return 0;
+  }
+  int k = size_class(len);
+  pthread_mutex_lock(&lock);
+  struct pool_free *p = classes[k].first;
+  if (p) {
+    classes[k].first = p->next;
+    classes[k].count--;
+  }
+  pthread_mutex_unlock(&lock);
+  if (p) return p;
+  len = (size_t)POOL_MIN_LEN << k;
+  void *q;
+  int huge = len >= POOL_HUGE_LEN;
+  errno = posix_memalign(&q, huge ? POOL_HUGE_LEN : CACHE_LINE, len);
+  if (errno) return 0;
+#ifdef MADV_HUGEPAGE
+  // only a hint, which the kernel may not take
+  if (huge)
+    madvise(q, len, MADV_HUGEPAGE);
+#endif
+  return q;
+}
+
+void pool_put(void *p, size_t len) {
+  if (!p) return;
+  int k = size_class(len);
+  pthread_mutex_lock(&lock);
+  if (classes[k].count < POOL_KEEP) {
+    struct pool_free *f = p;
+    f->next = classes[k].first;
+    classes[k].first = f;
+    classes[k].count++;
+    p = 0;
+  }
+  pthread_mutex_unlock(&lock);
+  free(p);
+}
@@ -0,0 +1,29 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+// Buffers for the work that comes and goes with each file: read and decode
+// rings, index blocks and output, kept when given back for the next file to
+// take instead of going back to malloc and having the kernel fault in fresh
+// pages for each of a batch of small files.  Sizes are rounded up to powers
+// of two from POOL_MIN_LEN, and each size keeps up to POOL_KEEP buffers.
+// Buffers start at a cache line, and those of POOL_HUGE_LEN or more at a
+// huge page, which the kernel is asked to back them with.  Any thread may
+// get and give back buffers.
+
+#define POOL_MIN_LEN (1 << 12)
+#define POOL_HUGE_LEN (1 << 21)
+#define POOL_KEEP 64
+
+// Returns a buffer of at least len bytes, or null with errno set if out of
+// memory.
+void *pool_get(size_t len);
+
+// Gives back p, got for len bytes, or nothing if p is null.
+void pool_put(void *p, size_t len);
+
+// what pool_get(len) really gives
+size_t pool_len(size_t len);
+
+#endif
@@ -0,0 +1,488 @@
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_RW_CUR_POS)
+#define HAVE_URING
+#endif
+#endif
+#endif
+
+#include "input.h"
+#include "pool.h"
+#include "reader.h"
+#include "timing.h"
+
+size_t reader_buffer_len = 0;
+
+static void open_file(struct reader *r, int k) {
+  struct reader_file *f = r->files + k;
+  struct stat st;
+  f->fd = r->names[k] ? open(r->names[k], O_RDONLY) : 0;
+  f->error = errno;
+  f->ahead = f->fd != -1;
+  f->offset = -1;
+  if (f->fd == -1 || fstat(f->fd, &st) == -1 || !S_ISREG(st.st_mode))
+    return;
+  off_t pos = lseek(f->fd, 0, SEEK_CUR);
+  if (pos == -1)
+    return;
+  // what input_map() takes
+  if (r->map && st.st_size >= INPUT_MAP_MIN_LEN && !pos) {
+    f->ahead = 0;
+    return;
+  }
+  f->offset = pos;
+  f->size = st.st_size;
+}
+
+static void close_file(struct reader *r, int k) {
+  if (r->names[k] && r->files[k].fd != -1)
+    close(r->files[k].fd);
+}
+
+static ssize_t read_at(struct reader_file *f, char *p, size_t len) {
+  while (1) {
+    timing_syscall();
+    ssize_t n = f->offset >= 0 ? pread(f->fd, p, len, f->offset) :
+      read(f->fd, p, len);
+    if (n != -1 || errno != EINTR)
+      return n;
+  }
+}
+
+#ifdef HAVE_URING
+
+// the user_data of a cancel, which is not that of any slot
+#define CANCEL_DATA READER_SLOTS
+
+struct reader_uring {
+  int fd;
+  unsigned *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_len, cq_ring_len, sqes_len;
+  unsigned to_submit;
+  struct iovec iov[READER_SLOTS];
+};
+
+static int uring_enter(struct reader_uring *u, unsigned wait) {
+  timing_syscall();
+  int n = syscall(__NR_io_uring_enter, u->fd, u->to_submit, wait,
+                  wait ? IORING_ENTER_GETEVENTS : 0, 0, 0);
+  if (n > 0)
+    u->to_submit -= n;
+  return n;
+}
+
+static int uring_init(struct reader *r) {
+  struct io_uring_params p;
+  struct reader_uring *u = malloc(sizeof(*u));
+  if (!u)
+    return -1;
+  memset(&p, 0, sizeof(p));
+  u->fd = syscall(__NR_io_uring_setup, READER_SLOTS, &p);
+  if (u->fd == -1) {
+    free(u);
+    return -1;
+  }
+  u->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  int single = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single && u->cq_ring_len > u->sq_ring_len)
+    u->sq_ring_len = u->cq_ring_len;
+  u->sq_ring = mmap(0, u->sq_ring_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  u->cq_ring = single || u->sq_ring == MAP_FAILED ? u->sq_ring :
+    mmap(0, u->cq_ring_len, PROT_READ | PROT_WRITE,
+         MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+  u->sqes = mmap(0, u->sqes_len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  // reads at the file position of pipes need it
+  if (!(p.features & IORING_FEAT_RW_CUR_POS) || u->sq_ring == MAP_FAILED ||
+      u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+    if (u->sqes != MAP_FAILED)
+      munmap(u->sqes, u->sqes_len);
+    if (u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring)
+      munmap(u->cq_ring, u->cq_ring_len);
+    if (u->sq_ring != MAP_FAILED)
+      munmap(u->sq_ring, u->sq_ring_len);
+    close(u->fd);
+    free(u);
+    return -1;
+  }
+  char *sq = u->sq_ring, *cq = u->cq_ring;
+  u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  u->sq_array = (unsigned *)(sq + p.sq_off.array);
+  u->cq_head = (unsigned *)(cq + p.cq_off.head);
+  u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  u->to_submit = 0;
+  r->uring = u;
+  return 0;
+}
+
+static void uring_free(struct reader_uring *u) {
+  munmap(u->sqes, u->sqes_len);
+  if (u->cq_ring != u->sq_ring)
+    munmap(u->cq_ring, u->cq_ring_len);
+  munmap(u->sq_ring, u->sq_ring_len);
+  close(u->fd);
+  free(u);
+}
+
+static void complete(struct reader *r, struct reader_slot *s, int res) {
+  struct reader_file *f = r->files + s->file;
+  s->len = res < 0 ? -1 : res;
+  s->error = res < 0 ? -res : 0;
+  s->done = 1;
+  f->in_flight--;
+  if (res <= 0)
+    f->at_end = 1;
+}
+
+// Takes the completions there are, after waiting for one if wait is set.
+static void uring_reap(struct reader *r, int wait) {
+  struct reader_uring *u = r->uring;
+  if (wait && uring_enter(u, 1) == -1 && errno != EINTR) {
+    // the ring is of no use any more, so its reads fail
+    for (unsigned i = r->head; i != r->tail; i++)
+      if (!r->slots[i % READER_SLOTS].done)
+        complete(r, r->slots + i % READER_SLOTS, -errno);
+    return;
+  }
+  unsigned head = *u->cq_head;
+  unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    struct io_uring_cqe *cqe = u->cqes + (head & *u->cq_mask);
+    if (cqe->user_data != CANCEL_DATA)
+      complete(r, r->slots + cqe->user_data, cqe->res);
+  }
+  __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Gives up the reads in flight of the files before file, which the tool is
+// done with.  Those of a pipe could otherwise be waited for until it gives
+// more, and a read that has started on a regular file just completes.  The
+// completions of the cancels themselves are told by their user_data.
+static void uring_cancel(struct reader *r, int file) {
+  struct reader_uring *u = r->uring;
+  for (unsigned i = r->head; i != r->tail; i++) {
+    struct reader_slot *s = r->slots + i % READER_SLOTS;
+    if (s->done || s->file >= file) continue;
+    unsigned tail = *u->sq_tail;
+    struct io_uring_sqe *sqe = u->sqes + (tail & *u->sq_mask);
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = i % READER_SLOTS;
+    sqe->user_data = CANCEL_DATA;
+    u->sq_array[tail & *u->sq_mask] = tail & *u->sq_mask;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->to_submit++;
+  }
+  if (u->to_submit)
+    uring_enter(u, 0);
+}
+
+static void queue_read(struct reader *r, struct reader_file *f, size_t len) {
+  struct reader_uring *u = r->uring;
+  unsigned index = r->tail % READER_SLOTS;
+  unsigned tail = *u->sq_tail;
+  struct io_uring_sqe *sqe = u->sqes + (tail & *u->sq_mask);
+  u->iov[index].iov_base = r->slots[index].buffer;
+  u->iov[index].iov_len = len;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READV;
+  sqe->fd = f->fd;
+  sqe->off = f->offset;      // -1 reads from the file position
+  sqe->addr = (uintptr_t)(u->iov + index);
+  sqe->len = 1;
+  sqe->user_data = index;
+  u->sq_array[tail & *u->sq_mask] = tail & *u->sq_mask;
+  __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  u->to_submit++;
+  r->slots[index].done = 0;
+  f->in_flight++;
+}
+
+// Queues reads into the free slots, of the file being queued and of the
+// next ones as they are reached.  Regular files are read in slot sized
+// pieces all at once, others one read at a time.
+static void uring_fill(struct reader *r) {
+  while (r->submit_file < r->count && r->tail - r->head < READER_SLOTS) {
+    int k = r->submit_file;
+    struct reader_file *f = r->files + k;
+    if (k == r->opened) {
+      if (k > r->current + READER_FILES_AHEAD) break;
+      open_file(r, k);
+      r->opened++;
+    }
+    if (!f->ahead || f->at_end) {
+      r->submit_file++;
+      continue;
+    }
+    struct reader_slot *s = r->slots + r->tail % READER_SLOTS;
+    if (f->offset < 0) {
+      if (f->in_flight) break;
+      queue_read(r, f, r->slot_len);
+    } else if ((uint64_t)f->offset < f->size) {
+      uint64_t len = f->size - f->offset;
+      if (len > r->slot_len)
+        len = r->slot_len;
+      queue_read(r, f, len);
+      f->offset += len;
+    } else {
+      // a regular file ends where it did when opened, like a mapped one
+      s->len = 0;
+      s->error = 0;
+      s->done = 1;
+      f->at_end = 1;
+    }
+    s->file = k;
+    r->tail++;
+  }
+  if (r->uring->to_submit)
+    uring_enter(r->uring, 0);
+}
+
+static struct reader_slot *uring_take(struct reader *r) {
+  struct reader_slot *s = r->slots + r->head % READER_SLOTS;
+  if (r->slot_pos && r->slot_pos == (size_t)s->len) {
+    r->head++;
+    r->slot_pos = 0;
+    s = r->slots + r->head % READER_SLOTS;
+  }
+  uring_fill(r);
+  while (r->head == r->tail || !s->done) {
+    uring_reap(r, 1);
+    uring_fill(r);
+  }
+  return s;
+}
+
+static void uring_next(struct reader *r) {
+  r->current++;
+  if (r->submit_file < r->current)
+    r->submit_file = r->current;
+  uring_cancel(r, r->current);
+  while (r->head != r->tail &&
+         r->slots[r->head % READER_SLOTS].file < r->current) {
+    if (r->slots[r->head % READER_SLOTS].done)
+      r->head++;
+    else
+      uring_reap(r, 1);
+  }
+  uring_fill(r);
+}
+
+#else
+
+static int uring_init(struct reader *r) {
+  return -1;
+}
+
+#endif
+
+// The reading thread.  It stops reading a file as soon as the tool moves
+// on from it, and opens files only a few ahead of the tool.
+static void *read_ahead(void *arg) {
+  struct reader *r = arg;
+  pthread_mutex_lock(&r->lock);
+  for (int k = 0; k < r->count && !r->stop; k++) {
+    while (!r->stop && k > r->current + READER_FILES_AHEAD)
+      pthread_cond_wait(&r->cond, &r->lock);
+    if (r->stop) break;
+    pthread_mutex_unlock(&r->lock);
+    struct reader_file *f = r->files + k;
+    open_file(r, k);
+    pthread_mutex_lock(&r->lock);
+    r->opened = k + 1;
+    pthread_cond_broadcast(&r->cond);
+    while (f->ahead) {
+      while (!r->stop && r->current <= k &&
+             r->tail - r->head == READER_SLOTS)
+        pthread_cond_wait(&r->cond, &r->lock);
+      if (r->stop || r->current > k) break;
+      struct reader_slot *s = r->slots + r->tail % READER_SLOTS;
+      pthread_mutex_unlock(&r->lock);
+      ssize_t n = read_at(f, s->buffer, r->slot_len);
+      int error = errno;
+      pthread_mutex_lock(&r->lock);
+      if (r->current > k) break;
+      s->file = k;
+      s->len = n;
+      s->error = error;
+      r->tail++;
+      pthread_cond_broadcast(&r->cond);
+      if (n <= 0) break;
+      if (f->offset >= 0)
+        f->offset += n;
+    }
+    r->read_done = k + 1;
+    pthread_cond_broadcast(&r->cond);
+  }
+  r->read_done = r->count;
+  pthread_cond_broadcast(&r->cond);
+  pthread_mutex_unlock(&r->lock);
+  return 0;
+}
+
+static struct reader_slot *thread_take(struct reader *r) {
+  struct reader_slot *s = r->slots + r->head % READER_SLOTS;
+  pthread_mutex_lock(&r->lock);
+  if (r->slot_pos && r->slot_pos == (size_t)s->len) {
+    r->head++;
+    r->slot_pos = 0;
+    s = r->slots + r->head % READER_SLOTS;
+    pthread_cond_broadcast(&r->cond);
+  }
+  while (r->head == r->tail)
+    pthread_cond_wait(&r->cond, &r->lock);
+  pthread_mutex_unlock(&r->lock);
+  return s;
+}
+
+// The file left is closed only once the thread is done with it.
+static void thread_next(struct reader *r) {
+  pthread_mutex_lock(&r->lock);
+  int prev = r->current++;
+  while (r->head != r->tail &&
+         r->slots[r->head % READER_SLOTS].file < r->current)
+    r->head++;
+  pthread_cond_broadcast(&r->cond);
+  while (r->read_done <= prev || r->opened <= r->current)
+    pthread_cond_wait(&r->cond, &r->lock);
+  pthread_mutex_unlock(&r->lock);
+}
+
+int reader_init(struct reader *r, char **names, int count, int map,
+                int no_uring) {
+  memset(r, 0, sizeof(*r));
+  r->names = names;
+  r->count = count;
+  r->map = map;
+  r->current = -1;
+  r->slot_len = reader_buffer_len;
+  struct stat st;
+  if (!r->slot_len)
+    r->slot_len = !map && count && names[0] && !stat(names[0], &st) &&
+      S_ISREG(st.st_mode) && st.st_size >= READER_BIG_FILE_LEN ?
+      READER_BIG_SLOT_LEN : READER_SLOT_LEN;
+  r->files = calloc(count ? count : 1, sizeof(*r->files));
+  r->buffer = pool_get((READER_SLOTS + 1) * r->slot_len);
+  if (!r->files || !r->buffer) {
+    free(r->files);
+    pool_put(r->buffer, (READER_SLOTS + 1) * r->slot_len);
+    errno = ENOMEM;
+    return -1;
+  }
+  for (int i = 0; i < READER_SLOTS; i++)
+    r->slots[i].buffer = r->buffer + (i + 1) * r->slot_len;
+  if (!no_uring && !uring_init(r))
+    return 0;
+  pthread_mutex_init(&r->lock, 0);
+  pthread_cond_init(&r->cond, 0);
+  errno = pthread_create(&r->thread, 0, read_ahead, r);
+  if (errno) {
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->cond);
+    free(r->files);
+    pool_put(r->buffer, (READER_SLOTS + 1) * r->slot_len);
+    return -1;
+  }
+  return 0;
+}
+
+int reader_next(struct reader *r) {
+  int prev = r->current;
+#ifdef HAVE_URING
+  if (r->uring)
+    uring_next(r);
+  else
+#endif
+    thread_next(r);
+  if (prev >= 0)
+    close_file(r, prev);
+  r->slot_pos = 0;
+  r->ended = 0;
+  struct reader_file *f = r->files + r->current;
+  if (f->fd == -1) {
+    errno = f->error;
+    return -1;
+  }
+  return f->fd;
+}
+
+ssize_t reader_read(struct reader *r, char **p, size_t len) {
+  struct reader_file *f = r->files + r->current;
+  if (len > r->slot_len)
+    len = r->slot_len;
+  if (!f->ahead) {
+    *p = r->buffer;
+    return read_at(f, r->buffer, len);
+  }
+  if (r->ended)
+    return 0;
+  struct reader_slot *s;
+#ifdef HAVE_URING
+  if (r->uring)
+    s = uring_take(r);
+  else
+#endif
+    s = thread_take(r);
+  if (s->len <= 0) {
+    r->ended = 1;
+    errno = s->error;
+    return s->len;
+  }
+  size_t n = s->len - r->slot_pos;
+  if (n > len)
+    n = len;
+  *p = s->buffer + r->slot_pos;
+  r->slot_pos += n;
+  return n;
+}
+
+// Waits for the reads in progress, which for a pipe means until it gives
+// data or ends.
+void reader_free(struct reader *r) {
+#ifdef HAVE_URING
+  if (r->uring) {
+    uring_cancel(r, r->count);
+    for (unsigned i = r->head; i != r->tail; i++)
+      while (!r->slots[i % READER_SLOTS].done)
+        uring_reap(r, 1);
+    uring_free(r->uring);
+  } else
+#endif
+  {
+    pthread_mutex_lock(&r->lock);
+    r->stop = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->thread, 0);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->cond);
+  }
+  for (int k = r->current < 0 ? 0 : r->current; k < r->opened; k++)
+    close_file(r, k);
+  free(r->files);
+  pool_put(r->buffer, (READER_SLOTS + 1) * r->slot_len);
+}
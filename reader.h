@@ -0,0 +1,89 @@
+#ifndef READER_H
+#define READER_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Reads the files of a batch ahead of the tool, in order, into a ring of
+// buffers, so that reading the next buffers and the next files overlaps
+// with scanning the current buffer.  The reads are queued on an io_uring
+// if the kernel gives one, otherwise a thread makes them.
+
+#define READER_SLOTS 4
+#define READER_SLOT_LEN (1 << 17)
+#define READER_BIG_SLOT_LEN (1 << 20)
+#define READER_BIG_FILE_LEN (1 << 24)
+#define READER_FILES_AHEAD 2      // files opened past the current one
+
+// The length of the buffers, which a tool may set before reader_init().
+// If it is 0, batches that start with a regular file of READER_BIG_FILE_LEN
+// or more that is read, not mapped, are read in READER_BIG_SLOT_LEN pieces,
+// with fewer calls, and others in READER_SLOT_LEN ones, which a batch of
+// small files does not need more of.
+extern size_t reader_buffer_len;
+
+struct reader_slot {
+  char *buffer;
+  int file;
+  ssize_t len;               // -1 for an error
+  int error;
+  int done;                  // io_uring only, read completed
+};
+
+struct reader_file {
+  int fd;                    // -1 if it could not be opened
+  int error;
+  int ahead;                 // read ahead, not left to the tool to map
+  int64_t offset;            // next read of a regular file, -1 for others
+  uint64_t size;
+  int in_flight;             // io_uring only
+  int at_end;
+};
+
+struct reader_uring;
+
+struct reader {
+  char **names;
+  int count;
+  int map;
+  size_t slot_len;
+  struct reader_file *files;
+  struct reader_slot slots[READER_SLOTS];
+  unsigned head;             // slot of the tool
+  unsigned tail;             // next slot to fill
+  size_t slot_pos;           // taken of the slot at head
+  int current;               // file of the tool, -1 before the first
+  int opened;                // files opened so far
+  int ended;                 // the current file gave its end or an error
+  char *buffer;              // reads of files not read ahead
+
+  struct reader_uring *uring;
+  int submit_file;           // io_uring only, file being queued
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int read_done;             // files the thread is done with
+  int stop;
+};
+
+// Reads names[0..count) in order, a null name being stdin.  If map is set,
+// regular files that can be mapped are only opened, for the tool to map.
+// If no_uring is set, the reads are made by a thread.  Returns -1 with
+// errno set if out of memory or if the thread cannot be created.
+int reader_init(struct reader *r, char **names, int count, int map,
+                int no_uring);
+
+// Moves on to the next file and returns its fd, or -1 with errno set if it
+// could not be opened.  The reader closes the fd later on.
+int reader_next(struct reader *r);
+
+// Stores in *p a piece of up to len bytes of the current file, valid until
+// the next call, and returns its length.  Returns 0 at the end of the file
+// and -1 with errno set if reading failed.
+ssize_t reader_read(struct reader *r, char **p, size_t len);
+
+void reader_free(struct reader *r);
+
+#endif
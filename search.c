@@ -0,0 +1,423 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "search.h"
+
+#if defined(NO_SIMD)
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define SIMD_AVX2
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SIMD_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define SIMD_NEON
+#endif
+
+// patterns at least this long go straight to Two-Way
+#define LONG_PATTERN 32
+
+// Bytes roughly from the most to the least common in text and logs.  Bytes
+// not listed, control and high bytes, count as rarer than all of these.
+static const char common_bytes[] =
+  " e0ta1o2in:s3r4h5l-6d.c7u8m9/f,p_g=w\"y\nb'v(k)x[j]q<z>ETAOINSRHLDCU"
+  "MFPGWYBVKXJQZ\t;{}!?*+#&%$@|\\^~`\r";
+
+static inline unsigned char fold_byte(const struct search *s,
+                                      unsigned char ch) {
+  return s->fold ? s->fold[ch] : ch;
+}
+
+// memcmp() of the pattern and h, through the fold table if there is one.
+static int same(const struct search *s, const char *h) {
+  if (!s->fold)
+    return !memcmp(h, s->pattern, s->len);
+  const unsigned char *u = (const unsigned char *)h;
+  const unsigned char *pat = (const unsigned char *)s->pattern;
+  for (size_t i = 0; i < s->len; i++)
+    if (s->fold[u[i]] != pat[i]) return 0;
+  return 1;
+}
+
+// Bytes fold to themselves or to themselves with 0x20 set, so one compare
+// with that bit set tells the byte in either case.
+static unsigned char fold_mask(const unsigned char *fold, unsigned char ch) {
+  return fold && ch & 0x20 && fold[ch ^ 0x20] == ch ? 0x20 : 0;
+}
+
+static int frequency(unsigned char ch) {
+  const char *p = ch ? strchr(common_bytes, ch) : 0;
+  return p ? (int)(sizeof(common_bytes) - (p - common_bytes)) : 0;
+}
+
+// A byte that repeats in the pattern yields a candidate for every copy of
+// it, and the second filter byte should differ from the first.
+static int byte_cost(const unsigned char *pat, size_t len, size_t i) {
+  int cost = frequency(pat[i]);
+  for (size_t k = 0; k < len; k++)
+    if (k != i && pat[k] == pat[i])
+      cost += 8;
+  return cost;
+}
+
+static int pair_cost(const unsigned char *pat, size_t len, size_t rare1,
+                     size_t i) {
+  return byte_cost(pat, len, i) + (pat[i] == pat[rare1] ? 256 : 0);
+}
+
+static void init_pair(struct search *s) {
+  const unsigned char *pat = (const unsigned char *)s->pattern;
+  size_t len = s->len;
+  size_t rare1 = 0;
+  for (size_t i = 1; i < len; i++)
+    if (byte_cost(pat, len, i) < byte_cost(pat, len, rare1))
+      rare1 = i;
+  size_t rare2 = rare1 ? 0 : 1;
+  for (size_t i = rare2 + 1; i < len; i++)
+    if (i != rare1 &&
+        pair_cost(pat, len, rare1, i) < pair_cost(pat, len, rare1, rare2))
+      rare2 = i;
+  s->rare1 = rare1;
+  s->rare2 = rare2;
+}
+
+// Maximal suffix of the pattern under one byte order, or the reverse order
+// if reverse is set; stores its period.  Crochemore and Perrin.
+static size_t maximal_suffix(const unsigned char *pat, size_t len,
+                             int reverse, size_t *period) {
+  size_t i = -1, j = 0, k = 1, p = 1;
+  while (j + k < len) {
+    unsigned char a = pat[i + k], b = pat[j + k];
+    if (a == b) {
+      if (k == p) {
+        j += p;
+        k = 1;
+      } else {
+        k++;
+      }
+    } else if (reverse ? a < b : a > b) {
+      j += k;
+      k = 1;
+      p = j - i;
+    } else {
+      i = j++;
+      k = p = 1;
+    }
+  }
+  *period = p;
+  return i;
+}
+
+static void init_two_way(struct search *s) {
+  const unsigned char *pat = (const unsigned char *)s->pattern;
+  size_t len = s->len;
+  memset(s->byteset, 0, sizeof(s->byteset));
+  for (size_t i = 0; i < len; i++) {
+    s->byteset[pat[i] >> 3] |= 1 << (pat[i] & 7);
+    s->shift[pat[i]] = i + 1;
+  }
+  size_t p1, p2;
+  size_t ms1 = maximal_suffix(pat, len, 0, &p1);
+  size_t ms2 = maximal_suffix(pat, len, 1, &p2);
+  // split and maximal suffix indices are one less than the usual, -1 is 0
+  size_t ms = ms2 + 1 > ms1 + 1 ? ms2 : ms1;
+  size_t p = ms2 + 1 > ms1 + 1 ? p2 : p1;
+  s->split = ms;
+  if (memcmp(pat, pat + p, ms + 1)) {
+    size_t left = ms + 1, right = len - ms - 1;
+    s->period = (left > right ? left : right) + 1;
+    s->period_memory = 0;
+  } else {
+    s->period = p;
+    s->period_memory = len - p;
+  }
+}
+
+static char *find_two_way(struct search *s, const char *hay, size_t len) {
+  const unsigned char *h = (const unsigned char *)hay;
+  const unsigned char *end = h + len;
+  const unsigned char *pat = (const unsigned char *)s->pattern;
+  size_t n = s->len;
+  size_t ms = s->split;
+  size_t mem = 0;
+  while ((size_t)(end - h) >= n) {
+    unsigned char last = fold_byte(s, h[n - 1]);
+    if (!(s->byteset[last >> 3] & (1 << (last & 7)))) {
+      h += n;
+      mem = 0;
+      continue;
+    }
+    size_t k = n - s->shift[last];
+    if (k) {
+      h += k < mem ? mem : k;
+      mem = 0;
+      continue;
+    }
+    for (k = ms + 1 > mem ? ms + 1 : mem; k < n && pat[k] == fold_byte(s, h[k]);
+         k++);
+    if (k < n) {
+      h += k - ms;
+      mem = 0;
+      continue;
+    }
+    for (k = ms + 1; k > mem && pat[k - 1] == fold_byte(s, h[k - 1]);
+         k--);
+    if (k <= mem)
+      return (char *)h;
+    h += s->period;
+    mem = s->period_memory;
+  }
+  return 0;
+}
+
+#if defined(SIMD_AVX2) || defined(SIMD_SSE2) || defined(SIMD_NEON)
+
+#if defined(SIMD_AVX2)
+
+#define VEC_BYTES 32
+typedef __m256i vec;
+#define vec_load(p) _mm256_loadu_si256((const __m256i *)(p))
+#define vec_splat(c) _mm256_set1_epi8((char)(c))
+#define vec_pair(a, b, x, y) \
+  ((uint32_t)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, x), \
+                                                   _mm256_cmpeq_epi8(b, y))))
+#define vec_or(a, b) _mm256_or_si256(a, b)
+#define vec_eq(a, b) _mm256_cmpeq_epi8(a, b)
+#define vec_sub(a, b) _mm256_sub_epi8(a, b)
+#define vec_zero() _mm256_setzero_si256()
+
+static inline uint64_t vec_sum(vec v) {
+  uint64_t t[4];
+  _mm256_storeu_si256((__m256i *)t, _mm256_sad_epu8(v, vec_zero()));
+  return t[0] + t[1] + t[2] + t[3];
+}
+
+#elif defined(SIMD_SSE2)
+
+#define VEC_BYTES 16
+typedef __m128i vec;
+#define vec_load(p) _mm_loadu_si128((const __m128i *)(p))
+#define vec_splat(c) _mm_set1_epi8((char)(c))
+#define vec_pair(a, b, x, y) \
+  ((uint32_t)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, x), \
+                                             _mm_cmpeq_epi8(b, y))))
+#define vec_or(a, b) _mm_or_si128(a, b)
+#define vec_eq(a, b) _mm_cmpeq_epi8(a, b)
+#define vec_sub(a, b) _mm_sub_epi8(a, b)
+#define vec_zero() _mm_setzero_si128()
+
+static inline uint64_t vec_sum(vec v) {
+  uint64_t t[2];
+  _mm_storeu_si128((__m128i *)t, _mm_sad_epu8(v, vec_zero()));
+  return t[0] + t[1];
+}
+
+#elif defined(SIMD_NEON)
+
+#define VEC_BYTES 16
+typedef uint8x16_t vec;
+#define vec_load(p) vld1q_u8((const uint8_t *)(p))
+#define vec_splat(c) vdupq_n_u8((uint8_t)(c))
+#define vec_or(a, b) vorrq_u8(a, b)
+#define vec_eq(a, b) vceqq_u8(a, b)
+#define vec_sub(a, b) vsubq_u8(a, b)
+#define vec_zero() vdupq_n_u8(0)
+#define vec_sum(v) ((uint64_t)vaddlvq_u8(v))
+
+static inline uint32_t vec_pair(vec a, vec b, vec x, vec y) {
+  static const uint8_t weights[16] =
+    {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+  uint8x16_t w = vandq_u8(vandq_u8(vceqq_u8(a, x), vceqq_u8(b, y)),
+                          vld1q_u8(weights));
+  return (uint32_t)vaddv_u8(vget_low_u8(w)) |
+    ((uint32_t)vaddv_u8(vget_high_u8(w)) << 8);
+}
+
+#endif
+
+// Tries the candidates in mask, bit k standing for position i + k.
+static int try_candidates(struct search *s, const char *hay, size_t len,
+                          size_t i, uint32_t mask, size_t *failed,
+                          char **res) {
+  size_t n = s->len;
+  while (mask) {
+    size_t pos = i + __builtin_ctz(mask);
+    mask &= mask - 1;
+    if (pos > len - n) {
+      *res = 0;
+      return 1;
+    }
+    if (same(s, hay + pos)) {
+      *res = (char *)hay + pos;
+      return 1;
+    }
+    if (++*failed * n > 4 * pos + 1024) {
+      *res = find_two_way(s, hay + pos + 1, len - pos - 1);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Candidates are positions where both rare bytes are in place, in either
+// case if folding.  If too many of them fail, the rest is left to Two-Way.
+static char *find_pair_vec(struct search *s, const char *hay, size_t len,
+                           size_t from) {
+  size_t n = s->len;
+  vec b1 = vec_splat(s->pattern[s->rare1]);
+  vec b2 = vec_splat(s->pattern[s->rare2]);
+  vec m1 = vec_splat(s->mask1);
+  vec m2 = vec_splat(s->mask2);
+  size_t far = s->rare1 > s->rare2 ? s->rare1 : s->rare2;
+  size_t failed = 0;
+  char *res;
+  if (len < from + far + VEC_BYTES) {
+    for (size_t i = from; i <= len - n; i++) {
+      if ((hay[i + s->rare1] | s->mask1) == s->pattern[s->rare1] &&
+          (hay[i + s->rare2] | s->mask2) == s->pattern[s->rare2] &&
+          same(s, hay + i))
+        return (char *)hay + i;
+    }
+    return 0;
+  }
+  size_t last = len - far - VEC_BYTES;
+  size_t i = from;
+  // two vectors a round, as candidates are rare
+  for (; i + VEC_BYTES < last; i += 2 * VEC_BYTES) {
+    uint32_t mask = vec_pair(vec_or(vec_load(hay + i + s->rare1), m1),
+                             vec_or(vec_load(hay + i + s->rare2), m2), b1, b2);
+    uint32_t next = vec_pair(vec_or(vec_load(hay + i + VEC_BYTES + s->rare1),
+                                    m1),
+                             vec_or(vec_load(hay + i + VEC_BYTES + s->rare2),
+                                    m2), b1, b2);
+    if (!(mask | next)) continue;
+    if (try_candidates(s, hay, len, i, mask, &failed, &res) ||
+        try_candidates(s, hay, len, i + VEC_BYTES, next, &failed, &res))
+      return res;
+  }
+  for (; i < last; i += VEC_BYTES) {
+    uint32_t mask = vec_pair(vec_or(vec_load(hay + i + s->rare1), m1),
+                             vec_or(vec_load(hay + i + s->rare2), m2), b1, b2);
+    if (try_candidates(s, hay, len, i, mask, &failed, &res))
+      return res;
+  }
+  // one more block flush with the end, without the positions already seen
+  uint32_t mask = vec_pair(vec_or(vec_load(hay + last + s->rare1), m1),
+                           vec_or(vec_load(hay + last + s->rare2), m2), b1, b2);
+  mask &= ~(uint32_t)0 << (i - last);
+  if (try_candidates(s, hay, len, last, mask, &failed, &res))
+    return res;
+  return 0;
+}
+
+#endif
+
+// As long as the rarest byte really is rare, memchr() on it is the fastest
+// filter, and even more so on the short spans of single lines.  Once it
+// turns out to be common the pair filter takes over.
+static char *find_pair(struct search *s, const char *hay, size_t len) {
+  size_t n = s->len;
+  if (len < n) return 0;
+  // memchr() cannot look for a byte in two cases
+  if (s->mask1) {
+#ifdef VEC_BYTES
+    return find_pair_vec(s, hay, len, 0);
+#else
+    return find_two_way(s, hay, len);
+#endif
+  }
+  size_t last = len - n;
+  char b1 = s->pattern[s->rare1];
+  char b2 = s->pattern[s->rare2];
+  size_t hits = 0;
+  for (size_t pos = 0; pos <= last;) {
+    const char *p = memchr(hay + pos + s->rare1, b1, last - pos + 1);
+    if (!p) return 0;
+    pos = p - hay - s->rare1;
+    if ((hay[pos + s->rare2] | s->mask2) == b2 && same(s, hay + pos))
+      return (char *)hay + pos;
+    pos++;
+    if (++hits > 8 && hits * 256 > pos) {
+#ifdef VEC_BYTES
+      return find_pair_vec(s, hay, len, pos);
+#else
+      return find_two_way(s, hay + pos, len - pos);
+#endif
+    }
+  }
+  return 0;
+}
+
+// A byte in either case, where memchr() cannot do.
+static char *find_folded_byte(struct search *s, const char *hay, size_t len) {
+  size_t i = 0;
+#ifdef VEC_BYTES
+  vec b = vec_splat(s->pattern[0]);
+  vec m = vec_splat(s->mask1);
+  for (; i + VEC_BYTES <= len; i += VEC_BYTES) {
+    vec v = vec_or(vec_load(hay + i), m);
+    uint32_t mask = vec_pair(v, v, b, b);
+    if (mask)
+      return (char *)hay + i + __builtin_ctz(mask);
+  }
+#endif
+  for (; i < len; i++)
+    if ((hay[i] | s->mask1) == s->pattern[0])
+      return (char *)hay + i;
+  return 0;
+}
+
+void search_fold(unsigned char *fold) {
+  for (int ch = 0; ch < 256; ch++)
+    fold[ch] = ch >= 'A' && ch <= 'Z' ? ch | 0x20 : ch;
+}
+
+void search_init(struct search *s, const char *pattern, size_t len,
+                 const unsigned char *fold) {
+  s->pattern = pattern;
+  s->len = len;
+  s->fold = fold;
+  if (len == 1) {
+    s->kind = SEARCH_BYTE;
+    s->mask1 = fold_mask(fold, pattern[0]);
+    return;
+  }
+  s->kind = len < LONG_PATTERN ? SEARCH_PAIR : SEARCH_TWO_WAY;
+  init_pair(s);
+  s->mask1 = fold_mask(fold, pattern[s->rare1]);
+  s->mask2 = fold_mask(fold, pattern[s->rare2]);
+  init_two_way(s);
+}
+
+char *search_find(struct search *s, const char *p, size_t len) {
+  switch (s->kind) {
+  case SEARCH_BYTE:
+    if (s->mask1)
+      return find_folded_byte(s, p, len);
+    return memchr(p, s->pattern[0], len);
+  case SEARCH_PAIR:
+    return find_pair(s, p, len);
+  case SEARCH_TWO_WAY:
+    break;
+  }
+  return find_two_way(s, p, len);
+}
+
+// A compare result of -1 is subtracted per byte in the byte lanes of a
+// vector, which are added up before any can overflow.
+size_t search_count(const char *p, size_t len, char ch) {
+  size_t count = 0, i = 0;
+#ifdef VEC_BYTES
+  vec b = vec_splat(ch);
+  while (i + VEC_BYTES <= len) {
+    vec lanes = vec_zero();
+    for (int n = 0; n < 255 && i + VEC_BYTES <= len; n++, i += VEC_BYTES)
+      lanes = vec_sub(lanes, vec_eq(vec_load(p + i), b));
+    count += vec_sum(lanes);
+  }
+#endif
+  for (; i < len; i++)
+    count += p[i] == ch;
+  return count;
+}
@@ -0,0 +1,45 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stddef.h>
+
+enum search_kind {SEARCH_BYTE, SEARCH_PAIR, SEARCH_TWO_WAY};
+
+// A pattern prepared for repeated searching.  Short patterns are found by
+// a vector filter on their two rarest bytes, long ones, and short ones
+// that keep failing verification, by Two-Way with a shift table, so the
+// worst case stays linear.  With a fold table, bytes of the text are taken
+// as the table maps them, and the filters look for the rare bytes of the
+// pattern in both cases at once.
+struct search {
+  const char *pattern;
+  size_t len;
+  enum search_kind kind;
+  const unsigned char *fold; // from search_fold(), or NULL
+  unsigned char mask1;       // set in a byte of the text to compare it with
+  unsigned char mask2;       // the rare bytes in both cases, if folding
+
+  size_t rare1;              // offset of the rarest byte
+  size_t rare2;              // and of the rarest different one
+
+  size_t split;              // critical factorization for Two-Way
+  size_t period;
+  size_t period_memory;      // nonzero if the pattern is periodic
+  unsigned char byteset[32];
+  size_t shift[256];
+};
+
+// Fills fold[256] with the table that takes ASCII letters to lowercase.
+void search_fold(unsigned char *fold);
+
+// Prepares the pattern, which with a fold table must be folded already.
+void search_init(struct search *s, const char *pattern, size_t len,
+                 const unsigned char *fold);
+
+// Returns the first occurrence of the pattern in p[0..len), or NULL.
+char *search_find(struct search *s, const char *p, size_t len);
+
+// Returns how many of the bytes in p[0..len) are ch.
+size_t search_count(const char *p, size_t len, char ch);
+
+#endif
@@ -0,0 +1,436 @@
+#include <string.h>
+
+#include "stats.h"
+#include "utf8.h"
+
+#if defined(NO_SIMD)
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define SIMD_AVX2
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SIMD_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define SIMD_NEON
+#endif
+
+const unsigned char stats_finnish_upper[STATS_FINNISH_LETTERS] =
+  {0xc4, 0xc5, 0xd6};
+
+static size_t consume_utf8(struct stats *s, const char *p, size_t len,
+                           int end) {
+  size_t i = 0;
+  while (1) {
+    enum utf8_class cls;
+    int bad_len;
+    i += utf8_find_bad(p + i, len - i, end, &cls, &bad_len);
+    switch (cls) {
+    case UTF8_VALID:
+    case UTF8_INCOMPLETE:
+      return i;
+    case UTF8_UPPER_CONTROL:
+      s->utf8_upper_control_count++;
+      break;
+    case UTF8_OVERLONG:
+      s->utf8_overlong_count++;
+      break;
+    case UTF8_ORPHAN_CONTINUATION:
+      s->utf8_orphan_continuation_count++;
+      break;
+    case UTF8_MISSING_CONTINUATION:
+      s->utf8_missing_continuation_count++;
+      break;
+    case UTF8_ILLEGAL:
+      s->utf8_illegal_count++;
+      break;
+    }
+    i += bad_len;
+  }
+}
+
+static void count_byte(struct stats *s, int ch) {
+  s->last_byte_nl = ch == '\n';
+
+  if (ch == '\n') {
+    if (s->last_byte_cr)
+      s->windows_line_count++;
+    if (s->last_byte_whitespace)
+      s->trailing_whitespace_count++;
+    s->line_count++;
+  }
+
+  s->last_byte_cr = ch == '\r';
+  if (ch != '\r')
+    s->last_byte_whitespace = ch == '\t' || ch == ' ';
+
+  if (!ch) {
+    s->null_char_count++;
+  }
+
+  if (ch > 0 && ch < ' ' && ch != '\r' && ch != '\n' && ch != '\t')
+    s->control_count++;
+
+  if (ch >= 0x80 && ch < 0xa0)
+    s->upper_control_count++;
+
+  if (ch >= 0xa0 && ch < 0x100)
+    s->upper_printable_count++;
+
+  for (int i = 0; i < STATS_FINNISH_LETTERS; i++)
+    if ((ch | 0x20) == (stats_finnish_upper[i] | 0x20))
+      s->latin1_finnish_count++;
+}
+
+#if defined(SIMD_AVX2) || defined(SIMD_SSE2) || defined(SIMD_NEON)
+
+// One bit per byte of a 64-byte block, bit i for byte i, for the bytes
+// that are counted by what comes before them.
+struct block_masks {
+  uint64_t nl;         // '\n'
+  uint64_t cr;         // '\r'
+  uint64_t ws;         // '\t' or ' '
+};
+
+#if defined(SIMD_AVX2)
+
+#define VEC_BYTES 32
+typedef __m256i vec;
+#define vec_load(p) _mm256_loadu_si256((const __m256i *)(p))
+#define vec_splat(c) _mm256_set1_epi8((char)(c))
+#define vec_and(a, b) _mm256_and_si256(a, b)
+#define vec_or(a, b) _mm256_or_si256(a, b)
+#define vec_xor(a, b) _mm256_xor_si256(a, b)
+#define vec_eq(a, b) _mm256_cmpeq_epi8(a, b)
+#define vec_sub(a, b) _mm256_sub_epi8(a, b)
+#define vec_zero() _mm256_setzero_si256()
+#define vec_mask(v) ((uint64_t)(uint32_t)_mm256_movemask_epi8(v))
+
+static inline uint64_t vec_sum(vec v) {
+  uint64_t t[4];
+  _mm256_storeu_si256((__m256i *)t, _mm256_sad_epu8(v, vec_zero()));
+  return t[0] + t[1] + t[2] + t[3];
+}
+
+#elif defined(SIMD_SSE2)
+
+#define VEC_BYTES 16
+typedef __m128i vec;
+#define vec_load(p) _mm_loadu_si128((const __m128i *)(p))
+#define vec_splat(c) _mm_set1_epi8((char)(c))
+#define vec_and(a, b) _mm_and_si128(a, b)
+#define vec_or(a, b) _mm_or_si128(a, b)
+#define vec_xor(a, b) _mm_xor_si128(a, b)
+#define vec_eq(a, b) _mm_cmpeq_epi8(a, b)
+#define vec_sub(a, b) _mm_sub_epi8(a, b)
+#define vec_zero() _mm_setzero_si128()
+#define vec_mask(v) ((uint64_t)(uint32_t)_mm_movemask_epi8(v))
+
+static inline uint64_t vec_sum(vec v) {
+  uint64_t t[2];
+  _mm_storeu_si128((__m128i *)t, _mm_sad_epu8(v, vec_zero()));
+  return t[0] + t[1];
+}
+
+#elif defined(SIMD_NEON)
+
+#define VEC_BYTES 16
+typedef uint8x16_t vec;
+#define vec_load(p) vld1q_u8((const uint8_t *)(p))
+#define vec_splat(c) vdupq_n_u8((uint8_t)(c))
+#define vec_and(a, b) vandq_u8(a, b)
+#define vec_or(a, b) vorrq_u8(a, b)
+#define vec_xor(a, b) veorq_u8(a, b)
+#define vec_eq(a, b) vceqq_u8(a, b)
+#define vec_sub(a, b) vsubq_u8(a, b)
+#define vec_zero() vdupq_n_u8(0)
+#define vec_sum(v) ((uint64_t)vaddlvq_u8(v))
+
+// NEON has no movemask, so weight each lane by its bit and add up halves.
+static inline uint64_t vec_mask(uint8x16_t v) {
+  static const uint8_t weights[16] =
+    {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+  uint8x16_t w = vandq_u8(v, vld1q_u8(weights));
+  return (uint64_t)vaddv_u8(vget_low_u8(w)) |
+    ((uint64_t)vaddv_u8(vget_high_u8(w)) << 8);
+}
+
+#endif
+
+// Bytes that only count by their own value are counted in the byte lanes
+// of vectors, a compare result of -1 subtracted per byte.  A lane takes at
+// most 64 / VEC_BYTES per block, so the lanes are widened to the 64-bit
+// counters once every LANE_BLOCKS blocks.
+#define LANE_BLOCKS 63
+
+struct block_lanes {
+  vec nul;             // 0x00
+  vec control;         // 0x01-0x1f but '\t', '\n', '\r'
+  vec upper;           // 0x80-0x9f
+  vec upper_printable; // 0xa0-0xff
+  vec finnish;         // latin1 ÄÅÖäåö
+};
+
+static void block_masks(const char *p, struct block_masks *m,
+                        struct block_lanes *l) {
+  vec top3 = vec_splat(0xe0);
+  memset(m, 0, sizeof(*m));
+  for (int k = 0; k < 64; k += VEC_BYTES) {
+    vec v = vec_load(p + k);
+    vec v3 = vec_and(v, top3);
+    vec nl = vec_eq(v, vec_splat('\n'));
+    vec cr = vec_eq(v, vec_splat('\r'));
+    vec nul = vec_eq(v, vec_zero());
+    vec tab = vec_eq(v, vec_splat('\t'));
+    vec ws = vec_or(tab, vec_eq(v, vec_splat(' ')));
+    vec low = vec_eq(v3, vec_zero());
+    vec upper = vec_eq(v3, vec_splat(0x80));
+    vec upper_printable = vec_or(vec_eq(v3, vec_splat(0xa0)),
+                                 vec_or(vec_eq(v3, vec_splat(0xc0)),
+                                        vec_eq(v3, top3)));
+    // either case, by the bit between them
+    vec lower = vec_or(v, vec_splat(0x20));
+    vec finnish = vec_zero();
+    for (int i = 0; i < STATS_FINNISH_LETTERS; i++)
+      finnish = vec_or(finnish,
+                       vec_eq(lower, vec_splat(stats_finnish_upper[i] | 0x20)));
+    // nul, tab, nl and cr are all low
+    vec control = vec_xor(low, vec_or(vec_or(nul, tab), vec_or(nl, cr)));
+    m->nl |= vec_mask(nl) << k;
+    m->cr |= vec_mask(cr) << k;
+    m->ws |= vec_mask(ws) << k;
+    l->nul = vec_sub(l->nul, nul);
+    l->control = vec_sub(l->control, control);
+    l->upper = vec_sub(l->upper, upper);
+    l->upper_printable = vec_sub(l->upper_printable, upper_printable);
+    l->finnish = vec_sub(l->finnish, finnish);
+  }
+}
+
+static void widen_lanes(struct stats *s, struct block_lanes *l) {
+  s->null_char_count += vec_sum(l->nul);
+  s->control_count += vec_sum(l->control);
+  s->upper_control_count += vec_sum(l->upper);
+  s->upper_printable_count += vec_sum(l->upper_printable);
+  s->latin1_finnish_count += vec_sum(l->finnish);
+  l->nul = l->control = l->upper = l->upper_printable = l->finnish =
+    vec_zero();
+}
+
+// Same as count_byte() on 64 bytes, except for the counts left in lanes.
+static void consume_block(struct stats *s, const char *p,
+                          struct block_lanes *l) {
+  struct block_masks m;
+  block_masks(p, &m, l);
+  s->byte_count += 64;
+
+  uint64_t cr_in = s->last_byte_cr;
+  uint64_t ws_in = s->last_byte_whitespace;
+  // whitespace state after each byte: carried over carriage returns
+  uint64_t ws = m.ws, next;
+  while ((next = m.ws | (m.cr & ((ws << 1) | ws_in))) != ws)
+    ws = next;
+
+  s->line_count += __builtin_popcountll(m.nl);
+  s->windows_line_count += __builtin_popcountll(m.nl & ((m.cr << 1) | cr_in));
+  s->trailing_whitespace_count +=
+    __builtin_popcountll(m.nl & ((ws << 1) | ws_in));
+
+  s->last_byte_nl = m.nl >> 63;
+  s->last_byte_cr = m.cr >> 63;
+  s->last_byte_whitespace = ws >> 63;
+}
+
+// Counts the newlines of the whole blocks at the start of p and returns
+// their length.
+static size_t count_newline_blocks(struct stats *s, const char *p,
+                                   size_t len) {
+  vec nl = vec_splat('\n');
+  size_t i = 0;
+  while (i + 64 <= len) {
+    vec lanes = vec_zero();
+    for (int n = 0; n < LANE_BLOCKS && i + 64 <= len; n++, i += 64)
+      for (int k = 0; k < 64; k += VEC_BYTES)
+        lanes = vec_sub(lanes, vec_eq(vec_load(p + i + k), nl));
+    s->line_count += vec_sum(lanes);
+  }
+  return i;
+}
+
+// Counts the whole blocks at the start of p and returns their length.
+static size_t consume_blocks(struct stats *s, const char *p, size_t len) {
+  struct block_lanes l;
+  l.nul = l.control = l.upper = l.upper_printable = l.finnish = vec_zero();
+  size_t i = 0;
+  while (i + 64 <= len) {
+    for (int n = 0; n < LANE_BLOCKS && i + 64 <= len; n++, i += 64)
+      consume_block(s, p + i, &l);
+    widen_lanes(s, &l);
+  }
+  return i;
+}
+
+#define HAVE_CONSUME_BLOCK
+
+#endif
+
+static void consume_lines_only(struct stats *s, const char *p, size_t len) {
+  size_t i = 0;
+#ifdef HAVE_CONSUME_BLOCK
+  i = count_newline_blocks(s, p, len);
+#endif
+  for (; i < len; i++)
+    s->line_count += p[i] == '\n';
+  s->byte_count += len;
+  s->last_byte_nl = p[len - 1] == '\n';
+}
+
+// Returns how much of p was counted.  Unless end is set, an incomplete utf8
+// sequence at the end is left for the next call, so that the byte counts
+// never run ahead of the utf8 checks.  Lines alone need no such care.
+static size_t consume(struct stats *s, enum stats_subset subset,
+                      const char *p, size_t len, int end) {
+  if (!len) return 0;
+  if (subset == STATS_LINES_ONLY) {
+    consume_lines_only(s, p, len);
+    return len;
+  }
+  len = consume_utf8(s, p, len, end);
+  if (subset == STATS_UTF8_ONLY) {
+    s->byte_count += len;
+    if (len)
+      s->last_byte_nl = p[len - 1] == '\n';
+    return len;
+  }
+  size_t i = 0;
+#ifdef HAVE_CONSUME_BLOCK
+  i = consume_blocks(s, p, len);
+#endif
+  for (; i < len; i++) {
+    s->byte_count++;
+    count_byte(s, (int)p[i] & 255);
+  }
+  return len;
+}
+
+void stats_init(struct stats_ctx *c) {
+  memset(c, 0, sizeof(*c));
+  c->lead = STATS_ALL_CR;
+}
+
+// What merging needs to know of the start of the bytes p[0..len).
+static int lead_flags(const char *p, size_t len) {
+  size_t i = 0;
+  while (i < len && p[i] == '\r')
+    i++;
+  if (i == len)
+    return STATS_ALL_CR;
+  if (p[i] != '\n')
+    return 0;
+  return i ? STATS_LEAD_CR_NL : STATS_LEAD_CR_NL | STATS_LEAD_NL;
+}
+
+// A sequence carried over is completed from the first bytes fed next, and
+// what is left incomplete at the end of p is carried over in turn, so the
+// byte counts never run ahead of the utf8 checks.
+void stats_feed(struct stats_ctx *c, const char *p, size_t len) {
+  if (!len) return;
+  if (c->lead & STATS_ALL_CR) {
+    int first = !c->stats.byte_count && !c->carry_len;
+    c->lead = lead_flags(p, len);
+    if (!first)
+      c->lead &= ~STATS_LEAD_NL;
+  }
+  if (c->carry_len) {
+    size_t n = len < 4 ? len : 4;
+    memcpy(c->carry + c->carry_len, p, n);
+    size_t done = consume(&c->stats, c->subset, c->carry, c->carry_len + n,
+                          0);
+    if (!done) {
+      c->carry_len += n;
+      return;
+    }
+    p += done - c->carry_len;
+    len -= done - c->carry_len;
+    c->carry_len = 0;
+  }
+  size_t done = consume(&c->stats, c->subset, p, len, 0);
+  c->carry_len = len - done;
+  memcpy(c->carry, p + done, c->carry_len);
+}
+
+void stats_finish(struct stats_ctx *c) {
+  if (c->carry_len)
+    consume(&c->stats, c->subset, c->carry, c->carry_len, 1);
+  c->carry_len = 0;
+}
+
+// The line endings and the trailing whitespace right at the start of the
+// bytes of from are fixed up here, by its lead flags.  Chunks and files
+// start at utf8 sequence boundaries and need no fixing for utf8.
+void stats_merge(struct stats_ctx *to, const struct stats_ctx *from) {
+  struct stats *t = &to->stats;
+  const struct stats *f = &from->stats;
+  int lead = from->lead;
+  if (!f->byte_count) return;
+  if (!t->byte_count)
+    to->lead = lead;
+  else if (to->lead & STATS_ALL_CR)
+    to->lead = lead & ~STATS_LEAD_NL;
+  if (t->last_byte_cr && (lead & STATS_LEAD_NL))
+    t->windows_line_count++;
+  int last_byte_whitespace = t->last_byte_whitespace;
+  if (!(lead & STATS_ALL_CR)) {
+    if (last_byte_whitespace && (lead & STATS_LEAD_CR_NL))
+      t->trailing_whitespace_count++;
+    last_byte_whitespace = f->last_byte_whitespace;
+  }
+
+  t->byte_count += f->byte_count;
+  t->utf8_missing_continuation_count += f->utf8_missing_continuation_count;
+  t->utf8_orphan_continuation_count += f->utf8_orphan_continuation_count;
+  t->utf8_overlong_count += f->utf8_overlong_count;
+  t->utf8_upper_control_count += f->utf8_upper_control_count;
+  t->utf8_illegal_count += f->utf8_illegal_count;
+  t->line_count += f->line_count;
+  t->windows_line_count += f->windows_line_count;
+  t->trailing_whitespace_count += f->trailing_whitespace_count;
+  t->null_char_count += f->null_char_count;
+  t->control_count += f->control_count;
+  t->upper_control_count += f->upper_control_count;
+  t->upper_printable_count += f->upper_printable_count;
+  t->latin1_finnish_count += f->latin1_finnish_count;
+
+  t->last_byte_nl = f->last_byte_nl;
+  t->last_byte_cr = f->last_byte_cr;
+  t->last_byte_whitespace = last_byte_whitespace;
+}
+
+const char *stats_class_names[] = {"ascii", "utf8", "latin1", "binary"};
+
+enum stats_class stats_class(const struct stats *s, const struct stats *since) {
+  if (s->null_char_count != since->null_char_count)
+    return STATS_BINARY;
+  uint64_t bad =
+    s->utf8_missing_continuation_count + s->utf8_orphan_continuation_count +
+    s->utf8_overlong_count + s->utf8_illegal_count;
+  uint64_t bad_since =
+    since->utf8_missing_continuation_count +
+    since->utf8_orphan_continuation_count + since->utf8_overlong_count +
+    since->utf8_illegal_count;
+  if (bad != bad_since)
+    return STATS_LATIN1;
+  if (s->upper_control_count != since->upper_control_count ||
+      s->upper_printable_count != since->upper_printable_count)
+    return STATS_UTF8;
+  return STATS_ASCII;
+}
+
+// A byte that is not a continuation, or one after three continuations.
+size_t stats_chunk_start(const char *p, size_t len, size_t pos) {
+  while (pos < len && (p[pos] & 0xc0) == 0x80 &&
+         !(pos >= 3 && (p[pos - 1] & 0xc0) == 0x80 &&
+           (p[pos - 2] & 0xc0) == 0x80 && (p[pos - 3] & 0xc0) == 0x80))
+    pos++;
+  return pos;
+}
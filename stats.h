@@ -0,0 +1,84 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The counts of textstats, for one stream of bytes fed in pieces of any
+// size.  Nothing is allocated, so a context can live anywhere and any
+// number of them can be fed from different threads.
+
+#define STATS_LEAD_NL 1           // first byte is a newline
+#define STATS_LEAD_CR_NL 2        // first byte after leading CRs is one
+#define STATS_ALL_CR 4            // nothing but CRs, or empty
+
+// The uppercase Finnish letters Ä, Å and Ö in latin1.  Their lowercase
+// ones are each 0x20 more, and so are the last bytes of their utf8.
+#define STATS_FINNISH_LETTERS 3
+extern const unsigned char stats_finnish_upper[STATS_FINNISH_LETTERS];
+
+struct stats {
+  uint64_t byte_count;
+
+  uint64_t utf8_missing_continuation_count;
+  uint64_t utf8_orphan_continuation_count;
+  uint64_t utf8_overlong_count;
+  uint64_t utf8_upper_control_count;
+  uint64_t utf8_illegal_count;
+
+  int last_byte_nl;
+  int last_byte_cr;
+  int last_byte_whitespace;
+
+  uint64_t line_count;
+  uint64_t windows_line_count;
+  uint64_t trailing_whitespace_count;
+  uint64_t null_char_count;
+  uint64_t control_count;
+  uint64_t upper_control_count;
+  uint64_t upper_printable_count;
+  uint64_t latin1_finnish_count;
+};
+
+// What a context counts.  A subset is counted by a scanner of its own,
+// faster than the whole, and the counts outside it stay 0.
+enum stats_subset {
+  STATS_EVERYTHING,
+  STATS_LINES_ONLY,          // bytes, lines and last_byte_nl
+  STATS_UTF8_ONLY,           // bytes, the utf8 counts and last_byte_nl
+};
+
+struct stats_ctx {
+  struct stats stats;
+  enum stats_subset subset;  // STATS_EVERYTHING unless set after init
+  int lead;                  // STATS_LEAD_* of the bytes so far
+  char carry[8];             // an incomplete utf8 sequence fed last
+  size_t carry_len;
+};
+
+void stats_init(struct stats_ctx *c);
+
+void stats_feed(struct stats_ctx *c, const char *p, size_t len);
+
+// Counts what was carried over as the end of the stream.  The context can
+// be fed on after it, but then a sequence cut by the end is counted bad.
+void stats_finish(struct stats_ctx *c);
+
+// Adds the counts of a finished context, fed from a clean state with the
+// bytes that followed those of to, to to.  Chunks of one buffer can be
+// counted apart this way if they start at stats_chunk_start().
+void stats_merge(struct stats_ctx *to, const struct stats_ctx *from);
+
+// What a stretch of bytes looks like, by its counts alone: any NUL makes
+// it binary, any bad utf8 latin1, any byte past 0x7f utf8.
+enum stats_class {STATS_ASCII, STATS_UTF8, STATS_LATIN1, STATS_BINARY};
+
+extern const char *stats_class_names[];
+
+// The class of the bytes counted into s since it was since.
+enum stats_class stats_class(const struct stats *s, const struct stats *since);
+
+// Moves pos forward to where no utf8 sequence can straddle it.
+size_t stats_chunk_start(const char *p, size_t len, size_t pos);
+
+#endif
@@ -0,0 +1,397 @@
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "decode.h"
+#include "input.h"
+#include "reader.h"
+#include "timing.h"
+#include "utf8.h"
+#include "util.h"
+
+char *help_text =
+  "textfix [-chlw] [--buffer-size=<bytes>] [--no-decompress] [--no-mmap]\n"
+  "        [--no-uring] [--stats-timing] [--] <file>*\n"
+  "Repairs the encoding of text: bytes that are not part of valid utf8 are\n"
+  "taken as cp1252 and converted to utf8, valid utf8 is left alone.  Reads\n"
+  "stdin or named files, decompressing gzip and zstd ones, and writes stdout.\n"
+  "  -c            Turn CRLF line endings into LF\n"
+  "  -h            Print this help text\n"
+  "  -l            Take bytes 0x80-0x9f as latin1 control characters, not\n"
+  "                as cp1252\n"
+  "  -w            Strip trailing whitespace\n"
+  "  --buffer-size=<bytes>\n"
+  "                Read files in pieces of up to <bytes>, by default 128k,\n"
+  "                or 1M when the first file is big and read, not mapped\n"
+  "  --no-decompress\n"
+  "                Take compressed files as they are\n"
+  "  --no-mmap     Read regular files instead of mapping them\n"
+  "  --no-uring    Read ahead with a thread instead of io_uring\n"
+  "  --stats-timing\n"
+  "                Report to stderr at exit and on SIGUSR1 how long reading,\n"
+  "                decompressing, fixing and writing took, in how many calls\n"
+  "                and on how many bytes\n";
+
+int fix_crlf = 0;
+int fix_whitespace = 0;
+int use_latin1 = 0;
+int use_decompress = 1;
+int use_mmap = 1;
+int use_uring = 1;
+
+void parse_options(int argc, char **argv) {
+  while (1) {
+    static struct option long_options[] =
+      {
+       {"crlf", no_argument, 0, 'c'},
+       {"help", no_argument, 0, 'h'},
+       {"latin1", no_argument, 0, 'l'},
+       {"whitespace", no_argument, 0, 'w'},
+       {"buffer-size", required_argument, 0, 'K'},
+       {"no-decompress", no_argument, 0, 'Z'},
+       {"no-mmap", no_argument, 0, 'M'},
+       {"no-uring", no_argument, 0, 'U'},
+       {"stats-timing", no_argument, 0, 'T'},
+       {}
+      };
+    int option_index = 0;
+    int c = getopt_long(argc, argv, "chlw", long_options, &option_index);
+    if (c == -1) break;
+    switch (c) {
+    case 'c':
+      fix_crlf = 1;
+      break;
+    case 'h':
+      fprintf(stderr, "%s", help_text);
+      exit(0);
+    case 'l':
+      use_latin1 = 1;
+      break;
+    case 'w':
+      fix_whitespace = 1;
+      break;
+    case 'K': {
+      long len = str2long(optarg);
+      if (len < 4096 || len > 1 << 30)
+        exit_printf("buffer size must be from 4096 bytes to 1G\n");
+      reader_buffer_len = len;
+      break;
+    }
+    case 'Z':
+      use_decompress = 0;
+      break;
+    case 'M':
+      use_mmap = 0;
+      break;
+    case 'U':
+      use_uring = 0;
+      break;
+    case 'T':
+      timing_enabled = 1;
+      break;
+    }
+  }
+}
+
+// Unicode of the cp1252 bytes 0x80-0x9f, the five undefined ones kept as
+// in latin1, like Windows does
+const unsigned short cp1252[32] = {
+  0x20ac, 0x0081, 0x201a, 0x0192, 0x201e, 0x2026, 0x2020, 0x2021,
+  0x02c6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008d, 0x017d, 0x008f,
+  0x0090, 0x2018, 0x2019, 0x201c, 0x201d, 0x2022, 0x2013, 0x2014,
+  0x02dc, 0x2122, 0x0161, 0x203a, 0x0153, 0x009d, 0x017e, 0x0178,
+};
+
+// utf8 of each byte 0x80-0xff, with its length in the last byte
+char conversion[128][4];
+
+void init_conversion() {
+  for (int i = 0; i < 128; i++) {
+    unsigned c = i < 32 && !use_latin1 ? cp1252[i] : 0x80 + i;
+    char *out = conversion[i];
+    if (c < 0x800) {
+      out[0] = 0xc0 | c >> 6;
+      out[1] = 0x80 | (c & 0x3f);
+      out[3] = 2;
+    } else {
+      out[0] = 0xe0 | c >> 12;
+      out[1] = 0x80 | (c >> 6 & 0x3f);
+      out[2] = 0x80 | (c & 0x3f);
+      out[3] = 3;
+    }
+  }
+}
+
+// Output is collected here and written with one write() when full.  Long
+// clean stretches of input are not copied but written along with it.
+char out_buffer[1 << 18];
+size_t out_len = 0;
+
+void write_all(struct iovec *iov, int count) {
+  while (count) {
+    uint64_t start = timing_start();
+    timing_syscall();
+    ssize_t len = writev(1, iov, count);
+    timing_end(TIMING_WRITE, start, len > 0 ? len : 0);
+    if (len == -1) {
+      if (errno == EINTR) continue;
+      errno_printf("cannot write");
+    }
+    while (count && len >= iov->iov_len) {
+      len -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count) {
+      iov->iov_base = (char *)iov->iov_base + len;
+      iov->iov_len -= len;
+    }
+  }
+}
+
+void out_flush() {
+  struct iovec iov = {out_buffer, out_len};
+  write_all(&iov, 1);
+  out_len = 0;
+}
+
+void out_write(char *p, size_t len) {
+  // pending is null until something is held back
+  if (!len) return;
+  if (out_len + len <= sizeof(out_buffer)) {
+    memcpy(out_buffer + out_len, p, len);
+    out_len += len;
+    return;
+  }
+  if (len < sizeof(out_buffer) / 2) {
+    out_flush();
+    memcpy(out_buffer, p, len);
+    out_len = len;
+    return;
+  }
+  struct iovec iov[2] = {{out_buffer, out_len}, {p, len}};
+  write_all(iov, 2);
+  out_len = 0;
+}
+
+// Blanks and CRs at the end of what was seen so far, held back until it
+// is known whether they end a line.
+char *pending = 0;
+size_t pending_len = 0;
+size_t pending_cap = 0;
+
+void hold(char *p, size_t len) {
+  if (!len) return;
+  if (pending_len + len > pending_cap) {
+    size_t cap = pending_cap ? 2 * pending_cap : 4096;
+    while (cap < pending_len + len)
+      cap *= 2;
+    pending = realloc(pending, cap);
+    if (!pending)
+      exit_printf("cannot allocate %zu bytes\n", cap);
+    pending_cap = cap;
+  }
+  memcpy(pending + pending_len, p, len);
+  pending_len += len;
+}
+
+void release() {
+  out_write(pending, pending_len);
+  pending_len = 0;
+}
+
+// What is held back ends a line.  Blanks go with -w, and the CR right
+// before the newline with -c.
+void end_line() {
+  size_t n = 0;
+  for (size_t i = 0; i < pending_len; i++)
+    if (!fix_whitespace || pending[i] == '\r')
+      pending[n++] = pending[i];
+  if (fix_crlf && n && pending[n - 1] == '\r')
+    n--;
+  out_write(pending, n);
+  pending_len = 0;
+  out_write("\n", 1);
+}
+
+int is_blank(char ch) {
+  return ch == ' ' || ch == '\t' || ch == '\r';
+}
+
+// Valid utf8 is written as it is but for the ends of its lines.  A line
+// with nothing to strip goes out in one piece.
+void fix_text(char *p, size_t len) {
+  if (!fix_crlf && !fix_whitespace) {
+    out_write(p, len);
+    return;
+  }
+  char *end = p + len;
+  while (p < end) {
+    char *nl = memchr(p, '\n', end - p);
+    char *stop = nl ? nl : end;
+    char *blanks = stop;
+    while (blanks > p && is_blank(blanks[-1]))
+      blanks--;
+    if (blanks > p)
+      release();
+    if (nl && blanks == nl && !pending_len) {
+      out_write(p, nl + 1 - p);
+      p = nl + 1;
+      continue;
+    }
+    out_write(p, blanks - p);
+    hold(blanks, stop - blanks);
+    if (!nl) break;
+    end_line();
+    p = nl + 1;
+  }
+}
+
+void fix_byte(unsigned char ch) {
+  release();
+  if (ch < 0x80)
+    out_write((char *)&ch, 1);
+  else
+    out_write(conversion[ch - 0x80], conversion[ch - 0x80][3]);
+}
+
+// Returns how much of p was fixed.  Unless final is set, an incomplete utf8
+// sequence at the end is left for the next call.
+size_t fix_span(char *p, size_t len, int final) {
+  size_t i = 0;
+  while (1) {
+    enum utf8_class cls;
+    int bad_len;
+    size_t bad = i + utf8_find_bad(p + i, len - i, final, &cls, &bad_len);
+    fix_text(p + i, bad - i);
+    if (cls == UTF8_VALID)
+      return len;
+    if (cls == UTF8_INCOMPLETE)
+      return bad;
+    if (cls == UTF8_UPPER_CONTROL) // valid, if odd
+      fix_text(p + bad, bad_len);
+    else
+      for (int k = 0; k < bad_len; k++)
+        fix_byte(p[bad + k]);
+    i = bad + bad_len;
+  }
+}
+
+// an incomplete utf8 sequence at the end of the last piece
+char carry[8];
+size_t carry_len = 0;
+
+void fix_feed(char *p, size_t len) {
+  uint64_t start = timing_start();
+  size_t fed = len;
+  if (carry_len) {
+    size_t n = len < 4 ? len : 4;
+    memcpy(carry + carry_len, p, n);
+    size_t done = fix_span(carry, carry_len + n, 0);
+    if (!done) {
+      carry_len += n;
+      timing_end(TIMING_SCAN, start, fed);
+      return;
+    }
+    p += done - carry_len;
+    len -= done - carry_len;
+    carry_len = 0;
+  }
+  size_t done = fix_span(p, len, 0);
+  carry_len = len - done;
+  memcpy(carry, p + done, carry_len);
+  timing_end(TIMING_SCAN, start, fed);
+}
+
+// Blanks at the end of a file that does not end in a newline are kept.
+void fix_finish() {
+  fix_span(carry, carry_len, 1);
+  carry_len = 0;
+  release();
+}
+
+// the files in argv, read ahead
+struct reader reader;
+
+// the file at hand if it is compressed
+struct decoder decoder;
+
+// Fixes the rest of the stream that starts with p[0..len), which the
+// caller fixes itself if it is not compressed.
+int run_decoded(char *p, size_t len, decode_source *source) {
+  if (!use_decompress) return 0;
+  int decoding = decoder_start(&decoder, p, len, source, &reader);
+  if (decoding == -1)
+    errno_printf("cannot decompress");
+  if (!decoding) return 0;
+  while (1) {
+    uint64_t start = timing_start();
+    ssize_t n = decoder_read(&decoder, &p, SIZE_MAX);
+    timing_end(TIMING_READ, start, n > 0 ? n : 0);
+    if (n == -1)
+      errno_printf("cannot decompress");
+    if (!n) break;
+    fix_feed(p, n);
+  }
+  decoder_stop(&decoder);
+  return 1;
+}
+
+void run_fd(int fd) {
+  size_t map_len;
+  char *map = use_mmap ? input_map(fd, &map_len) : 0;
+  if (map) {
+    if (!run_decoded(map, map_len, 0))
+      fix_feed(map, map_len);
+    input_unmap(map, map_len);
+  } else {
+    int first = 1;
+    while (1) {
+      char *p;
+      uint64_t start = timing_start();
+      ssize_t len = reader_read(&reader, &p, SIZE_MAX);
+      timing_end(TIMING_READ, start, len > 0 ? len : 0);
+      if (len == -1)
+        errno_printf("cannot read");
+      if (!len) break;
+      if (first && run_decoded(p, len, decode_from_reader)) break;
+      first = 0;
+      fix_feed(p, len);
+    }
+  }
+  fix_finish();
+}
+
+void run(int index, int argc, char **argv) {
+  int count = index == argc ? 1 : argc - index;
+  char **names = allocate(count * sizeof(char *));
+  for (int i = 0; i < count; i++)
+    names[i] = index == argc || !strcmp(argv[index + i], "-") ? 0 :
+      argv[index + i];
+  if (reader_init(&reader, names, count, use_mmap, !use_uring))
+    errno_printf("cannot start reading");
+  for (int i = 0; i < count; i++) {
+    int fd = reader_next(&reader);
+    if (fd == -1)
+      errno_printf("cannot open file \"%s\"", names[i]);
+    run_fd(fd);
+  }
+  reader_free(&reader);
+  free(names);
+}
+
+int main(int argc, char **argv) {
+  parse_options(argc, argv);
+  timing_setup();
+  init_conversion();
+  run(optind, argc, argv);
+  out_flush();
+  return 0;
+}
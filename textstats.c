@@ -1,300 +1,1048 @@
+#define _DEFAULT_SOURCE
+
 #include <errno.h>
-#include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <limits.h>
-#include <stdarg.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "decode.h"
+#include "follow.h"
+#include "input.h"
+#include "reader.h"
+#include "stats.h"
+#include "timing.h"
+#include "tuidx.h"
+#include "utf8.h"
+#include "util.h"
+#include "walk.h"
+
 char *help_text =
-  "textstats [-hr] [--] <file>*\n"
-  "Checks encoding and line endings, counts lines, etc.\n"
+  "textstats [-FRhrx] [-j <jobs>] [--buffer-size=<bytes>] [--map[=<len>]]\n"
+  "          [--only=<counts>] [--snapshot=<seconds>] [--no-decompress]\n"
+  "          [--no-mmap] [--no-uring] [--stats-timing] [--] <file>*\n"
+  "Checks encoding and line endings, counts lines, etc.  gzip and zstd files\n"
+  "are decompressed.\n"
+  "  -F            Follow the file, which must be the only one, as it grows\n"
+  "                like tail -f, and write the counts again whenever more\n"
+  "                has been counted, as if the file ended there\n"
+  "  -R            Count all files under the directories named, or under .,\n"
+  "                in name order, or biggest first with -j; one that cannot\n"
+  "                be read is warned about and makes the exit status 1\n"
   "  -h            Print this help text\n"
-  "  -r            Use color codes in output\n";
+  "  -j <jobs>     Split each mapped file between <jobs> threads, and with -R\n"
+  "                read the directories and count the files with as many\n"
+  "  -r            Use color codes in output\n"
+  "  -x            Answer from <file>.tuidx index files, and write them where\n"
+  "                they are missing or stale\n"
+  "  --buffer-size=<bytes>\n"
+  "                Read files in pieces of up to <bytes>, by default 128k,\n"
+  "                or 1M when the first file is big and read, not mapped\n"
+  "  --format=<f>  Write each file and the total to stdout as <f>: json (an\n"
+  "                object a line), tsv or binary, with all counts; the\n"
+  "                default is text, of the total only, to stderr\n"
+  "  --map[=<len>] Write a map of each file to stdout instead, a line for\n"
+  "                each run of blocks of <len> bytes (default 65536) of one\n"
+  "                class: ascii, utf8, latin1 or binary\n"
+  "  --only=<counts>\n"
+  "                Count only lines, or only bytes and bad utf8 with utf8,\n"
+  "                faster than all; the other counts are left 0\n"
+  "  --snapshot=<seconds>\n"
+  "                With -F, write the counts every <seconds> instead\n"
+  "  --no-decompress\n"
+  "                Take compressed files as they are\n"
+  "  --no-mmap     Read regular files instead of mapping them\n"
+  "  --no-uring    Read ahead with a thread instead of io_uring\n"
+  "  --stats-timing\n"
+  "                Report to stderr at exit and on SIGUSR1 how long reading,\n"
+  "                decompressing and counting took, in how many calls and on\n"
+  "                how many bytes\n";
 
-int use_color = 0;
+int use_decompress = 1;
+int use_mmap = 1;
+int use_uring = 1;
+int use_index = 0;
+long jobs = 1;
+long map_block_len = 0;          // 0 for no map
+int follow = 0;
+int recursive = 0;
+uint64_t snapshot_ns = 0;        // 0 for a snapshot after each growth
 
-char *foreground_red = "\033[31m";
-char *foreground_green = "\033[32m";
-char *foreground_yellow = "\033[33m";
-char *foreground_reset = "\033[39m";
-char *attribute_reset = "\033[0m";
-char *bold = "\033[1m";
+enum format {FORMAT_TEXT, FORMAT_JSON, FORMAT_TSV, FORMAT_BINARY};
+enum format format = FORMAT_TEXT;
+enum stats_subset subset = STATS_EVERYTHING;
+// smallest piece of a file worth a thread of its own
+size_t min_chunk_len = 1 << 20;
 
-void color_vprintf(char *color, char *fmt, va_list ap) {
-  if (use_color) fprintf(stderr, "%s", color);
-  vfprintf(stderr, fmt, ap);
-  if (use_color) fprintf(stderr, "%s", foreground_reset);
+void parse_options(int argc, char **argv) {
+  while (1) {
+    static struct option long_options[] =
+      {
+       {"help", no_argument, 0, 'h'},
+       {"jobs", required_argument, 0, 'j'},
+       {"color", no_argument, 0, 'r'},
+       {"index", no_argument, 0, 'x'},
+       {"follow", no_argument, 0, 'F'},
+       {"recursive", no_argument, 0, 'R'},
+       {"buffer-size", required_argument, 0, 'K'},
+       {"format", required_argument, 0, 'O'},
+       {"map", optional_argument, 0, 'B'},
+       {"only", required_argument, 0, 'Y'},
+       {"snapshot", required_argument, 0, 'S'},
+       {"no-decompress", no_argument, 0, 'Z'},
+       {"no-mmap", no_argument, 0, 'M'},
+       {"no-uring", no_argument, 0, 'U'},
+       {"stats-timing", no_argument, 0, 'T'},
+       {}
+      };
+    int option_index = 0;
+    int c = getopt_long(argc, argv, "FRhj:rx", long_options, &option_index);
+    if (c == -1) break;
+    switch (c) {
+    case 'F':
+      follow = 1;
+      break;
+    case 'R':
+      recursive = 1;
+      break;
+    case 'h':
+      fprintf(stderr, "%s", help_text);
+      exit(0);
+    case 'j':
+      jobs = str2long(optarg);
+      if (jobs < 1)
+        exit_printf("jobs must be at least 1\n");
+      break;
+    case 'r':
+      use_color = 1;
+      break;
+    case 'x':
+      use_index = 1;
+      break;
+    case 'K': {
+      long len = str2long(optarg);
+      if (len < 4096 || len > 1 << 30)
+        exit_printf("buffer size must be from 4096 bytes to 1G\n");
+      reader_buffer_len = len;
+      break;
+    }
+    case 'O':
+      if (!strcmp(optarg, "json"))
+        format = FORMAT_JSON;
+      else if (!strcmp(optarg, "tsv"))
+        format = FORMAT_TSV;
+      else if (!strcmp(optarg, "binary"))
+        format = FORMAT_BINARY;
+      else if (!strcmp(optarg, "text"))
+        format = FORMAT_TEXT;
+      else
+        exit_printf("unknown format \"%s\"\n", optarg);
+      break;
+    case 'B':
+      map_block_len = optarg ? str2long(optarg) : 1 << 16;
+      if (map_block_len < 1)
+        exit_printf("map block length must be at least 1\n");
+      break;
+    case 'Y':
+      if (!strcmp(optarg, "lines"))
+        subset = STATS_LINES_ONLY;
+      else if (!strcmp(optarg, "utf8"))
+        subset = STATS_UTF8_ONLY;
+      else
+        exit_printf("unknown counts \"%s\"\n", optarg);
+      break;
+    case 'S': {
+      long seconds = str2long(optarg);
+      if (seconds < 1)
+        exit_printf("snapshot interval must be at least 1 second\n");
+      snapshot_ns = seconds * 1000000000ULL;
+      break;
+    }
+    case 'Z':
+      use_decompress = 0;
+      break;
+    case 'M':
+      use_mmap = 0;
+      break;
+    case 'U':
+      use_uring = 0;
+      break;
+    case 'T':
+      timing_enabled = 1;
+      break;
+    }
+  }
 }
 
-void err_vprintf(char *fmt, va_list ap) {
-  color_vprintf(foreground_red, fmt, ap);
-}
+// all the files, in order
+struct stats_ctx total;
+// -R with -j, which splits big files by itself
+int parallel = 0;
 
-void info_vprintf(char *fmt, va_list ap) {
-  color_vprintf(foreground_green, fmt, ap);
-}
+struct chunk {
+  pthread_t thread;
+  char *p;
+  size_t len;
+  struct stats_ctx ctx;
+};
 
-void warn_vprintf(char *fmt, va_list ap) {
-  color_vprintf(foreground_yellow, fmt, ap);
+void *consume_chunk(void *arg) {
+  struct chunk *c = arg;
+  stats_init(&c->ctx);
+  c->ctx.subset = subset;
+  stats_feed(&c->ctx, c->p, c->len);
+  stats_finish(&c->ctx);
+  return 0;
 }
 
-void err_printf(char *fmt, ...) {
-  va_list ap;
-  va_start(ap, fmt);
-  err_vprintf(fmt, ap);
-  va_end(ap);
+// Counts p[0..len) into c, which was counted from a clean state.
+void consume_parallel(struct stats_ctx *c, char *p, size_t len) {
+  size_t n = len / min_chunk_len;
+  if (n > (size_t)jobs) n = jobs;
+  if (n < 2) {
+    stats_feed(c, p, len);
+    return;
+  }
+  struct chunk *chunks = allocate(n * sizeof(struct chunk));
+  size_t start = 0;
+  for (size_t i = 0; i < n; i++) {
+    size_t end = i + 1 < n ?
+      stats_chunk_start(p, len, len / n * (i + 1)) : len;
+    chunks[i].p = p + start;
+    chunks[i].len = end - start;
+    start = end;
+  }
+  for (size_t i = 1; i < n; i++) {
+    errno = pthread_create(&chunks[i].thread, 0, consume_chunk, &chunks[i]);
+    if (errno)
+      errno_printf("cannot create thread");
+  }
+  consume_chunk(&chunks[0]);
+  for (size_t i = 1; i < n; i++)
+    pthread_join(chunks[i].thread, 0);
+  for (size_t i = 0; i < n; i++)
+    stats_merge(c, &chunks[i].ctx);
+  free(chunks);
 }
 
-void info_printf(char *fmt, ...) {
-  va_list ap;
-  va_start(ap, fmt);
-  info_vprintf(fmt, ap);
-  va_end(ap);
+// What a file is counted with: the reader it comes from, its decoder if it
+// is compressed and the index being made of it, if any.  There is one for
+// the files in order, or with -R and -j one for each thread.
+struct counter {
+  struct reader *reader;
+  struct tuidx_builder *index_builder;
+  struct decoder decoder;
+  int decoding;
+  uint64_t taken_len;        // how much of the file, for -F to go on from
+  char *failed;              // what could not be done, errno telling why
+};
+
+// Decodes the stream that starts with p[0..len) if it is compressed.
+int start_decoding(struct counter *w, char *p, size_t len,
+                   decode_source *source) {
+  if (!use_decompress) return 0;
+  w->decoding = decoder_start(&w->decoder, p, len, source, w->reader);
+  if (w->decoding == -1)
+    w->failed = "cannot decompress";
+  return w->decoding;
 }
 
-void warn_printf(char *fmt, ...) {
-  va_list ap;
-  va_start(ap, fmt);
-  warn_vprintf(fmt, ap);
-  va_end(ap);
+// The map of the file at hand.  Only the counts at the start of the block
+// and the run of blocks so far are kept, and a run is written once a block
+// of another class ends it.
+struct block_map {
+  char *name;
+  uint64_t pos;              // bytes fed
+  uint64_t block_start;
+  struct stats block_stats;  // counts at block_start
+  uint64_t run_start;
+  enum stats_class run_class;
+} block_map;
+
+void map_begin(struct stats_ctx *c, char *name) {
+  block_map.name = name;
+  block_map.pos = block_map.block_start = block_map.run_start = 0;
+  block_map.block_stats = c->stats;
 }
 
-void errno_printf(char *fmt, ...) {
-  va_list ap;
-  va_start(ap, fmt);
-  err_vprintf(fmt, ap);
-  va_end(ap);
-  err_printf(": %s (%d)\n", strerror(errno), errno);
-  exit(errno);
+void map_run_end(void) {
+  struct block_map *m = &block_map;
+  if (m->block_start == m->run_start) return;
+  printf("%s\t%" PRIu64 "\t%" PRIu64 "\t%s\n", m->name, m->run_start,
+         m->block_start, stats_class_names[m->run_class]);
 }
 
-void exit_printf(char *fmt, ...) {
-  va_list ap;
-  va_start(ap, fmt);
-  err_vprintf(fmt, ap);
-  va_end(ap);
-  exit(1);
+void map_block_end(struct stats_ctx *c) {
+  struct block_map *m = &block_map;
+  enum stats_class cls = stats_class(&c->stats, &m->block_stats);
+  if (m->block_start != m->run_start && cls != m->run_class) {
+    map_run_end();
+    m->run_start = m->block_start;
+  }
+  m->run_class = cls;
+  m->block_start = m->pos;
+  m->block_stats = c->stats;
 }
 
-long str2long(char *str) {
-  char *end;
-  long res = strtol(str, &end, 10);
-  if (!*str || *end)
-    exit_printf("cannot convert \"%s\" to long\n", str);
-  return res;
+// Feeds p[0..len) a block at a time, classing each block as it ends.  A
+// utf8 sequence cut by the end of a block goes with the next one.
+void map_feed(struct stats_ctx *c, char *p, size_t len) {
+  struct block_map *m = &block_map;
+  while (len) {
+    uint64_t left = m->block_start + map_block_len - m->pos;
+    size_t n = len < left ? len : left;
+    stats_feed(c, p, n);
+    m->pos += n;
+    p += n;
+    len -= n;
+    if (n == left)
+      map_block_end(c);
+  }
 }
 
-int file4read(char *name) {
-  int fd = open(name, O_RDONLY);
-  if (fd == -1)
-    errno_printf("cannot open file \"%s\"", name);
-  return fd;
+void map_finish(struct stats_ctx *c) {
+  if (block_map.pos != block_map.block_start)
+    map_block_end(c);
+  map_run_end();
 }
 
-void *allocate(int size) {
-  char *res = malloc(size);
-  if (!res)
-    exit_printf("cannot allocate %d bytes\n", size);
-  return res;
+void feed(struct stats_ctx *c, char *p, size_t len) {
+  uint64_t start = timing_start();
+  if (map_block_len)
+    map_feed(c, p, len);
+  else
+    stats_feed(c, p, len);
+  timing_end(TIMING_SCAN, start, len);
 }
 
-void parse_options(int argc, char **argv) {
+int run_decoded(struct counter *w, struct stats_ctx *c) {
+  ssize_t len;
   while (1) {
-    static struct option long_options[] =
-      {
-       {"help", no_argument, 0, 'h'},
-       {"color", no_argument, 0, 'r'},
-       {}
-      };
-    int option_index = 0;
-    int c = getopt_long(argc, argv, "hr", long_options, &option_index);
-    if (c == -1) break;
-    switch (c) {
-    case 'h':
-      fprintf(stderr, "%s", help_text);
-      exit(0);
-    case 'r':
-      use_color = 1;
-      break;
+    char *p;
+    uint64_t start = timing_start();
+    len = decoder_read(&w->decoder, &p, SIZE_MAX);
+    timing_end(TIMING_READ, start, len > 0 ? len : 0);
+    if (len <= 0) break;
+    feed(c, p, len);
+  }
+  int error = errno;
+  decoder_stop(&w->decoder);
+  if (len == -1) {
+    w->failed = "cannot decompress";
+    errno = error;
+  }
+  return len;
+}
+
+// A compressed file is counted while its decoder thread decodes it, and
+// is never indexed.  Returns -1 with errno set if the file cannot be read
+// or decoded.
+int run_fd(struct counter *w, struct stats_ctx *c, int fd) {
+  w->decoding = 0;
+  w->taken_len = 0;
+  size_t map_len;
+  char *map = use_mmap ? input_map(fd, &map_len) : 0;
+  int res = 0;
+  if (map && (res = start_decoding(w, map, map_len, 0))) {
+    if (res == 1)
+      res = run_decoded(w, c);
+    input_unmap(map, map_len);
+  } else if (map) {
+    if (jobs > 1 && !map_block_len && !parallel) {
+      uint64_t start = timing_start();
+      consume_parallel(c, map, map_len);
+      timing_end(TIMING_SCAN, start, map_len);
+    } else
+      feed(c, map, map_len);
+    w->taken_len = map_len;
+    if (w->index_builder)
+      tuidx_feed(w->index_builder, map, map_len);
+    input_unmap(map, map_len);
+  } else {
+    int first = 1;
+    while (1) {
+      char *p;
+      uint64_t start = timing_start();
+      ssize_t len = reader_read(w->reader, &p, SIZE_MAX);
+      timing_end(TIMING_READ, start, len > 0 ? len : 0);
+      if (len == -1) {
+        w->failed = "cannot read";
+        res = -1;
+      }
+      if (len <= 0) break;
+      if (first && (res = start_decoding(w, p, len, decode_from_reader))) {
+        if (res == 1)
+          res = run_decoded(w, c);
+        break;
+      }
+      first = 0;
+      if (w->index_builder)
+        tuidx_feed(w->index_builder, p, len);
+      feed(c, p, len);
+      w->taken_len += len;
     }
   }
+  if (res == -1) return -1;
+  // -F goes on in run_file()
+  if (follow && !w->decoding) return 0;
+  stats_finish(c);
+  if (map_block_len)
+    map_finish(c);
+  return 0;
+}
+
+#define STATS_COUNTS 14
+
+// The counts as kept in an index, in a fixed order, and after them the
+// state of the last byte.
+void stats_counts(struct stats *s, uint64_t **c) {
+  c[0] = &s->byte_count;
+  c[1] = &s->utf8_missing_continuation_count;
+  c[2] = &s->utf8_orphan_continuation_count;
+  c[3] = &s->utf8_overlong_count;
+  c[4] = &s->utf8_upper_control_count;
+  c[5] = &s->utf8_illegal_count;
+  c[6] = &s->line_count;
+  c[7] = &s->windows_line_count;
+  c[8] = &s->trailing_whitespace_count;
+  c[9] = &s->null_char_count;
+  c[10] = &s->control_count;
+  c[11] = &s->upper_control_count;
+  c[12] = &s->upper_printable_count;
+  c[13] = &s->latin1_finnish_count;
+}
+
+void save_counts(struct stats *s, uint64_t *counts) {
+  uint64_t *c[STATS_COUNTS];
+  stats_counts(s, c);
+  for (int i = 0; i < STATS_COUNTS; i++)
+    counts[i] = *c[i];
+  counts[STATS_COUNTS] = s->last_byte_nl | s->last_byte_cr << 1 |
+    s->last_byte_whitespace << 2;
+}
+
+void load_counts(struct stats *s, uint64_t *counts) {
+  uint64_t *c[STATS_COUNTS];
+  stats_counts(s, c);
+  for (int i = 0; i < STATS_COUNTS; i++)
+    *c[i] = counts[i];
+  s->last_byte_nl = counts[STATS_COUNTS] & 1;
+  s->last_byte_cr = counts[STATS_COUNTS] >> 1 & 1;
+  s->last_byte_whitespace = counts[STATS_COUNTS] >> 2 & 1;
+}
+
+// A file is counted from a clean state, then merged into the total.  With
+// an index, the index keeps the counts and the lead flags, and one that
+// can be trusted stands for the pass.  A map needs the pass all the same,
+// a file being followed is not done when the pass is, and a subset of the
+// counts cannot make an index.  Returns -1 with errno set like run_fd().
+int count_file(struct counter *w, struct stats_ctx *c, char *name, int fd) {
+  struct tuidx x;
+  struct tuidx_builder builder;
+  stats_init(c);
+  c->subset = subset;
+  if (map_block_len)
+    map_begin(c, name);
+  if (!use_index || !fd || map_block_len || follow || subset)
+    return run_fd(w, c, fd);
+  if (!tuidx_load(&x, name, fd)) {
+    load_counts(&c->stats, x.h.counts);
+    c->lead = x.h.flags;
+    tuidx_free(&x);
+    return 0;
+  }
+  if (tuidx_begin(&builder, fd)) {
+    warn_printf("cannot index \"%s\": %s\n", name, strerror(errno));
+    return run_fd(w, c, fd);
+  }
+  w->index_builder = &builder;
+  int res = run_fd(w, c, fd);
+  w->index_builder = 0;
+  if (res || w->decoding) {
+    tuidx_discard(&builder);
+    w->decoding = 0;
+    return res;
+  }
+  save_counts(&c->stats, builder.x.h.counts);
+  builder.x.h.flags = c->lead;
+  if (tuidx_write(&builder, name, fd))
+    warn_printf("cannot write index of \"%s\": %s\n", name, strerror(errno));
+  return 0;
 }
 
-char buffer[65536];
-int buffer_pos = 0;
-int buffer_len = 65536;
+#define RECORD_FIELDS (STATS_COUNTS + 3)
 
-int ulen = 1;
-int umin;
-int umax;
-int u;
+// names of the stats_counts() in order, then the rest of a record
+char *field_names[RECORD_FIELDS] = {
+  "bytes",
+  "utf8_missing_continuations",
+  "utf8_orphan_continuations",
+  "utf8_overlongs",
+  "utf8_upper_controls",
+  "utf8_illegals",
+  "lines",
+  "windows_line_endings",
+  "trailing_whitespaces",
+  "null_chars",
+  "control_chars",
+  "upper_control_chars",
+  "upper_printables",
+  "finnish_letters",
+  "no_final_newline",
+  "elapsed_ns",
+  "bytes_per_sec",
+};
 
-int byte_count = 0;
+// Lines count like in the text output, the last one even if unterminated.
+void record_values(struct stats *s, uint64_t elapsed, uint64_t *v) {
+  struct stats t = *s;
+  int no_final_newline = t.byte_count && !t.last_byte_nl;
+  t.line_count += no_final_newline;
+  uint64_t *c[STATS_COUNTS];
+  stats_counts(&t, c);
+  for (int i = 0; i < STATS_COUNTS; i++)
+    v[i] = *c[i];
+  v[STATS_COUNTS] = no_final_newline;
+  v[STATS_COUNTS + 1] = elapsed;
+  v[STATS_COUNTS + 2] = elapsed ? t.byte_count * 1e9 / elapsed : 0;
+}
+
+// Valid utf8 goes through, other bytes as \u00XX.
+void json_string(char *str) {
+  size_t len = strlen(str);
+  putchar('"');
+  while (len) {
+    enum utf8_class cls;
+    int bad_len;
+    size_t n = utf8_find_bad(str, len, 1, &cls, &bad_len);
+    for (size_t i = 0; i < n; i++) {
+      unsigned char ch = str[i];
+      if (ch == '"' || ch == '\\')
+        printf("\\%c", ch);
+      else if (ch < ' ')
+        printf("\\u%04x", ch);
+      else
+        putchar(ch);
+    }
+    for (int i = 0; i < bad_len && n < len; i++)
+      printf("\\u%04x", (unsigned char)str[n + i]);
+    if (n == len) break;
+    str += n + bad_len;
+    len -= n + bad_len;
+  }
+  putchar('"');
+}
+
+void tsv_string(char *str) {
+  for (; *str; str++) {
+    if (*str == '\t')
+      fputs("\\t", stdout);
+    else if (*str == '\n')
+      fputs("\\n", stdout);
+    else if (*str == '\\')
+      fputs("\\\\", stdout);
+    else
+      putchar(*str);
+  }
+}
+
+void write_header(void) {
+  if (format == FORMAT_TSV) {
+    printf("file");
+    for (int i = 0; i < RECORD_FIELDS; i++)
+      printf("\t%s", field_names[i]);
+    putchar('\n');
+  } else if (format == FORMAT_BINARY) {
+    // magic, byte order mark, field count, NUL terminated field names
+    uint32_t h[2] = {0x01020304, RECORD_FIELDS};
+    fwrite("tstats\0\1", 1, 8, stdout);
+    fwrite(h, sizeof(h), 1, stdout);
+    for (int i = 0; i < RECORD_FIELDS; i++)
+      fwrite(field_names[i], 1, strlen(field_names[i]) + 1, stdout);
+  }
+}
 
-int utf8_missing_continuation_count = 0;
-int utf8_orphan_continuation_count = 0;
-int utf8_overlong_count = 0;
-int utf8_upper_control_count = 0;
-int utf8_illegal_count = 0;
+// One file, or the total if name is NULL.  A binary record is the length
+// of the name, all ones for the total, the name, and the values.
+void write_record(char *name, struct stats *s, uint64_t elapsed) {
+  uint64_t v[RECORD_FIELDS];
+  record_values(s, elapsed, v);
+  switch (format) {
+  case FORMAT_TEXT:
+    break;
+  case FORMAT_JSON:
+    printf("{\"file\":");
+    if (name)
+      json_string(name);
+    else
+      printf("null");
+    for (int i = 0; i < RECORD_FIELDS; i++)
+      printf(",\"%s\":%" PRIu64, field_names[i], v[i]);
+    printf("}\n");
+    break;
+  case FORMAT_TSV:
+    if (name)
+      tsv_string(name);
+    for (int i = 0; i < RECORD_FIELDS; i++)
+      printf("\t%" PRIu64, v[i]);
+    putchar('\n');
+    break;
+  case FORMAT_BINARY: {
+    uint32_t len = name ? strlen(name) : UINT32_MAX;
+    fwrite(&len, sizeof(len), 1, stdout);
+    if (name)
+      fwrite(name, 1, len, stdout);
+    fwrite(v, sizeof(uint64_t), RECORD_FIELDS, stdout);
+    break;
+  }
+  }
+}
 
-int last_byte_nl = 0;
-int last_byte_cr = 0;
-int last_byte_whitespace = 0;
+// The text report, to stderr.  An unfinished last line counts.
+void report(struct stats *counts) {
+  struct stats copy = *counts;
+  struct stats *s = &copy;
+  if (s->byte_count && !s->last_byte_nl)
+    s->line_count++;
+  if (subset != STATS_UTF8_ONLY)
+    info_printf("%" PRIu64 " lines\n", s->line_count);
+  if (s->windows_line_count)
+    warn_printf("%" PRIu64 " windows line endings\n",
+                s->windows_line_count);
+  if (s->byte_count && !s->last_byte_nl)
+    warn_printf("non-empty file does not end in newline\n");
+  if (s->null_char_count)
+    err_printf("%" PRIu64 " null characters\n", s->null_char_count);
+  if (s->control_count)
+    err_printf("%" PRIu64 " control characters\n", s->control_count);
+  if (s->upper_control_count)
+    warn_printf("%" PRIu64 " upper control characters\n",
+                s->upper_control_count);
+  if (s->trailing_whitespace_count)
+    warn_printf("%" PRIu64 " trailing whitespaces\n",
+                s->trailing_whitespace_count);
 
-int line_count = 0;
-int windows_line_count = 0;
-int trailing_whitespace_count = 0;
-int null_char_count = 0;
-int control_count = 0;
-int upper_control_count = 0;
-int upper_printable_count = 0;
-int latin1_finnish_count = 0;
+  if (s->utf8_missing_continuation_count)
+    err_printf("%" PRIu64 " missing utf8 continuation bytes\n",
+               s->utf8_missing_continuation_count);
+  if (s->utf8_orphan_continuation_count)
+    err_printf("%" PRIu64 " orphan utf8 continuation bytes\n",
+               s->utf8_orphan_continuation_count);
+  if (s->utf8_overlong_count)
+    err_printf("%" PRIu64 " overlong utf8 encodings\n",
+               s->utf8_overlong_count);
+  if (s->utf8_upper_control_count)
+    err_printf("%" PRIu64 " utf8 upper control characters\n",
+               s->utf8_upper_control_count);
+  if (s->utf8_illegal_count)
+    err_printf("%" PRIu64 " illegal utf8 encodings\n",
+               s->utf8_illegal_count);
+  if (s->upper_printable_count) {
+    char *fmt =
+      "%" PRIu64 "/%" PRIu64 " finnish letters out of upper printables\n";
+    if (100 * s->latin1_finnish_count / s->upper_printable_count > 80)
+      info_printf(fmt, s->latin1_finnish_count, s->upper_printable_count);
+    else
+      warn_printf(fmt, s->latin1_finnish_count, s->upper_printable_count);
+  }
+}
 
-void consume(int end) {
-  for (int i = 0; i < buffer_pos; i++) {
-    byte_count++;
+// The counts so far of a file being followed, as if it ended here.
+void snapshot(struct stats_ctx *c, char *name, uint64_t start) {
+  struct stats_ctx end = *c;
+  stats_finish(&end);
+  if (format == FORMAT_TEXT) {
+    report(&end.stats);
+  } else {
+    write_record(name, &end.stats, timing_now() - start);
+    fflush(stdout);
+  }
+}
 
-    int ch = (int)buffer[i] & 255;
+#define FOLLOW_READ_LEN (1 << 17)
 
-    if (ulen > 1 && ((ch & 0xc0) != 0x80)) {
-      utf8_missing_continuation_count++;
+// Counts on what is appended to the file, with the state the bytes so far
+// left, and writes a snapshot each time it has grown, or every snapshot_ns.
+// Returns only if the file cannot grow.
+void follow_fd(struct counter *w, struct stats_ctx *c, char *name, int fd,
+               uint64_t start) {
+  struct follow f;
+  int res = follow_start(&f, fd, w->taken_len);
+  if (res == -1)
+    errno_printf("cannot follow \"%s\"", name);
+  if (!res) return;
+  char *buffer = allocate(FOLLOW_READ_LEN);
+  int fresh = 1;             // counted since the last snapshot
+  uint64_t next = timing_now() + snapshot_ns;
+  while (1) {
+    uint64_t read_start = timing_start();
+    ssize_t len = follow_read(&f, buffer, FOLLOW_READ_LEN);
+    timing_end(TIMING_READ, read_start, len > 0 ? len : 0);
+    if (len == -1)
+      errno_printf("cannot read \"%s\"", name);
+    if (len) {
+      feed(c, buffer, len);
+      fresh = 1;
     }
-    if (!(ch & 0x80)) { // leading 1
-      ulen = 1;
-    } else if (!(ch & 0x40)) { // continuation
-      if (ulen < 2) {
-        utf8_orphan_continuation_count++;
-      } else {
-        u <<= 6;
-        u |= ch & 0x3f;
-        ulen--;
-        if (ulen == 1) {
-          if (u < umin)
-            utf8_overlong_count++;
-          if (u >= 0x80 && u < 0xa0)
-            utf8_upper_control_count++;
-        }
-      }
-    } else if (!(ch & 0x20)) { // leading 2
-      u = ch & 0x1f;
-      ulen = 2;
-      umin = 0x80;
-      umax = 0x7ff;
-    } else if (!(ch & 0x10)) { // leading 3
-      u = ch & 0xf;
-      ulen = 3;
-      umin = 0x800;
-      umax = 0xffff;
-    } else if (ch < 0xf5) { // leading 4
-      u = ch & 0x7;
-      ulen = 4;
-      umin = 0x10000;
-      umax = 0x10ffff;
-    } else { // illegal 0xf5-0xff
-      utf8_illegal_count++;
-      ulen = 1;
+    uint64_t now = timing_now();
+    if (snapshot_ns ? now >= next : !len && fresh) {
+      snapshot(c, name, start);
+      fresh = 0;
+      next = now + snapshot_ns;
     }
+    if (len) continue;
+    int wait_ms = !snapshot_ns ? -1 :
+      next > now ? (int)((next - now + 999999) / 1000000) : 0;
+    if (follow_wait(&f, wait_ms) == -1)
+      errno_printf("cannot follow \"%s\"", name);
+  }
+}
+
+// Counts a file on its own and writes its record.  Returns -1 with errno
+// set like run_fd().
+int run_file(struct counter *w, char *name, int fd) {
+  struct stats_ctx c;
+  uint64_t start = timing_now();
+  if (count_file(w, &c, name, fd)) return -1;
+  if (follow && !w->decoding) {
+    follow_fd(w, &c, name, fd, start);
+    stats_finish(&c);
+  }
+  if (format != FORMAT_TEXT)
+    write_record(name, &c.stats, timing_now() - start);
+  stats_merge(&total, &c);
+  return 0;
+}
 
-    last_byte_nl = ch == '\n';
+// some file or directory that -R found could not be read
+int read_failed = 0;
 
-    if (ch == '\n') {
-      if (last_byte_cr)
-        windows_line_count++;
-      if (last_byte_whitespace)
-        trailing_whitespace_count++;
-      line_count++;
-    }
+// A file that -R found may be gone or unreadable by now.  It is left out
+// and the others go on; only one named on the command line ends the run.
+void file_failed(char *name, int named, char *what) {
+  if (named)
+    errno_printf("%s \"%s\"", what, name);
+  warn_printf("%s \"%s\": %s\n", what, name, strerror(errno));
+  read_failed = 1;
+}
 
-    last_byte_cr = ch == '\r';
-    if (ch != '\r')
-      last_byte_whitespace = ch == '\t' || ch == ' ';
+// -R with -j counts that many files at once.  The threads take the files
+// of the list, which comes biggest first, in batches that a reader of their
+// own reads ahead: a batch is one big file, or small ones up to BATCH_LEN
+// bytes and BATCH_FILES files in all.  A big file that can be mapped is
+// split into chunks of at least min_chunk_len, up to jobs of them, which
+// threads take like files.  The counts of the files wait in a ring of slots
+// to be written and added to the total in the order of the list, and a
+// file waits for its slot until the file there before it is done.
+#define BATCH_FILES 64
+#define BATCH_LEN (1 << 20)
+#define SLOTS_PER_THREAD (2 * BATCH_FILES)
 
-    if (!ch) {
-      null_char_count++;
-    }
+struct item {
+  int file;
+  int chunk;
+  int chunks;
+};
+
+struct slot {
+  int file;                  // -1 before the first
+  int turn;                  // the file that takes the slot next
+  int left;                  // chunks still being counted
+  char *failed;              // like in a counter
+  int error;
+  uint64_t start;
+  uint64_t end;
+  struct stats_ctx ctx;
+  struct stats_ctx *chunks;  // of a file split into more than one
+  int chunk_count;
+};
 
-    if (ch > 0 && ch < ' ' && ch != '\r' && ch != '\n' && ch != '\t')
-      control_count++;
+struct walk_file *queue;
+int queue_count;
+struct item *items;
+size_t item_count;
+size_t next_item = 0;
+struct slot *slots;
+int slot_count;
+int next_report = 0;
 
-    if (ch >= 0x80 && ch < 0xa0)
-      upper_control_count++;
+pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t slot_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t slot_free = PTHREAD_COND_INITIALIZER;
 
-    if (ch >= 0xa0 && ch < 0x100)
-      upper_printable_count++;
+// Waits until it is the turn of the file of the item in its slot, and sets
+// the slot up for the first chunk of the file that comes.
+struct slot *take_slot(struct item *it) {
+  struct slot *s = slots + it->file % slot_count;
+  pthread_mutex_lock(&slot_lock);
+  while (s->turn != it->file)
+    pthread_cond_wait(&slot_free, &slot_lock);
+  if (s->file != it->file) {
+    s->file = it->file;
+    s->left = s->chunk_count = it->chunks;
+    s->failed = 0;
+    s->start = timing_now();
+    stats_init(&s->ctx);
+    s->ctx.subset = subset;
+    s->chunks = it->chunks > 1 ?
+      allocate(it->chunks * sizeof(struct stats_ctx)) : 0;
+  }
+  pthread_mutex_unlock(&slot_lock);
+  return s;
+}
+
+void report_slot(struct slot *s) {
+  struct walk_file *f = queue + s->file;
+  if (s->failed) {
+    errno = s->error;
+    file_failed(f->name, f->named, s->failed);
+  } else {
+    for (int i = 0; i < s->chunk_count && s->chunks; i++)
+      stats_merge(&s->ctx, s->chunks + i);
+    if (format != FORMAT_TEXT)
+      write_record(f->name, &s->ctx.stats, s->end - s->start);
+    stats_merge(&total, &s->ctx);
+  }
+  free(s->chunks);
+  s->chunks = 0;
+}
+
+// Ends a chunk of the file in the slot, failed if failed is set, and once
+// the files are done up to some, reports those.
+void finish_item(struct slot *s, char *failed, int error) {
+  pthread_mutex_lock(&slot_lock);
+  if (failed && !s->failed) {
+    s->failed = failed;
+    s->error = error;
+  }
+  if (!--s->left)
+    s->end = timing_now();
+  while (next_report < queue_count) {
+    struct slot *next = slots + next_report % slot_count;
+    if (next->file != next_report || next->left) break;
+    report_slot(next);
+    next->turn = next_report + slot_count;
+    next_report++;
+    pthread_cond_broadcast(&slot_free);
+  }
+  pthread_mutex_unlock(&slot_lock);
+}
+
+// A chunk of a big file, which the thread maps the file for.  The chunks
+// start where stats_chunk_start() moves the even split of the size the walk
+// found to, and the last goes to the end of the file as it is now.  A file
+// that turns out to be compressed, or cannot be mapped after all, is
+// counted whole with the first chunk.
+void count_chunk(struct counter *w, struct item *it) {
+  struct walk_file *f = queue + it->file;
+  struct slot *s = take_slot(it);
+  struct stats_ctx *c = s->chunks + it->chunk;
+  stats_init(c);
+  c->subset = subset;
+  if (reader_init(w->reader, &f->name, 1, use_mmap, !use_uring))
+    errno_printf("cannot start reading");
+  char *failed = 0;
+  int fd = reader_next(w->reader);
+  size_t len;
+  char *map = fd == -1 ? 0 : input_map(fd, &len);
+  if (fd == -1) {
+    failed = "cannot open file";
+  } else if (!map || (use_decompress && decode_detect(map, len))) {
+    if (map)
+      input_unmap(map, len);
+    if (!it->chunk && count_file(w, c, f->name, fd))
+      failed = w->failed;
+  } else {
+    uint64_t step = f->size / it->chunks;
+    uint64_t from = step * it->chunk, to = step * (it->chunk + 1);
+    from = it->chunk ? stats_chunk_start(map, len, from < len ? from : len) :
+      0;
+    to = it->chunk + 1 < it->chunks ?
+      stats_chunk_start(map, len, to < len ? to : len) : len;
+    if (to > from)
+      feed(c, map + from, to - from);
+    stats_finish(c);
+    input_unmap(map, len);
+  }
+  int error = errno;
+  reader_free(w->reader);
+  finish_item(s, failed, error);
+}
 
-    if (ch == 0xc4 || ch == 0xc5 || ch == 0xd6 ||
-        ch == 0xe4 || ch == 0xe5 || ch == 0xf6)
-      latin1_finnish_count++;
+// Counts the files of one batch, which starts at first and ends at end.
+void count_batch(struct counter *w, size_t first, size_t end) {
+  char *names[BATCH_FILES];
+  for (size_t i = first; i < end; i++)
+    names[i - first] = queue[items[i].file].name;
+  if (reader_init(w->reader, names, end - first, use_mmap, !use_uring))
+    errno_printf("cannot start reading");
+  for (size_t i = first; i < end; i++) {
+    struct slot *s = take_slot(items + i);
+    char *failed = 0;
+    int fd = reader_next(w->reader);
+    if (fd == -1)
+      failed = "cannot open file";
+    else if (count_file(w, &s->ctx, names[i - first], fd))
+      failed = w->failed;
+    finish_item(s, failed, errno);
   }
-  buffer_pos = 0;
+  reader_free(w->reader);
 }
 
-void run_fd(int fd) {
+void *count_files(void *arg) {
+  struct reader reader;
+  struct counter w;
+  memset(&w, 0, sizeof(w));
+  w.reader = &reader;
   while (1) {
-    int len = read(fd, buffer + buffer_pos, buffer_len - buffer_pos);
-    if (len == -1)
-      errno_printf("cannot read");
-    if (!len) break;
-    buffer_pos += len;
-    consume(0);
+    pthread_mutex_lock(&queue_lock);
+    size_t first = next_item, end = first;
+    uint64_t len = 0;
+    if (end < item_count && items[end].chunks > 1) {
+      end++;
+    } else {
+      while (end < item_count && end - first < BATCH_FILES &&
+             items[end].chunks == 1 &&
+             (end == first || len + queue[items[end].file].size <= BATCH_LEN))
+        len += queue[items[end++].file].size;
+    }
+    next_item = end;
+    pthread_mutex_unlock(&queue_lock);
+    if (first == end) break;
+    if (items[first].chunks > 1)
+      count_chunk(&w, items + first);
+    else
+      count_batch(&w, first, end);
   }
-  if (buffer_pos)
-    consume(1);
+  return 0;
+}
+
+void run_parallel(struct walk *walk) {
+  queue = walk->files;
+  queue_count = walk->count;
+  int *chunks = allocate((queue_count ? queue_count : 1) * sizeof(int));
+  item_count = 0;
+  for (int i = 0; i < queue_count; i++) {
+    uint64_t n = queue[i].size / min_chunk_len;
+    chunks[i] = !use_mmap || use_index || n < 2 ? 1 :
+      n < (uint64_t)jobs ? (int)n : jobs;
+    item_count += chunks[i];
+  }
+  items = allocate((item_count ? item_count : 1) * sizeof(struct item));
+  for (int i = 0, k = 0; i < queue_count; i++) {
+    for (int c = 0; c < chunks[i]; c++, k++) {
+      items[k].file = i;
+      items[k].chunk = c;
+      items[k].chunks = chunks[i];
+    }
+  }
+  free(chunks);
+  slot_count = jobs * SLOTS_PER_THREAD;
+  if (slot_count > queue_count)
+    slot_count = queue_count ? queue_count : 1;
+  slots = allocate(slot_count * sizeof(struct slot));
+  memset(slots, 0, slot_count * sizeof(struct slot));
+  for (int i = 0; i < slot_count; i++) {
+    slots[i].file = -1;
+    slots[i].turn = i;
+  }
+  pthread_t *threads = allocate(jobs * sizeof(pthread_t));
+  for (int i = 1; i < jobs; i++) {
+    errno = pthread_create(threads + i, 0, count_files, 0);
+    if (errno)
+      errno_printf("cannot create thread");
+  }
+  count_files(0);
+  for (int i = 1; i < jobs; i++)
+    pthread_join(threads[i], 0);
+  free(threads);
+  free(items);
+  free(slots);
 }
 
 void run(int index, int argc, char **argv) {
-  if (index == argc) {
-    run_fd(0);
-  } else {
-    while (index < argc) {
-      int fd = file4read(argv[index++]);
-      run_fd(fd);
-      close(fd);
+  char *stdin_name = 0;
+  char **names = index == argc ? &stdin_name : argv + index;
+  int count = index == argc ? 1 : argc - index;
+  char *named = 0;
+  struct walk walk;
+  if (recursive) {
+    char *here = "";
+    // and the index files of -x
+    if (walk_paths(&walk, index == argc ? &here : names, count, jobs,
+                   ".tuidx", parallel))
+      errno_printf("cannot list files");
+    for (size_t i = 0; i < walk.error_count; i++)
+      warn_printf("cannot read directory \"%s\": %s\n", walk.errors[i].name,
+                  strerror(walk.errors[i].error));
+    read_failed = walk.error_count != 0;
+    if (walk.count > INT_MAX)
+      exit_printf("too many files\n");
+    write_header();
+    if (parallel) {
+      run_parallel(&walk);
+      walk_free(&walk);
+      return;
+    }
+    count = walk.count;
+    names = allocate((count ? count : 1) * sizeof(char *));
+    named = allocate(count ? count : 1);
+    for (int i = 0; i < count; i++) {
+      names[i] = walk.files[i].name;
+      named[i] = walk.files[i].named;
     }
+  } else {
+    write_header();
+  }
+  struct reader reader;
+  if (reader_init(&reader, names, count, use_mmap, !use_uring))
+    errno_printf("cannot start reading");
+  struct counter w;
+  memset(&w, 0, sizeof(w));
+  w.reader = &reader;
+  for (int i = 0; i < count; i++) {
+    char *name = names[i] ? names[i] : "-";
+    int fd = reader_next(&reader);
+    if (fd == -1)
+      file_failed(name, !named || named[i], "cannot open file");
+    else if (run_file(&w, name, fd))
+      file_failed(name, !named || named[i], w.failed);
+  }
+  reader_free(&reader);
+  if (recursive) {
+    free(names);
+    free(named);
+    walk_free(&walk);
   }
 }
 
 int main(int argc, char **argv) {
   parse_options(argc, argv);
+  timing_setup();
+  if (map_block_len && format != FORMAT_TEXT)
+    exit_printf("--map and --format cannot be used together\n");
+  if (subset && map_block_len)
+    exit_printf("--map and --only cannot be used together\n");
+  if (follow && map_block_len)
+    exit_printf("--map and -F cannot be used together\n");
+  if (follow && recursive)
+    exit_printf("-F and -R cannot be used together\n");
+  if (follow && argc - optind > 1)
+    exit_printf("-F follows only one file\n");
+  parallel = recursive && jobs > 1 && !map_block_len;
+  stats_init(&total);
+  uint64_t start = timing_now();
   run(optind, argc, argv);
-  if (byte_count && !last_byte_nl)
-    line_count++;
-  info_printf("%d lines\n", line_count);
-  if (windows_line_count)
-    warn_printf("%d windows line endings\n", windows_line_count);
-  if (byte_count && !last_byte_nl)
-    warn_printf("non-empty file does not end in newline\n");
-  if (null_char_count)
-    err_printf("%d null characters\n", null_char_count);
-  if (control_count)
-    err_printf("%d control characters\n", control_count);
-  if (upper_control_count)
-    warn_printf("%d upper control characters\n", upper_control_count);
-  if (trailing_whitespace_count)
-    warn_printf("%d trailing whitespaces\n", trailing_whitespace_count);
-
-  if (utf8_missing_continuation_count)
-    err_printf("%d missing utf8 continuation bytes\n",
-               utf8_missing_continuation_count);
-  if (utf8_orphan_continuation_count)
-    err_printf("%d orphan utf8 continuation bytes\n",
-               utf8_orphan_continuation_count);
-  if (utf8_overlong_count)
-    err_printf("%d overlong utf8 encodings\n", utf8_overlong_count);
-  if (utf8_upper_control_count)
-    err_printf("%d utf8 upper control characters\n", utf8_upper_control_count);
-  if (utf8_illegal_count)
-    err_printf("%d illegal utf8 encodings\n", utf8_illegal_count);
-  if (upper_printable_count) {
-    if (100 * latin1_finnish_count / upper_printable_count > 80)
-      info_printf("%d/%d finnish letters out of upper printables\n",
-                  latin1_finnish_count, upper_printable_count);
-    else
-      warn_printf("%d/%d finnish letters out of upper printables\n",
-                  latin1_finnish_count, upper_printable_count);
+  struct stats *s = &total.stats;
+  if (format != FORMAT_TEXT) {
+    write_record(0, s, timing_now() - start);
+    return read_failed;
   }
-  return 0;
+  report(s);
+  return read_failed;
 }
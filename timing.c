@@ -0,0 +1,106 @@
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "timing.h"
+
+int timing_enabled = 0;
+struct timing_counters timing_totals;
+
+static uint64_t run_start;
+
+static const char *phase_names[TIMING_PHASES] = {
+  "read", "decode", "scan", "write", "carry",
+};
+
+uint64_t timing_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// No stdio here, as the report is also written from a signal handler.
+static char *put_str(char *out, const char *str) {
+  size_t len = strlen(str);
+  memcpy(out, str, len);
+  return out + len;
+}
+
+static char *put_u64(char *out, uint64_t n) {
+  char digits[20];
+  int len = 0;
+  do {
+    digits[len++] = '0' + n % 10;
+    n /= 10;
+  } while (n);
+  while (len)
+    *out++ = digits[--len];
+  return out;
+}
+
+// seconds with six decimals
+static char *put_secs(char *out, uint64_t ns) {
+  out = put_u64(out, ns / 1000000000);
+  *out++ = '.';
+  uint64_t us = ns % 1000000000 / 1000;
+  for (uint64_t d = 100000; d; d /= 10)
+    *out++ = '0' + us / d % 10;
+  return out;
+}
+
+void timing_report(void) {
+  char buffer[1024];
+  char *out = buffer;
+  for (int i = 0; i < TIMING_PHASES; i++) {
+    uint64_t calls = __atomic_load_n(timing_totals.calls + i, __ATOMIC_RELAXED);
+    uint64_t bytes = __atomic_load_n(timing_totals.bytes + i, __ATOMIC_RELAXED);
+    if (!calls) continue;
+    out = put_str(out, "timing: ");
+    out = put_str(out, phase_names[i]);
+    out = put_str(out, " ");
+    out = put_secs(out, __atomic_load_n(timing_totals.ns + i,
+                                        __ATOMIC_RELAXED));
+    out = put_str(out, " s, ");
+    out = put_u64(out, calls);
+    out = put_str(out, " calls, ");
+    out = put_u64(out, bytes);
+    out = put_str(out, " bytes, ");
+    out = put_u64(out, bytes / calls);
+    out = put_str(out, " bytes/call\n");
+  }
+  out = put_str(out, "timing: ");
+  out = put_u64(out, __atomic_load_n(&timing_totals.syscalls,
+                                     __ATOMIC_RELAXED));
+  out = put_str(out, " syscalls, ");
+  out = put_secs(out, timing_now() - run_start);
+  out = put_str(out, " s in all\n");
+  for (char *p = buffer; p < out;) {
+    ssize_t n = write(2, p, out - p);
+    if (n <= 0) break;
+    p += n;
+  }
+}
+
+// errno is kept for the code that the signal cut into, which may be about
+// to report a failed call.
+static void report_signal(int sig) {
+  int saved_errno = errno;
+  timing_report();
+  errno = saved_errno;
+}
+
+void timing_setup(void) {
+  run_start = timing_now();
+  if (!timing_enabled) return;
+  atexit(timing_report);
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = report_signal;
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGUSR1, &sa, 0);
+}
@@ -0,0 +1,53 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Counters of where a tool spends its time, for --stats-timing.  Each
+// phase is timed around whole reads, scans of buffers and writes, never
+// per byte, and while timing_enabled is not set a phase costs one branch.
+// The report goes to stderr at exit and whenever SIGUSR1 comes.
+
+enum timing_phase {TIMING_READ, TIMING_DECODE, TIMING_SCAN, TIMING_WRITE,
+                   TIMING_CARRY, TIMING_PHASES};
+
+struct timing_counters {
+  uint64_t ns[TIMING_PHASES];
+  uint64_t calls[TIMING_PHASES];
+  uint64_t bytes[TIMING_PHASES];
+  uint64_t syscalls;         // reads, writes and io_uring enters
+};
+
+extern int timing_enabled;
+extern struct timing_counters timing_totals;
+
+uint64_t timing_now(void);
+
+// Starts the clock of the whole run and sets up the reports.
+void timing_setup(void);
+
+static inline uint64_t timing_start(void) {
+  return timing_enabled ? timing_now() : 0;
+}
+
+// Adds a call of the phase that started at start and took len bytes.  The
+// counters are shared by the threads of a tool.
+static inline void timing_end(enum timing_phase phase, uint64_t start,
+                              uint64_t len) {
+  if (!timing_enabled) return;
+  __atomic_fetch_add(timing_totals.ns + phase, timing_now() - start,
+                     __ATOMIC_RELAXED);
+  __atomic_fetch_add(timing_totals.calls + phase, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(timing_totals.bytes + phase, len, __ATOMIC_RELAXED);
+}
+
+static inline void timing_syscall(void) {
+  if (timing_enabled)
+    __atomic_fetch_add(&timing_totals.syscalls, 1, __ATOMIC_RELAXED);
+}
+
+// Writes the report; safe in a signal handler.
+void timing_report(void);
+
+#endif
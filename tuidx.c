@@ -0,0 +1,411 @@
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pool.h"
+#include "tuidx.h"
+#include "utf8.h"
+
+static const char magic[8] = "tuidx\0\0\1";
+#define BYTE_ORDER_MARK 0x01020304
+
+#define SAMPLES 16
+#define SAMPLE_LEN 4096
+
+// Reads up to len bytes at offset, fewer only at the end of the file.
+static ssize_t read_at(int fd, void *p, size_t len, uint64_t offset) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = pread(fd, (char *)p + done, len - done, offset + done);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    if (!n) break;
+    done += n;
+  }
+  return done;
+}
+
+static int write_all(int fd, const void *p, size_t len) {
+  while (len) {
+    ssize_t n = write(fd, p, len);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    p = (const char *)p + n;
+    len -= n;
+  }
+  return 0;
+}
+
+static uint64_t hash_bytes(uint64_t h, const unsigned char *p, size_t len) {
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ p[i]) * 0x100000001b3ULL;
+  return h;
+}
+
+// FNV-1a of the size and of samples spread evenly over the file, both ends
+// included, so that checking it costs the same for any file.
+static int sample_hash(int fd, uint64_t size, uint64_t *hash) {
+  unsigned char buf[SAMPLE_LEN];
+  uint64_t h = hash_bytes(0xcbf29ce484222325ULL, (unsigned char *)&size,
+                          sizeof(size));
+  uint64_t step = size > SAMPLE_LEN ? (size - SAMPLE_LEN) / (SAMPLES - 1) : 0;
+  for (int i = 0; i < SAMPLES; i++) {
+    uint64_t offset = i * step;
+    size_t len = size - offset < SAMPLE_LEN ? size - offset : SAMPLE_LEN;
+    ssize_t n = read_at(fd, buf, len, offset);
+    if (n != (ssize_t)len) {
+      if (n != -1) errno = EIO;
+      return -1;
+    }
+    h = hash_bytes(h, buf, len);
+    if (!step) break;
+  }
+  *hash = h;
+  return 0;
+}
+
+static unsigned pair_bit(unsigned char a, unsigned char b) {
+  return ((uint32_t)(a << 8 | b) * 2654435761u) >> 20;
+}
+
+static int has_bit(const unsigned char *set, unsigned bit) {
+  return set[bit >> 3] >> (bit & 7) & 1;
+}
+
+static void set_bit(unsigned char *set, unsigned bit) {
+  set[bit >> 3] |= 1 << (bit & 7);
+}
+
+static char *index_path(const char *name, const char *suffix) {
+  char *path = malloc(strlen(name) + strlen(suffix) + 1);
+  if (path) {
+    strcpy(path, name);
+    strcat(path, suffix);
+  }
+  return path;
+}
+
+int tuidx_load(struct tuidx *x, const char *name, int fd) {
+  struct stat st, ist;
+  memset(x, 0, sizeof(*x));
+  char *path = index_path(name, ".tuidx");
+  if (!path || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+    free(path);
+    return -1;
+  }
+  int ifd = open(path, O_RDONLY);
+  free(path);
+  if (ifd == -1)
+    return -1;
+  struct tuidx_header *h = &x->h;
+  uint64_t blocks = ((uint64_t)st.st_size + TUIDX_BLOCK_LEN - 1) /
+    TUIDX_BLOCK_LEN;
+  if (fstat(ifd, &ist) == -1 ||
+      read_at(ifd, h, sizeof(*h), 0) != sizeof(*h) ||
+      memcmp(h->magic, magic, sizeof(magic)) ||
+      h->byte_order != BYTE_ORDER_MARK ||
+      h->block_len != TUIDX_BLOCK_LEN || h->line_step != TUIDX_LINE_STEP ||
+      h->size != (uint64_t)st.st_size ||
+      h->mtime_sec != st.st_mtim.tv_sec ||
+      h->mtime_nsec != st.st_mtim.tv_nsec ||
+      h->block_count != blocks ||
+      h->offset_count != h->newlines / TUIDX_LINE_STEP + 1 ||
+      (uint64_t)ist.st_size != sizeof(*h) +
+      blocks * sizeof(struct tuidx_block) + h->offset_count * sizeof(uint64_t))
+    goto fail;
+  size_t blocks_len = blocks * sizeof(struct tuidx_block);
+  size_t offsets_len = h->offset_count * sizeof(uint64_t);
+  x->blocks = malloc(blocks_len ? blocks_len : 1);
+  x->offsets = malloc(offsets_len);
+  uint64_t hash;
+  if (!x->blocks || !x->offsets ||
+      read_at(ifd, x->blocks, blocks_len, sizeof(*h)) != (ssize_t)blocks_len ||
+      read_at(ifd, x->offsets, offsets_len, sizeof(*h) + blocks_len) !=
+      (ssize_t)offsets_len ||
+      sample_hash(fd, h->size, &hash) || hash != h->sample_hash)
+    goto fail;
+  close(ifd);
+  return 0;
+
+fail:
+  close(ifd);
+  tuidx_free(x);
+  return -1;
+}
+
+void tuidx_free(struct tuidx *x) {
+  free(x->blocks);
+  free(x->offsets);
+  x->blocks = 0;
+  x->offsets = 0;
+}
+
+int tuidx_may_match(const struct tuidx *x, uint64_t block,
+                    const char *pattern, size_t len) {
+  const unsigned char *p = (const unsigned char *)pattern;
+  uint64_t last = block + (len + TUIDX_BLOCK_LEN - 2) / TUIDX_BLOCK_LEN;
+  if (last >= x->h.block_count)
+    last = x->h.block_count - 1;
+  // a pair is kept with the block of its second byte, like that byte
+  for (size_t i = 0; i < len; i++) {
+    int found = 0;
+    for (uint64_t k = block; k <= last && !found; k++) {
+      const struct tuidx_block *b = x->blocks + k;
+      found = has_bit(b->bytes, p[i]) &&
+        (!i || has_bit(b->pairs, pair_bit(p[i - 1], p[i])));
+    }
+    if (!found) return 0;
+  }
+  return 1;
+}
+
+int64_t tuidx_line_offset(const struct tuidx *x, int fd, uint64_t line) {
+  uint64_t k = line / TUIDX_LINE_STEP;
+  uint64_t offset = 0;
+  if (x) {
+    if (k >= x->h.offset_count)
+      k = x->h.offset_count - 1;
+    offset = x->offsets[k];
+    line -= k * TUIDX_LINE_STEP;
+  }
+  char buf[65536];
+  while (line) {
+    ssize_t len = read_at(fd, buf, sizeof(buf), offset);
+    if (len == -1)
+      return -1;
+    if (!len) break;
+    char *p = buf, *end = buf + len;
+    while (line && (p = memchr(p, '\n', end - p))) {
+      p++;
+      line--;
+    }
+    offset += line ? (uint64_t)len : (uint64_t)(p - buf);
+  }
+  return offset;
+}
+
+static struct tuidx_block *block_at(struct tuidx_builder *b) {
+  uint64_t k = b->pos / TUIDX_BLOCK_LEN;
+  struct tuidx *x = &b->x;
+  if (k < x->h.block_count)
+    return x->blocks + k;
+  if (k == b->block_cap) {
+    uint64_t cap = b->block_cap ? 2 * b->block_cap : 64;
+    struct tuidx_block *blocks = realloc(x->blocks, cap * sizeof(*blocks));
+    if (!blocks) {
+      b->failed = 1;
+      return 0;
+    }
+    x->blocks = blocks;
+    b->block_cap = cap;
+  }
+  struct tuidx_block *block = x->blocks + x->h.block_count++;
+  memset(block, 0, sizeof(*block));
+  block->flags = TUIDX_BLOCK_ASCII | TUIDX_BLOCK_UTF8;
+  return block;
+}
+
+static void add_offset(struct tuidx_builder *b, uint64_t offset) {
+  struct tuidx *x = &b->x;
+  if (x->h.offset_count == b->offset_cap) {
+    uint64_t cap = b->offset_cap ? 2 * b->offset_cap : 64;
+    uint64_t *offsets = realloc(x->offsets, cap * sizeof(uint64_t));
+    if (!offsets) {
+      b->failed = 1;
+      return;
+    }
+    x->offsets = offsets;
+    b->offset_cap = cap;
+  }
+  x->offsets[x->h.offset_count++] = offset;
+}
+
+int tuidx_begin(struct tuidx_builder *b, int fd) {
+  struct stat st;
+  memset(b, 0, sizeof(*b));
+  if (fstat(fd, &st) == -1)
+    return -1;
+  if (!S_ISREG(st.st_mode)) {
+    errno = EINVAL;
+    return -1;
+  }
+  struct tuidx_header *h = &b->x.h;
+  memcpy(h->magic, magic, sizeof(magic));
+  h->byte_order = BYTE_ORDER_MARK;
+  h->block_len = TUIDX_BLOCK_LEN;
+  h->line_step = TUIDX_LINE_STEP;
+  h->size = st.st_size;
+  h->mtime_sec = st.st_mtim.tv_sec;
+  h->mtime_nsec = st.st_mtim.tv_nsec;
+  b->buffer = pool_get(TUIDX_BLOCK_LEN + 4);
+  if (!b->buffer)
+    return -1;
+  add_offset(b, 0);
+  if (b->failed) {
+    pool_put(b->buffer, TUIDX_BLOCK_LEN + 4);
+    errno = ENOMEM;
+    return -1;
+  }
+  return 0;
+}
+
+// Bytes of one block, p[0..len) at stream offset b->pos.  Newlines and
+// NULs are rare enough to be left to memchr().
+static void scan(struct tuidx_builder *b, const unsigned char *p, size_t len) {
+  struct tuidx_block *block = block_at(b);
+  if (!block) return;
+  struct tuidx_header *h = &b->x.h;
+  // All in locals, as the stores to the sets could alias anything else.
+  // Bits are set only if not set yet, or a run of the same byte would make
+  // each store wait for the one before.
+  unsigned char *bytes = block->bytes, *pairs = block->pairs;
+  unsigned char prev = b->prev;
+  unsigned high = 0;
+  size_t i = 0;
+  if (!b->pos && len) {
+    set_bit(bytes, p[0]);
+    high = prev = p[0];
+    i = 1;
+  }
+  for (; i < len; i++) {
+    unsigned char ch = p[i];
+    unsigned bit = pair_bit(prev, ch);
+    if (!has_bit(bytes, ch))
+      set_bit(bytes, ch);
+    if (!has_bit(pairs, bit))
+      set_bit(pairs, bit);
+    high |= ch;
+    prev = ch;
+  }
+  if (high & 0x80)
+    block->flags &= ~TUIDX_BLOCK_ASCII;
+  b->prev = prev;
+  const unsigned char *end = p + len;
+  for (const unsigned char *q = p; (q = memchr(q, '\n', end - q)); q++) {
+    uint64_t next = b->pos + (q - p) + 1;
+    if (next - b->line_start > h->max_line_len)
+      h->max_line_len = next - b->line_start;
+    b->line_start = next;
+    block->newlines++;
+    if (++h->newlines % TUIDX_LINE_STEP == 0)
+      add_offset(b, next);
+  }
+  for (const unsigned char *q = p; (q = memchr(q, 0, end - q)); q++) {
+    h->nul_count++;
+    block->flags |= TUIDX_BLOCK_NUL;
+  }
+}
+
+// Bad sequences are looked for a block at a time, with an incomplete one
+// at the end carried over; the buffer starts at stream offset
+// b->pos - b->buffer_pos.
+static void check_utf8(struct tuidx_builder *b, int final) {
+  uint64_t start = b->pos - b->buffer_pos;
+  size_t i = 0;
+  while (1) {
+    enum utf8_class cls;
+    int bad_len;
+    i += utf8_find_bad(b->buffer + i, b->buffer_pos - i, final, &cls,
+                       &bad_len);
+    if (cls == UTF8_VALID || cls == UTF8_INCOMPLETE) break;
+    uint64_t block = (start + i) / TUIDX_BLOCK_LEN;
+    b->x.blocks[block].flags &= ~TUIDX_BLOCK_UTF8;
+    i += bad_len;
+    // The rest of the block can be skipped but for its last 3 bytes, which
+    // may hold the start of a sequence running into the next one.  Any
+    // byte but a continuation starts a sequence, so the parse is the same
+    // from the first one of those on.
+    uint64_t next = (block + 1) * TUIDX_BLOCK_LEN - 3;
+    if (next > start + i)
+      i = next - start < b->buffer_pos ? next - start : b->buffer_pos;
+  }
+  memmove(b->buffer, b->buffer + i, b->buffer_pos - i);
+  b->buffer_pos -= i;
+}
+
+void tuidx_feed(struct tuidx_builder *b, const char *p, size_t len) {
+  while (len && !b->failed) {
+    size_t n = TUIDX_BLOCK_LEN - b->pos % TUIDX_BLOCK_LEN;
+    if (n > len) n = len;
+    scan(b, (const unsigned char *)p, n);
+    memcpy(b->buffer + b->buffer_pos, p, n);
+    b->buffer_pos += n;
+    b->pos += n;
+    p += n;
+    len -= n;
+    if (b->pos % TUIDX_BLOCK_LEN == 0)
+      check_utf8(b, 0);
+  }
+}
+
+int tuidx_write(struct tuidx_builder *b, const char *name, int fd) {
+  struct tuidx_header *h = &b->x.h;
+  struct stat st;
+  char *path = 0, *tmp = 0;
+  int res = -1;
+  if (b->failed) {
+    errno = ENOMEM;
+    goto done;
+  }
+  if (b->buffer_pos)
+    check_utf8(b, 1);
+  if (b->pos - b->line_start > h->max_line_len)
+    h->max_line_len = b->pos - b->line_start;
+  if (fstat(fd, &st) == -1)
+    goto done;
+  if (b->pos != h->size || h->size != (uint64_t)st.st_size ||
+      h->mtime_sec != st.st_mtim.tv_sec ||
+      h->mtime_nsec != st.st_mtim.tv_nsec) {
+    errno = ESTALE;
+    goto done;
+  }
+  if (sample_hash(fd, h->size, &h->sample_hash))
+    goto done;
+  path = index_path(name, ".tuidx");
+  tmp = index_path(name, ".tuidx.tmp");
+  if (!path || !tmp) {
+    errno = ENOMEM;
+    goto done;
+  }
+  // written aside and renamed, so that a reader never sees half of it
+  int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (out == -1)
+    goto done;
+  int failed =
+    write_all(out, h, sizeof(*h)) ||
+    write_all(out, b->x.blocks, h->block_count * sizeof(struct tuidx_block)) ||
+    write_all(out, b->x.offsets, h->offset_count * sizeof(uint64_t));
+  if (close(out) == -1)
+    failed = 1;
+  if (failed || rename(tmp, path) == -1) {
+    int saved = errno;
+    unlink(tmp);
+    errno = saved;
+    goto done;
+  }
+  res = 0;
+
+done:
+  free(path);
+  free(tmp);
+  pool_put(b->buffer, TUIDX_BLOCK_LEN + 4);
+  b->buffer = 0;
+  tuidx_free(&b->x);
+  return res;
+}
+
+void tuidx_discard(struct tuidx_builder *b) {
+  pool_put(b->buffer, TUIDX_BLOCK_LEN + 4);
+  b->buffer = 0;
+  tuidx_free(&b->x);
+}
@@ -0,0 +1,95 @@
+#ifndef TUIDX_H
+#define TUIDX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Sidecar index of a file, kept next to it as <file>.tuidx.  It describes
+// the file in blocks of TUIDX_BLOCK_LEN bytes and gives the offset of every
+// TUIDX_LINE_STEP-th line.  It is only trusted while the size, the mtime
+// and a hash of samples of the file are still the ones it was made from.
+
+#define TUIDX_BLOCK_LEN 65536
+#define TUIDX_LINE_STEP 1024
+#define TUIDX_PAIR_BITS 4096
+#define TUIDX_COUNTS 16
+
+#define TUIDX_BLOCK_ASCII 1       // bytes below 0x80 only
+#define TUIDX_BLOCK_UTF8 2        // no bad utf8 sequence starts here
+#define TUIDX_BLOCK_NUL 4         // has a NUL byte
+
+struct tuidx_block {
+  uint32_t newlines;
+  uint32_t flags;
+  unsigned char bytes[32];                  // bit set for each byte value
+  unsigned char pairs[TUIDX_PAIR_BITS / 8]; // bloom filter of byte pairs
+};
+
+struct tuidx_header {
+  char magic[8];
+  uint32_t byte_order;
+  uint32_t block_len;
+  uint32_t line_step;
+  uint32_t flags;            // left to the tool, like counts
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t sample_hash;
+  uint64_t block_count;
+  uint64_t offset_count;
+  uint64_t newlines;
+  uint64_t max_line_len;     // with its newline
+  uint64_t nul_count;
+  uint64_t counts[TUIDX_COUNTS]; // left to the tool that writes the index
+};
+
+struct tuidx {
+  struct tuidx_header h;
+  struct tuidx_block *blocks;
+  uint64_t *offsets;         // where line k * line_step starts, from 0
+};
+
+// Loads the index of name, fd being open on the file.  Returns -1 if there
+// is none or it cannot be trusted.
+int tuidx_load(struct tuidx *x, const char *name, int fd);
+
+void tuidx_free(struct tuidx *x);
+
+// Whether a match of the pattern can start in the block.  A match that is
+// not ruled out by the byte and pair sets of all blocks it may touch is
+// assumed possible.
+int tuidx_may_match(const struct tuidx *x, uint64_t block,
+                    const char *pattern, size_t len);
+
+// Offset of the start of line line (from 0), or the size of the file if
+// there are not that many lines; reads the file from the nearest known
+// offset on.  Returns -1 if reading fails.
+int64_t tuidx_line_offset(const struct tuidx *x, int fd, uint64_t line);
+
+// Collects the index of a file while it is read through once, in order.
+struct tuidx_builder {
+  struct tuidx x;
+  uint64_t block_cap;
+  uint64_t offset_cap;
+  char *buffer;              // utf8 carried over, then the current block
+  size_t buffer_pos;
+  uint64_t pos;
+  uint64_t line_start;
+  unsigned char prev;
+  int failed;
+};
+
+// Returns -1 with errno set if fd is not a regular file or if out of memory.
+int tuidx_begin(struct tuidx_builder *b, int fd);
+
+void tuidx_feed(struct tuidx_builder *b, const char *p, size_t len);
+
+// Finishes the index and writes it for name, unless the file has changed
+// in the meantime, and frees the builder.  Returns -1 with errno set if it
+// was not written.
+int tuidx_write(struct tuidx_builder *b, const char *name, int fd);
+
+// Frees the builder without writing anything.
+void tuidx_discard(struct tuidx_builder *b);
+
+#endif
@@ -0,0 +1,275 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "utf8.h"
+
+#if defined(NO_SIMD)
+#elif defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define UTF8_SSSE3
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define UTF8_NEON
+#endif
+
+enum utf8_class utf8_sequence(const char *s, size_t len, int final,
+                              int *seq_len) {
+  const unsigned char *p = (const unsigned char *)s;
+  int ch = p[0];
+  int n, umin, u;
+  *seq_len = 1;
+  if (!(ch & 0x80)) { // leading 1
+    return UTF8_VALID;
+  } else if (!(ch & 0x40)) { // continuation
+    return UTF8_ORPHAN_CONTINUATION;
+  } else if (!(ch & 0x20)) { // leading 2
+    u = ch & 0x1f;
+    n = 2;
+    umin = 0x80;
+  } else if (!(ch & 0x10)) { // leading 3
+    u = ch & 0xf;
+    n = 3;
+    umin = 0x800;
+  } else if (ch < 0xf5) { // leading 4
+    u = ch & 0x7;
+    n = 4;
+    umin = 0x10000;
+  } else { // illegal 0xf5-0xff
+    return UTF8_ILLEGAL;
+  }
+  for (int i = 1; i < n; i++) {
+    if (i >= len) {
+      *seq_len = i;
+      return final ? UTF8_MISSING_CONTINUATION : UTF8_INCOMPLETE;
+    }
+    if ((p[i] & 0xc0) != 0x80) {
+      *seq_len = i;
+      return UTF8_MISSING_CONTINUATION;
+    }
+    u = (u << 6) | (p[i] & 0x3f);
+  }
+  *seq_len = n;
+  if (u < umin)
+    return UTF8_OVERLONG;
+  if (u > 0x10ffff || (u >= 0xd800 && u < 0xe000))
+    return UTF8_ILLEGAL;
+  if (u >= 0x80 && u < 0xa0)
+    return UTF8_UPPER_CONTROL;
+  return UTF8_VALID;
+}
+
+#if defined(UTF8_SSSE3) || defined(UTF8_NEON)
+
+// Lookup algorithm of Keiser and Lemire, "Validating UTF-8 In Less Than One
+// Instruction Per Byte".  Each byte pair is classified by three nibble
+// lookups whose results are and-ed together; the bits name error kinds.
+
+#define TOO_SHORT (1 << 0)      // 11______ 0_______, 11______ 11______
+#define TOO_LONG (1 << 1)       // 0_______ 10______
+#define OVERLONG_3 (1 << 2)     // 11100000 100_____
+#define TOO_LARGE (1 << 3)      // 11110100 1001____, 11110101+ 10______
+#define SURROGATE (1 << 4)      // 11101101 101_____
+#define OVERLONG_2 (1 << 5)     // 1100000_ 10______
+#define TOO_LARGE_1000 (1 << 6) // 11110101+ 1000____
+#define OVERLONG_4 (1 << 6)     // 11110000 1000____
+#define TWO_CONTS (1 << 7)      // 10______ 10______
+#define CARRY (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+static const uint8_t byte_1_high[16] = {
+  TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+  TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+  TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+  TOO_SHORT | OVERLONG_2,
+  TOO_SHORT,
+  TOO_SHORT | OVERLONG_3 | SURROGATE,
+  TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4,
+};
+
+static const uint8_t byte_1_low[16] = {
+  CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+  CARRY | OVERLONG_2,
+  CARRY,
+  CARRY,
+  CARRY | TOO_LARGE,
+  CARRY | TOO_LARGE | TOO_LARGE_1000,
+  CARRY | TOO_LARGE | TOO_LARGE_1000,
+  CARRY | TOO_LARGE | TOO_LARGE_1000,
+  CARRY | TOO_LARGE | TOO_LARGE_1000,
+  CARRY | TOO_LARGE | TOO_LARGE_1000,
+  CARRY | TOO_LARGE | TOO_LARGE_1000,
+  CARRY | TOO_LARGE | TOO_LARGE_1000,
+  CARRY | TOO_LARGE | TOO_LARGE_1000,
+  CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+  CARRY | TOO_LARGE | TOO_LARGE_1000,
+  CARRY | TOO_LARGE | TOO_LARGE_1000,
+};
+
+static const uint8_t byte_2_high[16] = {
+  TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+  TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+  TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+  TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+  TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+  TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+  TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+};
+
+// Last three bytes of a block that still expect continuation bytes.
+static const uint8_t incomplete_max[16] = {
+  255, 255, 255, 255, 255, 255, 255, 255,
+  255, 255, 255, 255, 255, 0xf0 - 1, 0xe0 - 1, 0xc0 - 1,
+};
+
+#if defined(UTF8_SSSE3)
+
+#define TARGET __attribute__((target("ssse3")))
+typedef __m128i vec;
+#define vec_load(p) _mm_loadu_si128((const __m128i *)(p))
+#define vec_splat(c) _mm_set1_epi8((char)(c))
+#define vec_zero() _mm_setzero_si128()
+#define vec_and(a, b) _mm_and_si128(a, b)
+#define vec_or(a, b) _mm_or_si128(a, b)
+#define vec_xor(a, b) _mm_xor_si128(a, b)
+#define vec_eq(a, b) _mm_cmpeq_epi8(a, b)
+#define vec_subs(a, b) _mm_subs_epu8(a, b)
+#define vec_high_nibble(v) _mm_and_si128(_mm_srli_epi16(v, 4), vec_splat(0xf))
+#define vec_lookup(table, idx) _mm_shuffle_epi8(table, idx)
+// bytes of prev and v shifted by n toward the end: prev[16-n..15], v[0..15-n]
+#define vec_prev(v, prev, n) _mm_alignr_epi8(v, prev, 16 - (n))
+#define vec_any(v) (_mm_movemask_epi8(vec_eq(v, vec_zero())) != 0xffff)
+#define vec_any_high(v) (_mm_movemask_epi8(v) != 0)
+
+#elif defined(UTF8_NEON)
+
+#define TARGET
+typedef uint8x16_t vec;
+#define vec_load(p) vld1q_u8((const uint8_t *)(p))
+#define vec_splat(c) vdupq_n_u8((uint8_t)(c))
+#define vec_zero() vdupq_n_u8(0)
+#define vec_and(a, b) vandq_u8(a, b)
+#define vec_or(a, b) vorrq_u8(a, b)
+#define vec_xor(a, b) veorq_u8(a, b)
+#define vec_eq(a, b) vceqq_u8(a, b)
+#define vec_subs(a, b) vqsubq_u8(a, b)
+#define vec_high_nibble(v) vshrq_n_u8(v, 4)
+#define vec_lookup(table, idx) vqtbl1q_u8(table, idx)
+#define vec_prev(v, prev, n) vextq_u8(prev, v, 16 - (n))
+#define vec_any(v) (vmaxvq_u8(v) != 0)
+#define vec_any_high(v) (vmaxvq_u8(v) >= 0x80)
+
+#endif
+
+TARGET static inline vec check_vec(vec input, vec prev_input,
+                                   vec table1, vec table2, vec table3) {
+  vec prev1 = vec_prev(input, prev_input, 1);
+  vec special =
+    vec_and(vec_and(vec_lookup(table1, vec_high_nibble(prev1)),
+                    vec_lookup(table2, vec_and(prev1, vec_splat(0xf)))),
+            vec_lookup(table3, vec_high_nibble(input)));
+  vec third = vec_subs(vec_prev(input, prev_input, 2), vec_splat(0xe0 - 0x80));
+  vec fourth = vec_subs(vec_prev(input, prev_input, 3), vec_splat(0xf0 - 0x80));
+  vec must_continue = vec_and(vec_or(third, fourth), vec_splat(0x80));
+  // valid utf8 but an upper control: 0xc2 0x80-0x9f
+  vec upper = vec_and(vec_eq(prev1, vec_splat(0xc2)),
+                      vec_eq(vec_and(input, vec_splat(0xe0)), vec_splat(0x80)));
+  return vec_or(vec_xor(must_continue, special), upper);
+}
+
+// Returns the end of the last clean 64 byte block.
+TARGET static size_t clean_blocks(const char *p, size_t len) {
+  vec table1 = vec_load(byte_1_high);
+  vec table2 = vec_load(byte_1_low);
+  vec table3 = vec_load(byte_2_high);
+  vec max = vec_load(incomplete_max);
+  vec prev = vec_zero();
+  vec prev_incomplete = vec_zero();
+  size_t i;
+  for (i = 0; i + 64 <= len; i += 64) {
+    vec a = vec_load(p + i);
+    vec b = vec_load(p + i + 16);
+    vec c = vec_load(p + i + 32);
+    vec d = vec_load(p + i + 48);
+    vec error;
+    if (!vec_any_high(vec_or(vec_or(a, b), vec_or(c, d)))) {
+      error = prev_incomplete;
+      prev_incomplete = vec_zero();
+    } else {
+      error = vec_or(vec_or(check_vec(a, prev, table1, table2, table3),
+                            check_vec(b, a, table1, table2, table3)),
+                     vec_or(check_vec(c, b, table1, table2, table3),
+                            check_vec(d, c, table1, table2, table3)));
+      prev_incomplete = vec_subs(d, max);
+    }
+    prev = d;
+    if (vec_any(error)) break;
+  }
+  return i;
+}
+
+static size_t simd_prefix(const char *p, size_t len) {
+#if defined(UTF8_SSSE3)
+  static int have_ssse3 = -1;
+  if (have_ssse3 < 0)
+    have_ssse3 = __builtin_cpu_supports("ssse3");
+  if (!have_ssse3)
+    return 0;
+#endif
+  size_t end = clean_blocks(p, len);
+  // a block may end in a sequence whose continuation was only checked
+  // against the following block
+  for (int k = 1; k <= 3 && k <= end; k++) {
+    int ch = p[end - k] & 255;
+    if (!(ch & 0x80))
+      break;
+    if (ch & 0x40) {
+      int n = ch >= 0xf0 ? 4 : ch >= 0xe0 ? 3 : 2;
+      if (n > k)
+        end -= k;
+      break;
+    }
+  }
+  return end;
+}
+
+#else
+
+static size_t simd_prefix(const char *p, size_t len) {
+  return 0;
+}
+
+#endif
+
+size_t utf8_valid_prefix(const char *p, size_t len) {
+  size_t i = simd_prefix(p, len);
+  while (i < len) {
+    if (i + 8 <= len) {
+      uint64_t word;
+      memcpy(&word, p + i, 8);
+      if (!(word & 0x8080808080808080ULL)) {
+        i += 8;
+        continue;
+      }
+    }
+    if (!(p[i] & 0x80)) {
+      i++;
+      continue;
+    }
+    int n;
+    if (utf8_sequence(p + i, len - i, 0, &n) != UTF8_VALID)
+      break;
+    i += n;
+  }
+  return i;
+}
+
+size_t utf8_find_bad(const char *p, size_t len, int final,
+                     enum utf8_class *cls, int *bad_len) {
+  size_t i = utf8_valid_prefix(p, len);
+  if (i < len) {
+    *cls = utf8_sequence(p + i, len - i, final, bad_len);
+  } else {
+    *cls = UTF8_VALID;
+    *bad_len = 0;
+  }
+  return i;
+}
@@ -0,0 +1,32 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <stddef.h>
+
+enum utf8_class {
+  UTF8_VALID,
+  UTF8_UPPER_CONTROL,        // valid encoding of 0x80-0x9f
+  UTF8_OVERLONG,
+  UTF8_ORPHAN_CONTINUATION,
+  UTF8_MISSING_CONTINUATION,
+  UTF8_ILLEGAL,              // 0xf5-0xff, surrogates, above 0x10ffff
+  UTF8_INCOMPLETE,           // cut short by the end of a non-final buffer
+};
+
+// Length of the longest prefix of p made of whole valid sequences, none of
+// them an upper control.  Clean blocks are checked 64 bytes at a time.
+size_t utf8_valid_prefix(const char *p, size_t len);
+
+// Classifies the single sequence at the start of p, len > 0, and stores its
+// length in bytes.  A bad sequence covers its leading byte and the
+// continuation bytes that were present.  If final is not set, a sequence
+// running past len is UTF8_INCOMPLETE instead of a missing continuation.
+enum utf8_class utf8_sequence(const char *p, size_t len, int final,
+                              int *seq_len);
+
+// Returns the offset of the first sequence in p that is not UTF8_VALID and
+// classifies it, or returns len with class UTF8_VALID if there is none.
+size_t utf8_find_bad(const char *p, size_t len, int final,
+                     enum utf8_class *cls, int *bad_len);
+
+#endif
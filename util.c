@@ -0,0 +1,95 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+int use_color = 0;
+
+char *foreground_red = "\033[31m";
+char *foreground_green = "\033[32m";
+char *foreground_yellow = "\033[33m";
+char *foreground_reset = "\033[39m";
+char *attribute_reset = "\033[0m";
+char *bold = "\033[1m";
+
+void color_vprintf(char *color, char *fmt, va_list ap) {
+  if (use_color) fprintf(stderr, "%s", color);
+  vfprintf(stderr, fmt, ap);
+  if (use_color) fprintf(stderr, "%s", foreground_reset);
+}
+
+void err_vprintf(char *fmt, va_list ap) {
+  color_vprintf(foreground_red, fmt, ap);
+}
+
+void info_vprintf(char *fmt, va_list ap) {
+  color_vprintf(foreground_green, fmt, ap);
+}
+
+void warn_vprintf(char *fmt, va_list ap) {
+  color_vprintf(foreground_yellow, fmt, ap);
+}
+
+void err_printf(char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  err_vprintf(fmt, ap);
+  va_end(ap);
+}
+
+void info_printf(char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  info_vprintf(fmt, ap);
+  va_end(ap);
+}
+
+void warn_printf(char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  warn_vprintf(fmt, ap);
+  va_end(ap);
+}
+
+void errno_printf(char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  err_vprintf(fmt, ap);
+  va_end(ap);
+  err_printf(": %s (%d)\n", strerror(errno), errno);
+  exit(errno);
+}
+
+void exit_printf(char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  err_vprintf(fmt, ap);
+  va_end(ap);
+  exit(1);
+}
+
+long str2long(char *str) {
+  char *end;
+  long res = strtol(str, &end, 10);
+  if (!*str || *end)
+    exit_printf("cannot convert \"%s\" to long\n", str);
+  return res;
+}
+
+int file4read(char *name) {
+  int fd = open(name, O_RDONLY);
+  if (fd == -1)
+    errno_printf("cannot open file \"%s\"", name);
+  return fd;
+}
+
+void *allocate(size_t size) {
+  char *res = malloc(size);
+  if (!res)
+    exit_printf("cannot allocate %zu bytes\n", size);
+  return res;
+}
@@ -0,0 +1,35 @@
+#ifndef UTIL_H
+#define UTIL_H
+
+#include <stdarg.h>
+#include <stddef.h>
+
+// Messages to stderr, in color if the tool sets use_color.  errno_printf()
+// and exit_printf() exit, as do the others below when they fail.
+
+extern int use_color;
+
+extern char *foreground_red;
+extern char *foreground_green;
+extern char *foreground_yellow;
+extern char *foreground_reset;
+extern char *attribute_reset;
+extern char *bold;
+
+void color_vprintf(char *color, char *fmt, va_list ap);
+void err_vprintf(char *fmt, va_list ap);
+void info_vprintf(char *fmt, va_list ap);
+void warn_vprintf(char *fmt, va_list ap);
+void err_printf(char *fmt, ...);
+void info_printf(char *fmt, ...);
+void warn_printf(char *fmt, ...);
+
+// Appends strerror(errno) to the message and exits with errno.
+void errno_printf(char *fmt, ...);
+void exit_printf(char *fmt, ...);
+
+long str2long(char *str);
+int file4read(char *name);
+void *allocate(size_t size);
+
+#endif
@@ -0,0 +1,278 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "timing.h"
+#include "walk.h"
+
+// what getdents64 fills its buffer with
+struct dirent64_raw {
+  uint64_t ino;
+  int64_t off;
+  unsigned short reclen;
+  unsigned char type;
+  char name[];
+};
+
+// Makes room for need elements of size bytes in *p.
+static int grow(void **p, size_t *cap, size_t need, size_t size) {
+  if (need <= *cap) return 0;
+  size_t n = *cap ? 2 * *cap : 256;
+  while (n < need)
+    n *= 2;
+  void *q = realloc(*p, n * size);
+  if (!q) return -1;
+  *p = q;
+  *cap = n;
+  return 0;
+}
+
+static char *join(const char *dir, const char *name) {
+  size_t dir_len = strlen(dir), name_len = strlen(name);
+  int slash = dir_len && dir[dir_len - 1] != '/';
+  char *path = malloc(dir_len + slash + name_len + 1);
+  if (!path) return 0;
+  memcpy(path, dir, dir_len);
+  path[dir_len] = '/';
+  memcpy(path + dir_len + slash, name, name_len + 1);
+  return path;
+}
+
+// A thread keeps the files it finds to itself until it is done, and the
+// directories until it is done with the one they are in.
+struct walker {
+  struct walk *w;
+  pthread_t thread;
+  struct walk_file *files;
+  size_t count;
+  size_t cap;
+  char **dirs;
+  size_t dir_count;
+  size_t dir_cap;
+  int failed;
+};
+
+static void add_error(struct walk *w, char *name, int error) {
+  pthread_mutex_lock(&w->lock);
+  if (grow((void **)&w->errors, &w->error_cap, w->error_count + 1,
+           sizeof(struct walk_error))) {
+    w->failed = 1;
+    free(name);
+  } else {
+    w->errors[w->error_count].name = name;
+    w->errors[w->error_count++].error = error;
+  }
+  pthread_mutex_unlock(&w->lock);
+}
+
+static void add_file(struct walker *t, char *name, uint64_t size,
+                     int named) {
+  if (grow((void **)&t->files, &t->cap, t->count + 1,
+           sizeof(struct walk_file))) {
+    t->failed = 1;
+    free(name);
+    return;
+  }
+  t->files[t->count].name = name;
+  t->files[t->count].size = size;
+  t->files[t->count++].named = named;
+}
+
+static void add_dir(struct walker *t, char *name) {
+  if (grow((void **)&t->dirs, &t->dir_cap, t->dir_count + 1,
+           sizeof(char *))) {
+    t->failed = 1;
+    free(name);
+    return;
+  }
+  t->dirs[t->dir_count++] = name;
+}
+
+static int skipped(struct walk *w, const char *name) {
+  if (!w->skip) return 0;
+  size_t len = strlen(name), skip_len = strlen(w->skip);
+  return len >= skip_len && !strcmp(name + len - skip_len, w->skip);
+}
+
+// Entries whose type the file system does not give are looked at, and so
+// are regular files if their size is wanted; nothing else needs more than
+// the entry.  Takes path.
+static void read_dir(struct walker *t, char *path) {
+  int fd = open(*path ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) {
+    add_error(t->w, path, errno);
+    return;
+  }
+  uint64_t buffer[4096];
+  while (1) {
+    timing_syscall();
+    long n = syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+    if (n == -1 && errno == EINTR) continue;
+    if (n == -1) {
+      char *name = strdup(path);
+      if (name)
+        add_error(t->w, name, errno);
+    }
+    if (n <= 0) break;
+    for (long pos = 0; pos < n;) {
+      struct dirent64_raw *d = (struct dirent64_raw *)((char *)buffer + pos);
+      pos += d->reclen;
+      if (!strcmp(d->name, ".") || !strcmp(d->name, ".."))
+        continue;
+      int type = d->type;
+      struct stat st;
+      st.st_size = 0;
+      if (type == DT_UNKNOWN || (type == DT_REG && t->w->by_size)) {
+        // gone in the meantime
+        if (fstatat(fd, d->name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+          continue;
+        type = S_ISDIR(st.st_mode) ? DT_DIR :
+          S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+      }
+      if (type != DT_DIR && type != DT_REG)
+        continue;
+      if (type == DT_REG && skipped(t->w, d->name))
+        continue;
+      char *name = join(path, d->name);
+      if (!name)
+        t->failed = 1;
+      else if (type == DT_DIR)
+        add_dir(t, name);
+      else
+        add_file(t, name, t->w->by_size ? st.st_size : 0, 0);
+    }
+  }
+  close(fd);
+  free(path);
+}
+
+// The walk is over when no directory is left and no thread is reading one
+// that may have more.
+static void *walk_thread(void *arg) {
+  struct walker *t = arg;
+  struct walk *w = t->w;
+  pthread_mutex_lock(&w->lock);
+  while (1) {
+    while (!w->dir_count && w->busy)
+      pthread_cond_wait(&w->cond, &w->lock);
+    if (!w->dir_count) break;
+    char *path = w->dirs[--w->dir_count];
+    w->busy++;
+    pthread_mutex_unlock(&w->lock);
+    read_dir(t, path);
+    pthread_mutex_lock(&w->lock);
+    w->busy--;
+    if (grow((void **)&w->dirs, &w->dir_cap, w->dir_count + t->dir_count,
+             sizeof(char *))) {
+      w->failed = 1;
+      for (size_t i = 0; i < t->dir_count; i++)
+        free(t->dirs[i]);
+    } else {
+      memcpy(w->dirs + w->dir_count, t->dirs, t->dir_count * sizeof(char *));
+      w->dir_count += t->dir_count;
+    }
+    if (t->dir_count || !w->busy)
+      pthread_cond_broadcast(&w->cond);
+    t->dir_count = 0;
+  }
+  if (grow((void **)&w->files, &w->cap, w->count + t->count,
+           sizeof(struct walk_file))) {
+    w->failed = 1;
+    for (size_t i = 0; i < t->count; i++)
+      free(t->files[i].name);
+  } else {
+    memcpy(w->files + w->count, t->files, t->count * sizeof(struct walk_file));
+    w->count += t->count;
+  }
+  w->failed |= t->failed;
+  pthread_mutex_unlock(&w->lock);
+  free(t->files);
+  free(t->dirs);
+  return 0;
+}
+
+// biggest first, then by name, so that the order does not depend on the
+// threads
+static int compare_files(const void *a, const void *b) {
+  const struct walk_file *x = a, *y = b;
+  if (x->size != y->size)
+    return x->size > y->size ? -1 : 1;
+  return strcmp(x->name, y->name);
+}
+
+int walk_paths(struct walk *w, char **paths, int count, int threads,
+               const char *skip, int by_size) {
+  memset(w, 0, sizeof(*w));
+  w->skip = skip;
+  w->by_size = by_size;
+  pthread_mutex_init(&w->lock, 0);
+  pthread_cond_init(&w->cond, 0);
+  struct walker *walkers = calloc(threads, sizeof(struct walker));
+  if (!walkers)
+    w->failed = 1;
+  for (int i = 0; i < count && walkers; i++) {
+    struct stat st;
+    int found = stat(*paths[i] ? paths[i] : ".", &st) != -1;
+    char *name = strdup(paths[i]);
+    if (!name)
+      w->failed = 1;
+    else if (found && S_ISDIR(st.st_mode))
+      add_dir(walkers, name);
+    else
+      add_file(walkers, name,
+               by_size && found && S_ISREG(st.st_mode) ? st.st_size : 0, 1);
+  }
+  // the roots go in like the directories of a first one read
+  if (walkers) {
+    w->dirs = walkers->dirs;
+    w->dir_count = walkers->dir_count;
+    w->dir_cap = walkers->dir_cap;
+    walkers->dirs = 0;
+    walkers->dir_count = walkers->dir_cap = 0;
+  }
+  int started = 0;
+  int error = 0;
+  for (int i = 0; i < threads && walkers; i++) {
+    walkers[i].w = w;
+    if (!i) continue;
+    error = pthread_create(&walkers[i].thread, 0, walk_thread, walkers + i);
+    if (error) break;
+    started++;
+  }
+  if (walkers)
+    walk_thread(walkers);
+  for (int i = 1; i <= started; i++)
+    pthread_join(walkers[i].thread, 0);
+  free(walkers);
+  for (size_t i = 0; i < w->dir_count; i++)
+    free(w->dirs[i]);
+  free(w->dirs);
+  pthread_mutex_destroy(&w->lock);
+  pthread_cond_destroy(&w->cond);
+  if (error || w->failed) {
+    walk_free(w);
+    errno = error ? error : ENOMEM;
+    return -1;
+  }
+  qsort(w->files, w->count, sizeof(struct walk_file), compare_files);
+  return 0;
+}
+
+void walk_free(struct walk *w) {
+  for (size_t i = 0; i < w->count; i++)
+    free(w->files[i].name);
+  free(w->files);
+  for (size_t i = 0; i < w->error_count; i++)
+    free(w->errors[i].name);
+  free(w->errors);
+  w->files = 0;
+  w->errors = 0;
+  w->count = w->error_count = 0;
+}
@@ -0,0 +1,62 @@
+#ifndef WALK_H
+#define WALK_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Lists the regular files under directories for -R, read with getdents64
+// by a number of threads that take directories from a shared stack, each
+// as soon as it is done with the last.  Symbolic links under a directory
+// are not followed.  The list comes in name order, or biggest file first
+// for a tool that scans files in parallel, so that it starts the long
+// scans early and is not left with one at the end.
+
+struct walk_file {
+  char *name;
+  uint64_t size;             // 0 unless by size
+  int named;                 // one of the paths, not found under one
+};
+
+// a directory that could not be read
+struct walk_error {
+  char *name;
+  int error;
+};
+
+struct walk {
+  struct walk_file *files;
+  size_t count;
+  size_t cap;
+  struct walk_error *errors;
+  size_t error_count;
+  size_t error_cap;
+
+  // the threads
+  char **dirs;               // still to read
+  size_t dir_count;
+  size_t dir_cap;
+  const char *skip;
+  int by_size;
+  int busy;                  // threads reading a directory
+  int failed;                // out of memory
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+// Lists the files under each of paths[0..count), with threads threads.
+// A path that is not a directory is listed as it is, whatever it is, and
+// so is one that does not exist, for the tool to tell, both as named.
+// Directories that cannot be read are left out and listed in errors.  An
+// empty path stands for the current directory, with names that do not
+// start with "./".
+// Files under a directory with names that end in skip are left out, unless
+// it is NULL.  If by_size is set, each file is looked at for its size, at
+// the cost of a system call.  Returns -1 with errno set if out of memory or
+// if a thread cannot be created.
+int walk_paths(struct walk *w, char **paths, int count, int threads,
+               const char *skip, int by_size);
+
+void walk_free(struct walk *w);
+
+#endif